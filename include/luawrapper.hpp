@@ -17,11 +17,17 @@
 //  luaW_to<T>
 //  luaW_check<T>
 //  luaW_push<T>
+//  luaW_pushshared<T>
+//  luaW_checkshared<T>
 //  luaW_register<T>
 //  luaW_setfuncs<T>
 //  luaW_extend<T, U>
+//  luaW_flatten<T>
 //  luaW_hold<T>
 //  luaW_release<T>
+//  luaW_invalidate<T>
+//  luaW_deferdestruction<T>
+//  luaW_trackmemory<T>
 //
 // These functions allow you to manipulate arbitrary classes just like you
 // would the primitive types (e.g. numbers or strings). If you are familiar
@@ -33,7 +39,19 @@
 #ifndef LUA_WRAPPER_H_
 #define LUA_WRAPPER_H_
 
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
 #include <type_traits>
+#include <unordered_map>
+#include <vector>
 
 // If you are linking against Lua compiled in C++, define LUAW_NO_EXTERN_C
 #ifndef LUAW_NO_EXTERN_C
@@ -49,6 +67,7 @@ extern "C" {
 
 #define LUAW_POSTCTOR_KEY "__postctor"
 #define LUAW_EXTENDS_KEY "__extends"
+#define LUAW_FLATTENED_KEY "__flattened"
 #define LUAW_STORAGE_KEY "storage"
 #define LUAW_CACHE_KEY "cache"
 #define LUAW_CACHE_METATABLE_KEY "cachemetatable"
@@ -60,6 +79,15 @@ extern "C" {
 // after pushing or popping things off the stack
 inline int luaW_correctindex(lua_State* L, int index, int correction) { return index < 0 ? index - correction : index; }
 
+// The raw length of the table or userdata at the given index
+inline size_t luaW_rawlen(lua_State* L, int index) {
+#if LUA_VERSION_NUM >= 502
+  return lua_rawlen(L, index);
+#else
+  return lua_objlen(L, index);
+#endif
+}
+
 // These are the default allocator and deallocator. If you would prefer an
 // alternative option, you may select a different function when registering
 // your class.
@@ -75,25 +103,160 @@ void luaW_defaultdeallocator(lua_State*, T* obj) {
 // The identifier function is responsible for pushing a value unique to each
 // object on to the stack. Most of the time, this can simply be the address
 // of the pointer, but sometimes that is not adequate. For example, if you
-// are using shared_ptr you would need to push the address of the object the
-// shared_ptr represents, rather than the address of the shared_ptr itself.
+// are using your own smart pointer type you would need to push the address of
+// the object it represents, rather than the address of the smart pointer
+// itself. (std::shared_ptr is supported directly through luaW_pushshared.)
 template <typename T>
 void luaW_defaultidentifier(lua_State* L, T* obj) {
   lua_pushlightuserdata(L, const_cast<std::remove_const_t<T>*>(obj));
 }
 
+// A (slot, generation) pair identifying an object. Slots are handed out from a
+// per-type slot map and reused once their object is destroyed, and the
+// generation is bumped every time that happens, so no two objects ever share a
+// handle.
+struct luaW_Handle {
+  uint32_t slot;
+  uint32_t generation;
+};
+
+// The slot map that hands out handles for objects deriving from
+// luaW_Handled<H>. Slots start at 1 so that they can index Lua arrays directly.
+// It is shared by every thread. Handing out and giving back slots is guarded by
+// a mutex, but the generations are atomics kept in fixed-size chunks that are
+// never moved or freed, so current can read them without taking the lock.
+template <typename H>
+class luaW_HandleMap {
+ public:
+  static luaW_Handle acquire() {
+    std::lock_guard<std::mutex> lock(mutex());
+    std::vector<uint32_t>& slots = freeslots();
+    luaW_Handle handle;
+    if (slots.empty()) {
+      uint32_t slot = size() + 1;
+      if (slot / kChunkSize >= kMaxChunks) throw std::bad_alloc();
+      std::atomic<std::atomic<uint32_t>*>& chunk = chunks()[slot / kChunkSize];
+      if (!chunk.load(std::memory_order_relaxed)) {
+        chunk.store(new std::atomic<uint32_t>[kChunkSize](), std::memory_order_release);
+      }
+      chunk.load(std::memory_order_relaxed)[slot % kChunkSize].store(1, std::memory_order_release);
+      size() = slot;
+      handle.slot = slot;
+    } else {
+      handle.slot = slots.back();
+      slots.pop_back();
+    }
+    handle.generation = generation(handle.slot).load(std::memory_order_relaxed);
+    return handle;
+  }
+
+  static void release(const luaW_Handle& handle) {
+    std::lock_guard<std::mutex> lock(mutex());
+    generation(handle.slot).fetch_add(1, std::memory_order_release);
+    freeslots().push_back(handle.slot);
+  }
+
+  // Returns true if the object the handle was given to has not been destroyed.
+  static bool current(const luaW_Handle& handle) {
+    return generation(handle.slot).load(std::memory_order_acquire) == handle.generation;
+  }
+
+  // The address of this is used as the registry key for the generations each
+  // lua_State has seen. This is only used internally.
+  static void* key() {
+    static char k;
+    return &k;
+  }
+
+ private:
+  static const uint32_t kChunkSize = 4096;
+  static const uint32_t kMaxChunks = 16384;
+
+  static std::atomic<uint32_t>& generation(uint32_t slot) {
+    return chunks()[slot / kChunkSize].load(std::memory_order_acquire)[slot % kChunkSize];
+  }
+
+  static std::mutex& mutex() {
+    static std::mutex m;
+    return m;
+  }
+  static std::atomic<std::atomic<uint32_t>*>* chunks() {
+    static std::atomic<std::atomic<uint32_t>*> c[kMaxChunks];
+    return c;
+  }
+  static uint32_t& size() {
+    static uint32_t n = 0;
+    return n;
+  }
+  static std::vector<uint32_t>& freeslots() {
+    static std::vector<uint32_t> slots;
+    return slots;
+  }
+};
+
+// Deriving from luaW_Handled<H> gives each object a handle from the slot map
+// for H, which luaW_handleidentifier uses instead of the object's address.
+// Copies get a handle of their own. The handle is also recorded in the
+// userdata, so an object destroyed from C++ without telling Lua is seen as
+// disposed rather than read after it was freed.
+template <typename H>
+class luaW_Handled {
+ public:
+  luaW_Handled() : luaW_handle(luaW_HandleMap<H>::acquire()) {}
+  luaW_Handled(const luaW_Handled&) : luaW_handle(luaW_HandleMap<H>::acquire()) {}
+  luaW_Handled& operator=(const luaW_Handled&) { return *this; }
+  ~luaW_Handled() { luaW_HandleMap<H>::release(luaW_handle); }
+
+  const luaW_Handle luaW_handle;
+};
+
 // This class is what is used by LuaWrapper to contain the userdata. data
 // stores a pointer to the object itself, and cast is used to cast toward the
 // base class if there is one and it is necessary. Rather than use RTTI and
 // typid to compare types, I use the clever trick of using the cast to compare
 // types. Because there is at most one cast per type, I can use it to identify
-// when and object is the type I want. This is only used internally.
+// when and object is the type I want. shared is set when the userdata block
+// is actually a luaW_SharedUserdata. For objects deriving from luaW_Handled,
+// handle is the object's handle and current checks it against the slot map;
+// otherwise current is NULL. functions is set once a function has been stored
+// in the object's storage table. This is only used internally.
 struct luaW_Userdata {
-  luaW_Userdata(void* vptr = NULL, luaW_Userdata (*udcast)(const luaW_Userdata&) = NULL) : data(vptr), cast(udcast) {}
+  luaW_Userdata(void* vptr = NULL, luaW_Userdata (*udcast)(const luaW_Userdata&) = NULL, bool udshared = false) : data(vptr), cast(udcast), shared(udshared), functions(false), handle(), current(NULL) {}
   void* data;
   luaW_Userdata (*cast)(const luaW_Userdata&);
+  bool shared;
+  bool functions;
+  luaW_Handle handle;
+  bool (*current)(const luaW_Handle&);
 };
 
+// The userdata block used for objects pushed with luaW_pushshared. The
+// shared_ptr lives inside the userdata itself, so the object is kept alive for
+// exactly as long as Lua can reach it, and is released in __gc. The owner is
+// type erased so that luaW_checkshared can hand out a shared_ptr to any base
+// class through the aliasing constructor. This is only used internally.
+struct luaW_SharedUserdata : luaW_Userdata {
+  luaW_SharedUserdata(void* vptr, luaW_Userdata (*udcast)(const luaW_Userdata&), std::shared_ptr<void> udowner) : luaW_Userdata(vptr, udcast, true), owner(std::move(udowner)) {}
+  std::shared_ptr<void> owner;
+};
+
+// Records the handle of an object deriving from luaW_Handled in a new userdata.
+// Other objects have nothing to record. This is only used internally.
+inline void luaW_recordhandle(luaW_Userdata*, const void*) {}
+
+template <typename H>
+void luaW_recordhandle(luaW_Userdata* pud, const luaW_Handled<H>* obj) {
+  pud->handle = obj->luaW_handle;
+  pud->current = luaW_HandleMap<H>::current;
+}
+
+// Marks a userdata as disposed if its object has been destroyed since it was
+// pushed, which is only known for objects deriving from luaW_Handled. This is
+// only used internally.
+inline void luaW_validate(luaW_Userdata* pud) {
+  if (pud->data && pud->current && !pud->current(pud->handle)) pud->data = NULL;
+}
+
 // This class cannot actually to be instantiated. It is used only hold the
 // table name and other information.
 template <typename T>
@@ -104,7 +267,7 @@ class LuaWrapper {
   static T* (*allocator)(lua_State*);
   static void (*deallocator)(lua_State*, T*);
   static luaW_Userdata (*cast)(const luaW_Userdata&);
-  static void (*postconstructorrecurse)(lua_State* L, int numargs);
+  static void (*postconstructorrecurse)(lua_State* L, int list);
 
  private:
   LuaWrapper();
@@ -115,7 +278,7 @@ template <typename T> void (*LuaWrapper<T>::identifier)(lua_State*, T*);
 template <typename T> T* (*LuaWrapper<T>::allocator)(lua_State*);
 template <typename T> void (*LuaWrapper<T>::deallocator)(lua_State*, T*);
 template <typename T> luaW_Userdata (*LuaWrapper<T>::cast)(const luaW_Userdata&);
-template <typename T> void (*LuaWrapper<T>::postconstructorrecurse)(lua_State* L, int numargs);
+template <typename T> void (*LuaWrapper<T>::postconstructorrecurse)(lua_State* L, int list);
 // clang-format on
 
 // Cast from an object of type T to an object of type U. This template
@@ -171,11 +334,13 @@ bool luaW_is(lua_State* L, int index, bool strict = false) {
 // Analogous to lua_to(boolean|string|*)
 //
 // Converts the given acceptable index to a T*. That value must be of (or
-// convertible to) type T; otherwise, returns NULL.
+// convertible to) type T; otherwise, returns NULL. Objects that have been
+// disposed also return NULL.
 template <typename T>
 T* luaW_to(lua_State* L, int index, bool strict = false) {
   if (luaW_is<T>(L, index, strict)) {
     luaW_Userdata* pud = static_cast<luaW_Userdata*>(lua_touserdata(L, index));
+    luaW_validate(pud);
     luaW_Userdata ud;
     while (!strict && LuaWrapper<T>::cast != pud->cast) {
       ud = pud->cast(*pud);
@@ -189,18 +354,24 @@ T* luaW_to(lua_State* L, int index, bool strict = false) {
 // Analogous to luaL_check(boolean|string|*)
 //
 // Converts the given acceptable index to a T*. That value must be of (or
-// convertible to) type T; otherwise, an error is raised.
+// convertible to) type T, and must not have been disposed; otherwise, an error
+// is raised.
 template <typename T>
 T* luaW_check(lua_State* L, int index, bool strict = false) {
   T* obj = NULL;
   if (luaW_is<T>(L, index, strict)) {
     luaW_Userdata* pud = static_cast<luaW_Userdata*>(lua_touserdata(L, index));
+    luaW_validate(pud);
     luaW_Userdata ud;
     while (!strict && LuaWrapper<T>::cast != pud->cast) {
       ud = pud->cast(*pud);
       pud = &ud;
     }
     obj = (T*)pud->data;
+    if (!obj) {
+      const char* msg = lua_pushfstring(L, "%s expected, got disposed %s", LuaWrapper<T>::classname, LuaWrapper<T>::classname);
+      luaL_argerror(L, index, msg);
+    }
   } else {
     const char* msg = lua_pushfstring(L, "%s expected, got %s", LuaWrapper<T>::classname, luaL_typename(L, index));
     luaL_argerror(L, index, msg);
@@ -217,6 +388,39 @@ T* luaW_opt(lua_State* L, int index, T* fallback = NULL, bool strict = false) {
   }
 }
 
+// Pushes the userdata that represents obj. If this object already exists in
+// the Lua environment the cached userdata is pushed and false is returned.
+// Otherwise a new userdata of udsize bytes is created, given T's metatable,
+// initialized by calling init on its memory, and placed in the cache. The
+// metatable is set before init runs and nothing that can raise an error comes
+// between the two, so whatever init stores is always released by __gc. This is
+// only used internally.
+template <typename T, typename Init>
+bool luaW_pushuserdata(lua_State* L, T* obj, size_t udsize, Init init) {
+  LuaWrapper<T>::identifier(L, obj);        // ... id
+  luaW_wrapperfield<T>(L, LUAW_CACHE_KEY);  // ... id cache
+  lua_pushvalue(L, -2);                     // ... id cache id
+  lua_gettable(L, -2);                      // ... id cache obj
+  if (lua_isnil(L, -1)) {
+    // Create the new luaW_userdata and place it in the cache
+    lua_pop(L, 1);                                   // ... id cache
+    lua_insert(L, -2);                               // ... cache id
+    void* ud = lua_newuserdata(L, udsize);           // ... cache id obj
+    luaL_getmetatable(L, LuaWrapper<T>::classname);  // ... cache id obj mt
+    lua_setmetatable(L, -2);                         // ... cache id obj
+    init(ud);
+    lua_pushvalue(L, -1);  // ... cache id obj obj
+    lua_insert(L, -4);     // ... obj cache id obj
+    lua_settable(L, -3);   // ... obj cache
+    lua_pop(L, 1);         // ... obj
+    return true;
+  } else {
+    lua_replace(L, -3);  // ... obj cache
+    lua_pop(L, 1);       // ... obj
+    return false;
+  }
+}
+
 // Analogous to lua_push(boolean|string|*)
 //
 // Pushes a userdata of type T onto the stack. If this object already exists in
@@ -225,34 +429,315 @@ T* luaW_opt(lua_State* L, int index, T* fallback = NULL, bool strict = false) {
 template <typename T>
 void luaW_push(lua_State* L, T* obj) {
   if (obj) {
-    LuaWrapper<T>::identifier(L, obj);        // ... id
-    luaW_wrapperfield<T>(L, LUAW_CACHE_KEY);  // ... id cache
-    lua_pushvalue(L, -2);                     // ... id cache id
-    lua_gettable(L, -2);                      // ... id cache obj
-    if (lua_isnil(L, -1)) {
-      // Create the new luaW_userdata and place it in the cache
-      lua_pop(L, 1);                                                                               // ... id cache
-      lua_insert(L, -2);                                                                           // ... cache id
-      luaW_Userdata* ud = static_cast<luaW_Userdata*>(lua_newuserdata(L, sizeof(luaW_Userdata)));  // ... cache id obj
-      ud->data = const_cast<std::remove_const_t<T>*>(obj);
-      ud->cast = LuaWrapper<T>::cast;
-      lua_pushvalue(L, -1);  // ... cache id obj obj
-      lua_insert(L, -4);     // ... obj cache id obj
-      lua_settable(L, -3);   // ... obj cache
-
-      luaL_getmetatable(L, LuaWrapper<T>::classname);  // ... obj cache mt
-      lua_setmetatable(L, -3);                         // ... obj cache
-
-      lua_pop(L, 1);  // ... obj
-    } else {
-      lua_replace(L, -3);  // ... obj cache
-      lua_pop(L, 1);       // ... obj
+    luaW_pushuserdata<T>(L, obj, sizeof(luaW_Userdata), [obj](void* ud) {
+      luaW_recordhandle(new (ud) luaW_Userdata(const_cast<std::remove_const_t<T>*>(obj), LuaWrapper<T>::cast), obj);
+    });  // ... obj
+  } else {
+    lua_pushnil(L);
+  }
+}
+
+// Pushes an object owned by a std::shared_ptr. A copy of the shared_ptr is
+// stored inside the userdata itself, so the object is guaranteed to stay alive
+// for as long as Lua can reach it, and the reference is dropped when the
+// userdata is garbage collected. These objects do not go through the holds
+// table and should not be passed to luaW_hold or luaW_release.
+//
+// As with luaW_push, the userdata is cached by the object's identifier (by
+// default obj.get()), so pushing the same object twice yields the same
+// userdata. If the object was previously pushed with luaW_push, that userdata
+// cannot take ownership and an error is raised instead. obj is only copied
+// once the userdata exists, so an error raised while pushing does not leave a
+// reference behind.
+template <typename T>
+void luaW_pushshared(lua_State* L, const std::shared_ptr<T>& obj) {
+  if (obj) {
+    std::remove_const_t<T>* ptr = const_cast<std::remove_const_t<T>*>(obj.get());
+    bool created = luaW_pushuserdata<T>(L, ptr, sizeof(luaW_SharedUserdata), [ptr, &obj](void* ud) {
+      luaW_recordhandle(new (ud) luaW_SharedUserdata(ptr, LuaWrapper<T>::cast, std::const_pointer_cast<std::remove_const_t<T>>(obj)), ptr);
+    });  // ... obj
+    if (!created && !static_cast<luaW_Userdata*>(lua_touserdata(L, -1))->shared) {
+      luaL_error(L, "%s was already pushed without shared ownership", LuaWrapper<T>::classname);
     }
   } else {
     lua_pushnil(L);
   }
 }
 
+// Converts the given acceptable index to a std::shared_ptr<T> that shares
+// ownership with the shared_ptr stored in the userdata. Returns an empty
+// shared_ptr if the value is not of (or convertible to) type T, or if it was
+// not pushed with luaW_pushshared.
+template <typename T>
+std::shared_ptr<T> luaW_toshared(lua_State* L, int index, bool strict = false) {
+  T* obj = luaW_to<T>(L, index, strict);
+  if (obj) {
+    luaW_Userdata* pud = static_cast<luaW_Userdata*>(lua_touserdata(L, index));
+    if (pud->shared) {
+      return std::shared_ptr<T>(static_cast<luaW_SharedUserdata*>(pud)->owner, obj);
+    }
+  }
+  return std::shared_ptr<T>();
+}
+
+// Like luaW_toshared, but raises an error if the value is not a T pushed with
+// luaW_pushshared.
+template <typename T>
+std::shared_ptr<T> luaW_checkshared(lua_State* L, int index, bool strict = false) {
+  T* obj = luaW_check<T>(L, index, strict);
+  luaW_Userdata* pud = static_cast<luaW_Userdata*>(lua_touserdata(L, index));
+  if (!pud->shared) {
+    const char* msg = lua_pushfstring(L, "shared %s expected, got unowned %s", LuaWrapper<T>::classname, LuaWrapper<T>::classname);
+    luaL_argerror(L, index, msg);
+  }
+  return std::shared_ptr<T>(static_cast<luaW_SharedUserdata*>(pud)->owner, obj);
+}
+
+// The bytes charged for the objects held by a lua_State, in total or for one
+// type, along with the most ever charged and the limits set for them. A limit
+// of 0 means there is none.
+struct luaW_MemoryUsage {
+  size_t bytes = 0;
+  size_t objects = 0;
+  size_t peak = 0;
+  size_t softlimit = 0;
+  size_t hardlimit = 0;
+};
+
+// The usage of one type, and how to measure its objects. If every object is
+// charged the same size, it is also kept in fixedsize, so that objects can be
+// checked against the limits before they are allocated.
+struct luaW_TypeMemory : luaW_MemoryUsage {
+  size_t (*measure)(const void*) = NULL;
+  size_t fixedsize = 0;
+};
+
+// The entry that the objects of a registered type are charged to, or NULL if
+// there is none, and how many times an object has to be cast to reach the
+// type of that entry.
+struct luaW_MemoryCharge {
+  luaW_TypeMemory* type;
+  int casts;
+};
+
+// The memory account of a lua_State. A userdata in the registry shares
+// ownership of it with the blocks created by luaW_newarray, which refund it
+// when they are freed, and each tracked type's metatable points at its entry
+// in types. The entry resolved for each registered type is cached in charges
+// by classname until a type is tracked or extended.
+struct luaW_MemoryAccount {
+  luaW_MemoryUsage total;
+  std::map<std::string, luaW_TypeMemory> types;
+  std::unordered_map<const char*, luaW_MemoryCharge> charges;
+};
+
+inline void* luaW_memorykey() {
+  static char key;
+  return &key;
+}
+
+// Drops the state's share of the account when the state is closed. Objects
+// collected after this are simply not refunded. This is only used internally.
+inline int luaW_memoryaccountgc(lua_State* L) {
+  std::shared_ptr<luaW_MemoryAccount>* account = static_cast<std::shared_ptr<luaW_MemoryAccount>*>(lua_touserdata(L, 1));
+  lua_pushlightuserdata(L, luaW_memorykey());  // account key
+  lua_pushnil(L);                              // account key nil
+  lua_rawset(L, LUA_REGISTRYINDEX);            // account
+  account->~shared_ptr();
+  return 0;
+}
+
+// Returns the state's share of its memory account, or NULL if it has none.
+// This is only used internally.
+inline std::shared_ptr<luaW_MemoryAccount>* luaW_sharememoryaccount(lua_State* L) {
+  lua_pushlightuserdata(L, luaW_memorykey());  // ... key
+  lua_rawget(L, LUA_REGISTRYINDEX);            // ... account
+  std::shared_ptr<luaW_MemoryAccount>* account = static_cast<std::shared_ptr<luaW_MemoryAccount>*>(lua_touserdata(L, -1));
+  lua_pop(L, 1);  // ...
+  return account;
+}
+
+// Returns the memory account of the state, or NULL if neither
+// luaW_trackmemory nor luaW_setmemorylimits has been called on it. The totals
+// and the usage of each tracked type can be read from it, for example to size
+// a pool of states from what their scripts really hold.
+inline luaW_MemoryAccount* luaW_memoryaccount(lua_State* L) {
+  std::shared_ptr<luaW_MemoryAccount>* account = luaW_sharememoryaccount(L);
+  return account ? account->get() : NULL;
+}
+
+// Returns the memory account of the state, creating it if there is none yet.
+// This is only used internally.
+inline luaW_MemoryAccount* luaW_openmemoryaccount(lua_State* L) {
+  luaW_MemoryAccount* account = luaW_memoryaccount(L);
+  if (account) return account;
+  void* block = lua_newuserdata(L, sizeof(std::shared_ptr<luaW_MemoryAccount>));  // ... account
+  account = (new (block) std::shared_ptr<luaW_MemoryAccount>(std::make_shared<luaW_MemoryAccount>()))->get();
+  lua_newtable(L);                             // ... account mt
+  lua_pushcfunction(L, luaW_memoryaccountgc);  // ... account mt gc
+  lua_setfield(L, -2, "__gc");                 // ... account mt
+  lua_setmetatable(L, -2);                     // ... account
+  lua_pushlightuserdata(L, luaW_memorykey());  // ... account key
+  lua_insert(L, -2);                           // ... key account
+  lua_rawset(L, LUA_REGISTRYINDEX);            // ...
+  return account;
+}
+
+// Finds the entry that objects of the type registered as classname are
+// charged to by walking up the metatables of the types it extends. This is
+// only used internally.
+inline luaW_MemoryCharge luaW_resolvememory(lua_State* L, const char* classname) {
+  luaW_MemoryCharge charge = {NULL, 0};
+  luaL_getmetatable(L, classname);  // ... mt
+  while (lua_istable(L, -1)) {
+    lua_pushlightuserdata(L, luaW_memorykey());  // ... mt key
+    lua_rawget(L, -2);                           // ... mt type
+    charge.type = static_cast<luaW_TypeMemory*>(lua_touserdata(L, -1));
+    lua_pop(L, 1);  // ... mt
+    if (charge.type || !lua_getmetatable(L, -1)) break;
+
+    // luaW_extend makes the extended type's metatable the __index of this one
+    lua_pushstring(L, "__index");  // ... mt mmt "__index"
+    lua_rawget(L, -2);             // ... mt mmt base
+    lua_replace(L, -3);            // ... base mmt
+    lua_pop(L, 1);                 // ... base
+    ++charge.casts;
+  }
+  lua_pop(L, 1);  // ...
+  return charge;
+}
+
+// Returns the entry that objects of the type registered as classname are
+// charged to in the state's memory account: the type's own if it is tracked,
+// or else that of the nearest type it extends that is, or NULL if there is
+// none. If obj is given, it is cast along the way to the type of the entry.
+// This is only used internally.
+inline luaW_TypeMemory* luaW_typememory(lua_State* L, const char* classname, luaW_Userdata* obj = NULL) {
+  luaW_MemoryAccount* account = classname ? luaW_memoryaccount(L) : NULL;
+  if (!account) return NULL;
+  auto found = account->charges.find(classname);
+  if (found == account->charges.end()) {
+    found = account->charges.emplace(classname, luaW_resolvememory(L, classname)).first;
+  }
+  for (int i = 0; obj && obj->cast && i < found->second.casts; ++i) *obj = obj->cast(*obj);
+  return found->second.type;
+}
+
+template <typename T>
+size_t luaW_defaultsize(const T*) {
+  return sizeof(T);
+}
+
+template <typename T, size_t (*Size)(const T*)>
+size_t luaW_measure(const void* obj) {
+  return Size(static_cast<const T*>(obj));
+}
+
+// Makes this state account for the objects of type T that it holds, charging
+// Size(obj) bytes for each of them when it takes hold of it (sizeof(T) unless
+// a function reporting the object's real footprint is given) and refunding
+// the same amount when the hold is released. Objects that were already held
+// before this was called are not counted.
+//
+// When creating an object through T.new, T.newn or T.newarray would take T's
+// usage, or the state's total, over its soft limit, a garbage collection step
+// is run first. If it would go over the hard limit, a full collection is run,
+// and if that does not free enough, the call raises an error. Without a Size
+// function this is checked before the objects are allocated; otherwise they
+// are measured and destroyed again. Objects held from C++ are counted but never refused.
+// Objects of types extending T that are not tracked themselves are charged to
+// T, measured by Size as a T. Calling this again changes the limits.
+template <typename T, size_t (*Size)(const T*) = luaW_defaultsize<T>>
+void luaW_trackmemory(lua_State* L, size_t softlimit = 0, size_t hardlimit = 0) {
+  if (!LuaWrapper<T>::classname) {
+    luaL_error(L, "attempting to track memory for a type that has not been registered");
+  }
+  luaW_MemoryAccount* account = luaW_openmemoryaccount(L);
+  luaW_TypeMemory& type = account->types[LuaWrapper<T>::classname];
+  type.softlimit = softlimit;
+  type.hardlimit = hardlimit;
+  type.measure = luaW_measure<T, Size>;
+  type.fixedsize = Size == luaW_defaultsize<T> ? sizeof(T) : 0;
+  account->charges.clear();
+  luaL_getmetatable(L, LuaWrapper<T>::classname);  // ... mt
+  lua_pushlightuserdata(L, luaW_memorykey());      // ... mt key
+  lua_pushlightuserdata(L, &type);                 // ... mt key type
+  lua_rawset(L, -3);                               // ... mt
+  lua_pop(L, 1);                                   // ...
+}
+
+// Sets limits on the total bytes charged for all of the tracked types in this
+// state, which apply as the limits of luaW_trackmemory do.
+inline void luaW_setmemorylimits(lua_State* L, size_t softlimit, size_t hardlimit) {
+  luaW_MemoryAccount* account = luaW_openmemoryaccount(L);
+  account->total.softlimit = softlimit;
+  account->total.hardlimit = hardlimit;
+}
+
+// Checks whether size more bytes could be charged to type without going over
+// a hard limit, collecting garbage first as described for luaW_trackmemory.
+// This is only used internally.
+inline bool luaW_admitbytes(lua_State* L, luaW_TypeMemory* type, size_t size) {
+  luaW_MemoryUsage& total = luaW_memoryaccount(L)->total;
+  auto over = [size](const luaW_MemoryUsage& usage, size_t limit) { return limit && usage.bytes + size > limit; };
+  if (over(*type, type->softlimit) || over(total, total.softlimit)) {
+    lua_gc(L, LUA_GCSTEP, 0);
+  }
+  if (over(*type, type->hardlimit) || over(total, total.hardlimit)) {
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    return !over(*type, type->hardlimit) && !over(total, total.hardlimit);
+  }
+  return true;
+}
+
+// Checks whether an object of type T could be created without going over a
+// hard limit before it is allocated, if the type it is charged to charges
+// every object the same size. This is only used internally.
+template <typename T>
+bool luaW_admitmemory(lua_State* L) {
+  luaW_TypeMemory* type = luaW_typememory(L, LuaWrapper<T>::classname);
+  if (!type || !type->fixedsize) return true;
+  return luaW_admitbytes(L, type, type->fixedsize);
+}
+
+// Checks whether the newly allocated obj of type T can be kept without going
+// over a hard limit, if it could not be checked before it was allocated. This
+// is only used internally.
+template <typename T>
+bool luaW_admitmemory(lua_State* L, T* obj) {
+  luaW_Userdata ud(obj, LuaWrapper<T>::cast);
+  luaW_TypeMemory* type = luaW_typememory(L, LuaWrapper<T>::classname, &ud);
+  if (!type || type->fixedsize || !obj) return true;
+  return luaW_admitbytes(L, type, type->measure(ud.data));
+}
+
+// Charges size bytes for the given number of objects to type and to the
+// total of account. This is only used internally.
+inline void luaW_chargememory(luaW_MemoryAccount* account, luaW_TypeMemory* type, size_t size, size_t objects) {
+  for (luaW_MemoryUsage* usage : {static_cast<luaW_MemoryUsage*>(type), &account->total}) {
+    usage->bytes += size;
+    usage->objects += objects;
+    if (usage->bytes > usage->peak) usage->peak = usage->bytes;
+  }
+}
+
+// Takes back what luaW_chargememory charged. This is only used internally.
+inline void luaW_refundbytes(luaW_MemoryAccount* account, luaW_TypeMemory* type, size_t size, size_t objects) {
+  for (luaW_MemoryUsage* usage : {static_cast<luaW_MemoryUsage*>(type), &account->total}) {
+    usage->bytes -= size;
+    usage->objects -= objects;
+  }
+}
+
+// Refunds the bytes recorded in the hold at the given index, if any, to the
+// type registered as classname. This is only used internally.
+inline void luaW_refundmemory(lua_State* L, const char* classname, int index) {
+  if (lua_type(L, index) != LUA_TNUMBER) return;
+  luaW_TypeMemory* type = luaW_typememory(L, classname);
+  if (!type) return;
+  luaW_refundbytes(luaW_memoryaccount(L), type, static_cast<size_t>(lua_tointeger(L, index)), 1);
+}
+
 // Instructs LuaWrapper that it owns the userdata, and can manage its memory.
 // When all references to the object are removed, Lua is free to garbage
 // collect it and delete the object.
@@ -267,11 +752,21 @@ bool luaW_hold(lua_State* L, T* obj) {
   lua_gettable(L, -3);                      // ... holds id hold
   // If it's not held, hold it
   if (!lua_toboolean(L, -1)) {
-    // Apply hold boolean
-    lua_pop(L, 1);             // ... holds id
-    lua_pushboolean(L, true);  // ... holds id true
-    lua_settable(L, -3);       // ... holds
-    lua_pop(L, 1);             // ...
+    lua_pop(L, 1);  // ... holds id
+
+    // The hold is the number of bytes charged for the object if its type is
+    // tracked, and true otherwise
+    luaW_Userdata ud(obj, LuaWrapper<T>::cast);
+    luaW_TypeMemory* type = luaW_typememory(L, LuaWrapper<T>::classname, &ud);
+    if (type) {
+      size_t size = type->measure(ud.data);
+      luaW_chargememory(luaW_memoryaccount(L), type, size, 1);
+      lua_pushinteger(L, static_cast<lua_Integer>(size));  // ... holds id size
+    } else {
+      lua_pushboolean(L, true);  // ... holds id true
+    }
+    lua_settable(L, -3);  // ... holds
+    lua_pop(L, 1);        // ...
     return true;
   }
   lua_pop(L, 3);  // ...
@@ -290,6 +785,10 @@ template <typename T>
 void luaW_release(lua_State* L, int index) {
   luaW_wrapperfield<T>(L, LUAW_HOLDS_KEY);           // ... id ... holds
   lua_pushvalue(L, luaW_correctindex(L, index, 1));  // ... id ... holds id
+  lua_gettable(L, -2);                               // ... id ... holds hold
+  luaW_refundmemory(L, LuaWrapper<T>::classname, -1);
+  lua_pop(L, 1);                                     // ... id ... holds
+  lua_pushvalue(L, luaW_correctindex(L, index, 1));  // ... id ... holds id
   lua_pushnil(L);                                    // ... id ... holds id nil
   lua_settable(L, -3);                               // ... id ... holds
   lua_pop(L, 1);                                     // ... id ...
@@ -302,23 +801,457 @@ void luaW_release(lua_State* L, T* obj) {
   lua_pop(L, 1);                      // ...
 }
 
+// The address of this is used as the registry key for the counter below. This
+// is only used internally.
+inline void* luaW_methodsversionkey() {
+  static char key;
+  return &key;
+}
+
+// A counter, kept in each lua_State, that is bumped whenever a method name
+// might start resolving to a different function for a whole class: a
+// function is assigned to a class metatable, or a type is registered or
+// extended. luaU_MethodRef compares it against the value it saw when it last
+// looked methods up to decide whether its cached functions are still good.
+// Functions stored on individual objects do not bump it; the userdata records
+// that they have them instead (see luaW_Userdata::functions). The counter
+// lives in a userdata in the registry, so the pointer stays valid until the
+// state is closed.
+inline unsigned* luaW_methodsversion(lua_State* L) {
+  lua_pushlightuserdata(L, luaW_methodsversionkey());  // ... key
+  lua_rawget(L, LUA_REGISTRYINDEX);                    // ... version
+  unsigned* version = static_cast<unsigned*>(lua_touserdata(L, -1));
+  lua_pop(L, 1);  // ...
+  if (!version) {
+    version = static_cast<unsigned*>(lua_newuserdata(L, sizeof(unsigned)));  // ... version
+    *version = 1;
+    lua_pushlightuserdata(L, luaW_methodsversionkey());  // ... version key
+    lua_insert(L, -2);                                   // ... key version
+    lua_rawset(L, LUA_REGISTRYINDEX);                    // ...
+  }
+  return version;
+}
+
+// Forces every luaU_MethodRef on this state to look its method up again on its
+// next call. Changes made through LuaWrapper are tracked automatically, as are
+// functions a script adds to a metatable, but if a script replaces a function
+// that is already in a metatable (or rawsets one into an extends chain), this
+// must be called for cached methods to see it.
+inline void luaW_invalidatemethods(lua_State* L) {
+  ++*luaW_methodsversion(L);
+}
+
+// Removes every trace of obj from the Lua state: its hold, storage table and
+// cache entry are cleared, and the cached userdata, if there is one, is marked
+// as disposed (its shared_ptr is dropped if it was pushed with
+// luaW_pushshared). Returns true if Lua was holding the object, in which case
+// it is now up to the caller to destroy it. This is only used internally.
 template <typename T>
-void luaW_postconstructorinternal(lua_State* L, int numargs) {
-  // ... ud args...
+bool luaW_detach(lua_State* L, T* obj) {
+  LuaWrapper<T>::identifier(L, obj);        // ... id
+  luaW_wrapperfield<T>(L, LUAW_HOLDS_KEY);  // ... id holds
+  lua_pushvalue(L, -2);                     // ... id holds id
+  lua_gettable(L, -2);                      // ... id holds hold
+  bool held = lua_toboolean(L, -1) != 0;
+  lua_pop(L, 2);  // ... id
+  luaW_release<T>(L, -1);
+
+  luaW_wrapperfield<T>(L, LUAW_STORAGE_KEY);  // ... id storage
+  lua_pushvalue(L, -2);                       // ... id storage id
+  lua_pushnil(L);                             // ... id storage id nil
+  lua_settable(L, -3);                        // ... id storage
+  lua_pop(L, 1);                              // ... id
+
+  luaW_wrapperfield<T>(L, LUAW_CACHE_KEY);  // ... id cache
+  lua_pushvalue(L, -2);                     // ... id cache id
+  lua_gettable(L, -2);                      // ... id cache ud
+  luaW_Userdata* pud = static_cast<luaW_Userdata*>(lua_touserdata(L, -1));
+  if (pud) {
+    pud->data = NULL;
+    if (pud->shared) static_cast<luaW_SharedUserdata*>(pud)->owner.reset();
+  }
+  lua_pop(L, 1);         // ... id cache
+  lua_pushvalue(L, -2);  // ... id cache id
+  lua_pushnil(L);        // ... id cache id nil
+  lua_settable(L, -3);   // ... id cache
+  lua_pop(L, 2);         // ...
+  return held;
+}
+
+// Tells Lua that obj is about to be (or has just been) destroyed from C++.
+// The userdata representing it is marked as disposed, so any script that still
+// has a reference gets an error from luaW_check instead of touching freed
+// memory, and its storage table is dropped right away instead of lingering
+// until the userdata is collected. If Lua was holding the object, the hold is
+// removed without calling the deallocator. T must be the type the object was
+// pushed as.
+template <typename T>
+void luaW_invalidate(lua_State* L, T* obj) {
+  if (obj) luaW_detach<T>(L, obj);
+}
+
+// Copies the value at the absolute index index in from onto the top of to.
+// Tables are copied recursively, without their metatables; copies is the
+// absolute index of a table in to that maps the tables already copied to
+// their copies, so shared and cyclic references survive. Functions, userdata
+// and threads cannot be copied between states, so if one is found nothing is
+// pushed and false is returned. This is only used internally.
+inline bool luaW_copyvalue(lua_State* from, int index, lua_State* to, int copies) {
+  if (!lua_checkstack(to, 4) || !lua_checkstack(from, 3)) return false;
+  switch (lua_type(from, index)) {
+    case LUA_TNIL:
+      lua_pushnil(to);
+      return true;
+    case LUA_TBOOLEAN:
+      lua_pushboolean(to, lua_toboolean(from, index));
+      return true;
+    case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+      if (lua_isinteger(from, index)) {
+        lua_pushinteger(to, lua_tointeger(from, index));
+        return true;
+      }
+#endif
+      lua_pushnumber(to, lua_tonumber(from, index));
+      return true;
+    case LUA_TSTRING: {
+      size_t len;
+      const char* str = lua_tolstring(from, index, &len);
+      lua_pushlstring(to, str, len);
+      return true;
+    }
+    case LUA_TTABLE: {
+      lua_pushlightuserdata(to, const_cast<void*>(lua_topointer(from, index)));  // ... key
+      lua_rawget(to, copies);                                                    // ... copy
+      if (!lua_isnil(to, -1)) return true;
+      lua_pop(to, 1);                                                            // ...
+      lua_newtable(to);                                                          // ... copy
+      lua_pushlightuserdata(to, const_cast<void*>(lua_topointer(from, index)));  // ... copy key
+      lua_pushvalue(to, -2);                                                     // ... copy key copy
+      lua_rawset(to, copies);                                                    // ... copy
+
+      lua_pushnil(from);  // ... key
+      while (lua_next(from, index)) {
+        // ... key value
+        int top = lua_gettop(from);
+        if (!luaW_copyvalue(from, top - 1, to, copies)) {
+          lua_pop(from, 2);  // ...
+          lua_pop(to, 1);    // ...
+          return false;
+        }
+        if (!luaW_copyvalue(from, top, to, copies)) {
+          lua_pop(from, 2);  // ...
+          lua_pop(to, 2);    // ...
+          return false;
+        }
+        lua_rawset(to, -3);  // ... copy
+        lua_pop(from, 1);    // ... key
+      }
+      return true;
+    }
+    default:
+      return false;
+  }
+}
+
+// Moves obj from the state from to the state to, for example when a session is
+// handed from one worker's state to another's. The object itself stays where
+// it is in memory; what moves is everything Lua knows about it. Its storage
+// table is deep-copied into to, Lua's hold on it (if any) is transferred, and
+// an object pushed with luaW_pushshared keeps its shared ownership. In from,
+// the object's storage, hold and cache entries are dropped and any userdata
+// still referencing it is marked as disposed, as with luaW_invalidate.
+//
+// On success the object's userdata is pushed onto to's stack and true is
+// returned. If T has not been registered in to, or the storage table holds a
+// value that cannot be copied (a function, userdata or thread), nothing is
+// pushed, neither state is changed and false is returned.
+template <typename T>
+bool luaW_transfer(lua_State* from, lua_State* to, T* obj) {
+  if (!obj) return false;
+  luaL_getmetatable(to, LuaWrapper<T>::classname);  // ... mt
+  bool registered = !lua_isnil(to, -1);
+  lua_pop(to, 1);  // ...
+  if (!registered) return false;
+
+  // Copy the storage table, if there is one
+  LuaWrapper<T>::identifier(from, obj);          // ... id
+  luaW_wrapperfield<T>(from, LUAW_STORAGE_KEY);  // ... id storage
+  lua_pushvalue(from, -2);                       // ... id storage id
+  lua_gettable(from, -2);                        // ... id storage store
+  bool hasstore = !lua_isnil(from, -1);
+  if (hasstore) {
+    lua_newtable(to);  // ... copies
+    if (!luaW_copyvalue(from, lua_gettop(from), to, lua_gettop(to))) {
+      lua_pop(to, 1);    // ...
+      lua_pop(from, 3);  // ...
+      return false;
+    }
+    lua_remove(to, -2);  // ... store
+  }
+  lua_pop(from, 2);  // ... id
+
+  // Keep shared objects alive across the move
+  std::shared_ptr<void> owner;
+  luaW_wrapperfield<T>(from, LUAW_CACHE_KEY);  // ... id cache
+  lua_insert(from, -2);                        // ... cache id
+  lua_gettable(from, -2);                      // ... cache ud
+  luaW_Userdata* pud = static_cast<luaW_Userdata*>(lua_touserdata(from, -1));
+  if (pud && pud->shared) owner = static_cast<luaW_SharedUserdata*>(pud)->owner;
+  lua_pop(from, 2);  // ...
+
+  bool held = luaW_detach<T>(from, obj);
+
+  if (owner) {
+    luaW_pushshared<T>(to, std::shared_ptr<T>(owner, obj));  // ... [store] ud
+  } else {
+    luaW_push<T>(to, obj);  // ... [store] ud
+  }
+  if (hasstore) {
+    luaW_wrapperfield<T>(to, LUAW_STORAGE_KEY);  // ... store ud storage
+    LuaWrapper<T>::identifier(to, obj);          // ... store ud storage id
+    lua_pushvalue(to, -4);                       // ... store ud storage id store
+    lua_settable(to, -3);                        // ... store ud storage
+    lua_pop(to, 1);                              // ... store ud
+    lua_remove(to, -2);                          // ... ud
+  }
+  if (held) luaW_hold<T>(to, obj);
+  return true;
+}
+
+// Forgets everything this state knows about the given slot of the slot map
+// whose generations table is at the absolute index gens: any cached userdata
+// still using it is marked as disposed, and its storage table and hold are
+// dropped, for every class that has been identified by that slot map. This
+// is only used internally.
+inline void luaW_purgehandle(lua_State* L, int gens, uint32_t slot) {
+  lua_getfield(L, LUA_REGISTRYINDEX, LUAW_WRAPPER_KEY);  // ... LuaWrapper
+  lua_rawgeti(L, gens, -1);                              // ... LuaWrapper classes
+  for (lua_pushnil(L); lua_next(L, -2); lua_pop(L, 1)) {
+    // ... LuaWrapper classes classname true
+    lua_getfield(L, -4, LUAW_CACHE_KEY);  // ... LuaWrapper classes classname true caches
+    lua_pushvalue(L, -3);                 // ... LuaWrapper classes classname true caches classname
+    lua_rawget(L, -2);                    // ... LuaWrapper classes classname true caches cache
+    lua_rawgeti(L, -1, slot);             // ... LuaWrapper classes classname true caches cache ud
+    luaW_Userdata* pud = static_cast<luaW_Userdata*>(lua_touserdata(L, -1));
+    if (pud) {
+      pud->data = NULL;
+      if (pud->shared) static_cast<luaW_SharedUserdata*>(pud)->owner.reset();
+    }
+    lua_getfield(L, -7, LUAW_HOLDS_KEY);  // ... LuaWrapper classes classname true caches cache ud holds
+    lua_pushvalue(L, -6);                 // ... LuaWrapper classes classname true caches cache ud holds classname
+    lua_rawget(L, -2);                    // ... LuaWrapper classes classname true caches cache ud holds table
+    lua_rawgeti(L, -1, slot);             // ... LuaWrapper classes classname true caches cache ud holds table hold
+    luaW_refundmemory(L, lua_tostring(L, -9), -1);
+    lua_pop(L, 6);  // ... LuaWrapper classes classname true
+    const char* fields[] = {LUAW_CACHE_KEY, LUAW_STORAGE_KEY, LUAW_HOLDS_KEY};
+    for (const char* field : fields) {
+      lua_getfield(L, -4, field);  // ... LuaWrapper classes classname true field
+      lua_pushvalue(L, -3);        // ... LuaWrapper classes classname true field classname
+      lua_rawget(L, -2);           // ... LuaWrapper classes classname true field table
+      lua_pushnil(L);              // ... LuaWrapper classes classname true field table nil
+      lua_rawseti(L, -2, slot);    // ... LuaWrapper classes classname true field table
+      lua_pop(L, 2);               // ... LuaWrapper classes classname true
+    }
+  }
+  lua_pop(L, 2);  // ...
+}
+
+// Pushes the table of generations this state has seen for the slot map whose
+// key is given, creating it if there is none yet, and returns the registry
+// reference that also holds it. This is only used internally.
+inline int luaW_opengenerations(lua_State* L, void* key) {
+  lua_pushlightuserdata(L, key);     // ... key
+  lua_rawget(L, LUA_REGISTRYINDEX);  // ... ref
+  if (lua_isnumber(L, -1)) {
+    int ref = static_cast<int>(lua_tointeger(L, -1));
+    lua_pop(L, 1);                           // ...
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ref);  // ... gens
+    return ref;
+  }
+  lua_pop(L, 1);                             // ...
+  lua_newtable(L);                           // ... gens
+  lua_pushlightuserdata(L, key);             // ... gens key
+  lua_rawseti(L, -2, 0);                     // ... gens
+  lua_newtable(L);                           // ... gens classes
+  lua_rawseti(L, -2, -1);                    // ... gens
+  lua_pushvalue(L, -1);                      // ... gens gens
+  int ref = luaL_ref(L, LUA_REGISTRYINDEX);  // ... gens
+  lua_pushlightuserdata(L, key);             // ... gens key
+  lua_pushinteger(L, ref);                   // ... gens key ref
+  lua_rawset(L, LUA_REGISTRYINDEX);          // ... gens
+  return ref;
+}
+
+// Pushes the slot of obj's handle as its identifier in this state, as the
+// class called classname. The state keeps, in a table for each slot map, the
+// generation it last saw in every slot (under the slot), the classes it has
+// identified (under -1) and the slot map's key (under 0). Each thread
+// remembers the registry reference to the table it last used, so while it
+// keeps using the same state the table is fetched by index instead of by
+// hashing the key; the key at 0 tells it apart from whatever another state
+// keeps under the same reference.
+template <typename H>
+void luaW_pushhandle(lua_State* L, const luaW_Handled<H>& obj, const char* classname) {
+  static thread_local int ref = LUA_NOREF;
+  const luaW_Handle& handle = obj.luaW_handle;
+  bool found = false;
+  if (ref > 0) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ref);  // ... gens
+    if (lua_istable(L, -1)) {
+      lua_rawgeti(L, -1, 0);  // ... gens key
+      found = lua_touserdata(L, -1) == luaW_HandleMap<H>::key();
+      lua_pop(L, 1);  // ... gens
+    }
+    if (!found) lua_pop(L, 1);  // ...
+  }
+  if (!found) ref = luaW_opengenerations(L, luaW_HandleMap<H>::key());  // ... gens
+  lua_rawgeti(L, -1, handle.slot);                                      // ... gens gen
+  lua_Integer seen = lua_tointeger(L, -1);
+  lua_pop(L, 1);  // ... gens
+  if (seen != static_cast<lua_Integer>(handle.generation)) {
+    // The slot is new to this state, or has been reused since it last saw it
+    if (seen != 0) luaW_purgehandle(L, lua_gettop(L), handle.slot);
+    lua_pushinteger(L, handle.generation);  // ... gens gen
+    lua_rawseti(L, -2, handle.slot);        // ... gens
+    lua_rawgeti(L, -1, -1);                 // ... gens classes
+    lua_pushboolean(L, true);               // ... gens classes true
+    lua_setfield(L, -2, classname);         // ... gens classes
+    lua_pop(L, 1);                          // ... gens
+  }
+  lua_pop(L, 1);                    // ...
+  lua_pushinteger(L, handle.slot);  // ... id
+}
+
+// An identifier for types deriving from luaW_Handled. Rather than the object's
+// address, it pushes the integer slot of the object's handle, so the cache,
+// storage and holds tables index the array part of a Lua table instead of
+// hashing pointers. Each state remembers the generation it last saw in every
+// slot; when a slot turns out to have been reused, whatever the state still
+// has for the old occupant is discarded first, so a new object can never pick
+// up the userdata or storage table of an old one that happened to live at the
+// same address. Pass it as the identifier to luaW_register.
+//
+// The identifier reads the handle through obj, so it is only ever called on
+// live objects: luaW_to and luaW_check compare the handle recorded in the
+// userdata against the slot map first, and treat a userdata whose object has
+// been destroyed as disposed.
+template <typename T>
+void luaW_handleidentifier(lua_State* L, T* obj) {
+  luaW_pushhandle(L, *obj, LuaWrapper<T>::classname);
+}
+
+// The post-constructors that apply to each type are looked up once per state
+// and cached in a table in the registry, keyed by the address below. This is
+// only used internally.
+inline void* luaW_postconstructorskey() {
+  static char key;
+  return &key;
+}
+
+// Appends the post-constructor of T, and those of the types it extends, to the
+// list at the given absolute index, base classes first. This is only used
+// internally.
+template <typename T>
+void luaW_collectpostconstructors(lua_State* L, int list) {
   if (LuaWrapper<T>::postconstructorrecurse) {
-    LuaWrapper<T>::postconstructorrecurse(L, numargs);
+    LuaWrapper<T>::postconstructorrecurse(L, list);
   }
-  luaL_getmetatable(L, LuaWrapper<T>::classname);  // ... ud args... mt
-  lua_getfield(L, -1, LUAW_POSTCTOR_KEY);          // ... ud args... mt postctor
+  luaL_getmetatable(L, LuaWrapper<T>::classname);  // ... mt
+  lua_getfield(L, -1, LUAW_POSTCTOR_KEY);          // ... mt postctor
   if (lua_type(L, -1) == LUA_TFUNCTION) {
-    for (int i = 0; i < numargs + 1; i++) {
-      lua_pushvalue(L, -3 - numargs);  // ... ud args... mt postctor ud args...
-    }
-    lua_call(L, numargs + 1, 0);  // ... ud args... mt
-    lua_pop(L, 1);                // ... ud args...
+    lua_rawseti(L, list, static_cast<int>(luaW_rawlen(L, list)) + 1);  // ... mt
+    lua_pop(L, 1);                                                     // ...
   } else {
-    lua_pop(L, 2);  // ... ud args...
+    lua_pop(L, 2);  // ...
+  }
+}
+
+// Pushes the list of post-constructors that apply to T, or false if there are
+// none. The list is built the first time it is needed, and reused until
+// luaW_invalidatepostconstructors is called.
+template <typename T>
+void luaW_pushpostconstructors(lua_State* L) {
+  void* type = &LuaWrapper<T>::classname;
+  lua_pushlightuserdata(L, luaW_postconstructorskey());  // ... key
+  lua_rawget(L, LUA_REGISTRYINDEX);                      // ... cache
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);                                         // ...
+    lua_newtable(L);                                       // ... cache
+    lua_pushlightuserdata(L, luaW_postconstructorskey());  // ... cache key
+    lua_pushvalue(L, -2);                                  // ... cache key cache
+    lua_rawset(L, LUA_REGISTRYINDEX);                      // ... cache
   }
+  lua_pushlightuserdata(L, type);  // ... cache type
+  lua_rawget(L, -2);               // ... cache postctors
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);                                      // ... cache
+    lua_newtable(L);                                    // ... cache postctors
+    luaW_collectpostconstructors<T>(L, lua_gettop(L));  // ... cache postctors
+    if (luaW_rawlen(L, -1) == 0) {
+      lua_pop(L, 1);              // ... cache
+      lua_pushboolean(L, false);  // ... cache false
+    }
+    lua_pushlightuserdata(L, type);  // ... cache postctors type
+    lua_pushvalue(L, -2);            // ... cache postctors type postctors
+    lua_rawset(L, -4);               // ... cache postctors
+  }
+  lua_replace(L, -2);  // ... postctors
+}
+
+// Forgets the post-constructors cached for every type, so they are looked up
+// again the next time an object is constructed. This happens automatically
+// when a type is registered or extended, and when a script assigns a
+// LUAW_POSTCTOR_KEY function to a metatable that does not have one yet. It
+// only needs to be called after replacing a post-constructor that is already
+// there, or after setting one with rawset.
+inline void luaW_invalidatepostconstructors(lua_State* L) {
+  lua_pushlightuserdata(L, luaW_postconstructorskey());  // ... key
+  lua_pushnil(L);                                        // ... key nil
+  lua_rawset(L, LUA_REGISTRYINDEX);                      // ...
+}
+
+// The __newindex of the metatable of every class metatable, which notices a
+// post-constructor or method being added so that the cached ones are looked
+// up again. This is only used internally.
+inline int luaW_metatablenewindex(lua_State* L) {
+  // mt key value
+  if (lua_type(L, 2) == LUA_TSTRING && strcmp(lua_tostring(L, 2), LUAW_POSTCTOR_KEY) == 0) {
+    luaW_invalidatepostconstructors(L);
+  }
+  if (lua_isfunction(L, 3)) luaW_invalidatemethods(L);
+  lua_rawset(L, 1);  // mt
+  return 0;
+}
+
+// Calls each function in the list of post-constructors at the absolute index
+// postctors on the userdata at the absolute index ud, followed by numargs
+// arguments starting at the absolute index firstarg. This is only used
+// internally.
+inline void luaW_callpostconstructors(lua_State* L, int postctors, int ud, int firstarg, int numargs) {
+  for (int i = 1;; ++i) {
+    lua_rawgeti(L, postctors, i);  // ... postctor
+    if (lua_isnil(L, -1)) {
+      lua_pop(L, 1);  // ...
+      break;
+    }
+    lua_pushvalue(L, ud);  // ... postctor ud
+    for (int j = 0; j < numargs; ++j) {
+      lua_pushvalue(L, firstarg + j);  // ... postctor ud args...
+    }
+    lua_call(L, numargs + 1, 0);  // ...
+  }
+}
+
+template <typename T>
+void luaW_postconstructorinternal(lua_State* L, int numargs) {
+  // ... ud args...
+  int firstarg = lua_gettop(L) - numargs + 1;
+  luaW_pushpostconstructors<T>(L);  // ... ud args... postctors
+  if (lua_toboolean(L, -1)) {
+    luaW_callpostconstructors(L, lua_gettop(L), firstarg - 1, firstarg, numargs);
+  }
+  lua_pop(L, 1);  // ... ud args...
 }
 
 // This function is called from Lua, not C++
@@ -343,7 +1276,14 @@ void luaW_postconstructor(lua_State* L, int numargs) {
 template <typename T>
 inline int luaW_new(lua_State* L, int numargs) {
   // ... args...
+  if (!luaW_admitmemory<T>(L)) {
+    return luaL_error(L, "%s memory limit exceeded", LuaWrapper<T>::classname);
+  }
   T* obj = LuaWrapper<T>::allocator(L);
+  if (!luaW_admitmemory<T>(L, obj)) {
+    if (LuaWrapper<T>::deallocator) LuaWrapper<T>::deallocator(L, obj);
+    return luaL_error(L, "%s memory limit exceeded", LuaWrapper<T>::classname);
+  }
   luaW_push<T>(L, obj);  // ... args... ud
   luaW_hold<T>(L, obj);
   lua_insert(L, -1 - numargs);          // ... ud args...
@@ -356,6 +1296,163 @@ int luaW_new(lua_State* L) {
   return luaW_new<T>(L, lua_gettop(L));
 }
 
+// This function is called from Lua, not C++
+//
+// Creates count objects of type T at once, as T.newn(count, ...), and returns
+// them in an array. Every object is created by the allocator and then passed
+// to the post-constructors together with the remaining arguments, exactly as
+// T.new(...) would, but the post-constructors are only resolved once for the
+// whole batch. The arguments are at the bottom of the stack when the
+// allocator runs, followed by values used by luaW_newn.
+template <typename T>
+int luaW_newn(lua_State* L) {
+  // count args...
+  lua_Integer requested = luaL_checkinteger(L, 1);
+  luaL_argcheck(L, requested >= 0, 1, "count must not be negative");
+  luaL_argcheck(L, requested <= INT_MAX, 1, "count is too large");
+  int count = static_cast<int>(requested);
+  lua_remove(L, 1);  // args...
+  int numargs = lua_gettop(L);
+  lua_createtable(L, count, 0);     // args... {}
+  luaW_pushpostconstructors<T>(L);  // args... {} postctors
+  bool haspostctors = lua_toboolean(L, -1) != 0;
+  for (int i = 1; i <= count; ++i) {
+    if (!luaW_admitmemory<T>(L)) {
+      return luaL_error(L, "%s memory limit exceeded", LuaWrapper<T>::classname);
+    }
+    T* obj = LuaWrapper<T>::allocator(L);
+    if (!luaW_admitmemory<T>(L, obj)) {
+      if (LuaWrapper<T>::deallocator) LuaWrapper<T>::deallocator(L, obj);
+      return luaL_error(L, "%s memory limit exceeded", LuaWrapper<T>::classname);
+    }
+    luaW_push<T>(L, obj);  // args... {} postctors ud
+    luaW_hold<T>(L, obj);
+    if (haspostctors) {
+      luaW_callpostconstructors(L, numargs + 2, numargs + 3, 1, numargs);
+    }
+    lua_rawseti(L, numargs + 1, i);  // args... {} postctors
+  }
+  lua_pop(L, 1);  // args... {}
+  return 1;
+}
+
+// Frees a block created by luaW_newarray and refunds the memory it was charged
+// for, if any. The charge is filled in once the block has been measured. This
+// is only used internally.
+template <typename T>
+struct luaW_ArrayDeleter {
+  void operator()(T* elements) const {
+    delete[] elements;
+    if (account) luaW_refundbytes(account.get(), type, size, count);
+  }
+  std::shared_ptr<luaW_MemoryAccount> account;
+  luaW_TypeMemory* type;
+  size_t size;
+  size_t count;
+};
+
+// The __gc metamethod of the userdata that owns a block while luaW_newarray
+// pushes its elements. This is only used internally.
+inline int luaW_blockownergc(lua_State* L) {
+  static_cast<std::shared_ptr<void>*>(lua_touserdata(L, 1))->~shared_ptr();
+  return 0;
+}
+
+// This function is called from Lua, not C++
+//
+// Creates count default constructed objects of type T in a single contiguous
+// allocation, as T.newarray(count, ...), and returns them in an array. The
+// remaining arguments are passed to the post-constructors of each object.
+//
+// The elements are pushed as with luaW_pushshared, each sharing ownership of
+// the whole block, so the block is freed with delete[] once the last of them
+// is garbage collected; the class's allocator and deallocator are not used.
+// Because the objects are adjacent in memory, C++ code handed the first
+// element can walk the rest of them directly.
+template <typename T>
+int luaW_newarray(lua_State* L) {
+  // count args...
+  if constexpr (std::is_default_constructible_v<T>) {
+    lua_Integer requested = luaL_checkinteger(L, 1);
+    luaL_argcheck(L, requested >= 0, 1, "count must not be negative");
+    luaL_argcheck(L, requested <= INT_MAX, 1, "count is too large");
+    int count = static_cast<int>(requested);
+    lua_remove(L, 1);  // args...
+    int numargs = lua_gettop(L);
+    lua_createtable(L, count, 0);  // args... {}
+    if (count == 0) return 1;
+
+    // The block is owned from a userdata rather than from C++ locals, since an
+    // error raised while the elements are pushed would skip their destructors
+    void* block = lua_newuserdata(L, sizeof(std::shared_ptr<void>));  // args... {} owner
+    std::shared_ptr<void>* owner = new (block) std::shared_ptr<void>();
+    lua_newtable(L);                          // args... {} owner mt
+    lua_pushcfunction(L, luaW_blockownergc);  // args... {} owner mt gc
+    lua_setfield(L, -2, "__gc");              // args... {} owner mt
+    lua_setmetatable(L, -2);                  // args... {} owner
+
+    T* elements = new (std::nothrow) T[count];
+    if (!elements) {
+      return luaL_error(L, "not enough memory for %d %s objects", count, LuaWrapper<T>::classname);
+    }
+    bool owned = true;
+    try {
+      *owner = std::shared_ptr<void>(elements, luaW_ArrayDeleter<T>{std::shared_ptr<luaW_MemoryAccount>(), NULL, 0, 0});
+    } catch (const std::bad_alloc&) {
+      owned = false;  // The shared_ptr constructor has already freed elements
+    }
+    if (!owned) {
+      return luaL_error(L, "not enough memory for %d %s objects", count, LuaWrapper<T>::classname);
+    }
+
+    // If T is tracked, the whole block is charged now and refunded when it is
+    // freed. Every element is cast the same way to the type it is charged to
+    luaW_Userdata first(elements, LuaWrapper<T>::cast);
+    luaW_TypeMemory* type = luaW_typememory(L, LuaWrapper<T>::classname, &first);
+    if (type) {
+      ptrdiff_t offset = static_cast<char*>(first.data) - reinterpret_cast<char*>(elements);
+      luaW_ArrayDeleter<T>* charge = std::get_deleter<luaW_ArrayDeleter<T>>(*owner);
+      charge->account = *luaW_sharememoryaccount(L);
+      charge->type = type;
+      charge->count = static_cast<size_t>(count);
+      for (int i = 0; i < count; ++i) charge->size += type->measure(reinterpret_cast<char*>(&elements[i]) + offset);
+      luaW_chargememory(charge->account.get(), type, charge->size, charge->count);
+    }
+
+    // Each element's userdata takes its share of the block only once it exists
+    for (int i = 0; i < count; ++i) {
+      T* obj = &elements[i];
+      luaW_pushuserdata<T>(L, obj, sizeof(luaW_SharedUserdata), [obj, owner](void* ud) {
+        luaW_recordhandle(new (ud) luaW_SharedUserdata(obj, LuaWrapper<T>::cast, *owner), obj);
+      });                                  // args... {} owner ud
+      lua_rawseti(L, numargs + 1, i + 1);  // args... {} owner
+    }
+    owner->reset();
+    lua_pop(L, 1);  // args... {}
+
+    // The block is only checked against the limits once Lua owns it, as the
+    // collection may run finalizers. If it does not fit, its elements are
+    // disposed of, which frees and refunds it right away
+    if (type && !luaW_admitbytes(L, type, 0)) {
+      for (int i = 0; i < count; ++i) luaW_detach<T>(L, &elements[i]);
+      return luaL_error(L, "%s memory limit exceeded", LuaWrapper<T>::classname);
+    }
+
+    luaW_pushpostconstructors<T>(L);  // args... {} postctors
+    if (lua_toboolean(L, -1)) {
+      for (int i = 1; i <= count; ++i) {
+        lua_rawgeti(L, numargs + 1, i);  // args... {} postctors ud
+        luaW_callpostconstructors(L, numargs + 2, numargs + 3, 1, numargs);
+        lua_pop(L, 1);  // args... {} postctors
+      }
+    }
+    lua_pop(L, 1);  // args... {}
+    return 1;
+  } else {
+    return luaL_error(L, "%s can not be created in an array without a default constructor", LuaWrapper<T>::classname);
+  }
+}
+
 // This function is called from Lua, not C++
 //
 // The default metamethod to call when indexing into lua userdata representing
@@ -367,19 +1464,21 @@ template <typename T>
 int luaW_index(lua_State* L) {
   // obj key
   T* obj = luaW_to<T>(L, 1);
-  luaW_wrapperfield<T>(L, LUAW_STORAGE_KEY);  // obj key storage
-  LuaWrapper<T>::identifier(L, obj);          // obj key storage id
-  lua_gettable(L, -2);                        // obj key storage store
-
-  // Check if storage table exists
-  if (!lua_isnil(L, -1)) {
-    lua_pushvalue(L, -3);  // obj key storage store key
-    lua_gettable(L, -2);   // obj key storage store store[k]
+  if (obj) {
+    luaW_wrapperfield<T>(L, LUAW_STORAGE_KEY);  // obj key storage
+    LuaWrapper<T>::identifier(L, obj);          // obj key storage id
+    lua_gettable(L, -2);                        // obj key storage store
+
+    // Check if storage table exists
+    if (!lua_isnil(L, -1)) {
+      lua_pushvalue(L, -3);  // obj key storage store key
+      lua_gettable(L, -2);   // obj key storage store store[k]
+    }
   }
 
-  // If either there is no storage table or the key wasn't found
-  // then fall back to the metatable
-  if (lua_isnil(L, -1)) {
+  // If the object was disposed, there is no storage table or the key wasn't
+  // found then fall back to the metatable
+  if (lua_gettop(L) == 2 || lua_isnil(L, -1)) {
     lua_settop(L, 2);         // obj key
     lua_getmetatable(L, -2);  // obj key mt
     lua_pushvalue(L, -2);     // obj key mt k
@@ -413,6 +1512,11 @@ int luaW_newindex(lua_State* L) {
     lua_settable(L, -4);   // obj key value storage store
   }
 
+  // A function stored here overrides the class's method of the same name for
+  // this object alone, so rather than invalidating every cached method the
+  // userdata remembers that it has to be checked on its own
+  if (lua_isfunction(L, 3)) static_cast<luaW_Userdata*>(lua_touserdata(L, 1))->functions = true;
+
   lua_pushvalue(L, 2);  // obj key value ... store key
   lua_pushvalue(L, 3);  // obj key value ... store key value
   lua_settable(L, -3);  // obj key value ... store
@@ -420,21 +1524,166 @@ int luaW_newindex(lua_State* L) {
   return 0;
 }
 
+// An object whose destruction was deferred by luaW_gc. Running it calls the
+// deallocator the object was registered with, or drops the last Lua reference
+// to an object pushed with luaW_pushshared.
+struct luaW_PendingRelease {
+  void* obj;
+  void (*release)(lua_State*, void*);
+  std::shared_ptr<void> owner;
+  void operator()(lua_State* L) {
+    if (release) release(L, obj);
+    owner.reset();
+  }
+};
+
+// The queue of pending releases for a lua_State. It lives in a userdata in the
+// registry whose __gc runs whatever is left when the state is closed. This is
+// only used internally.
+struct luaW_ReleaseQueue {
+  std::deque<luaW_PendingRelease> pending;
+};
+
+inline void* luaW_releasequeuekey() {
+  static char key;
+  return &key;
+}
+
+// Runs and then destroys every remaining pending release. Once this has run,
+// luaW_gc goes back to destroying objects immediately. This is only used
+// internally.
+inline int luaW_releasequeuegc(lua_State* L) {
+  luaW_ReleaseQueue* queue = static_cast<luaW_ReleaseQueue*>(lua_touserdata(L, 1));
+  lua_pushlightuserdata(L, luaW_releasequeuekey());  // queue key
+  lua_pushnil(L);                                    // queue key nil
+  lua_rawset(L, LUA_REGISTRYINDEX);                  // queue
+  while (!queue->pending.empty()) {
+    luaW_PendingRelease release = std::move(queue->pending.front());
+    queue->pending.pop_front();
+    release(L);
+  }
+  queue->~luaW_ReleaseQueue();
+  return 0;
+}
+
+// Returns the release queue of the state if the userdata at the given index
+// belongs to a type whose destruction is deferred, or NULL if it should be
+// destroyed immediately. This is only used internally.
+inline luaW_ReleaseQueue* luaW_deferredqueue(lua_State* L, int index) {
+  if (!lua_getmetatable(L, index)) return NULL;
+  luaW_ReleaseQueue* queue = NULL;
+  lua_pushlightuserdata(L, luaW_releasequeuekey());  // ... mt key
+  lua_rawget(L, -2);                                 // ... mt deferred
+  if (lua_toboolean(L, -1)) {
+    lua_pushlightuserdata(L, luaW_releasequeuekey());  // ... mt deferred key
+    lua_rawget(L, LUA_REGISTRYINDEX);                  // ... mt deferred queue
+    queue = static_cast<luaW_ReleaseQueue*>(lua_touserdata(L, -1));
+    lua_pop(L, 1);  // ... mt deferred
+  }
+  lua_pop(L, 2);  // ...
+  return queue;
+}
+
+template <typename T>
+void luaW_deferreddeallocate(lua_State* L, void* obj) {
+  LuaWrapper<T>::deallocator(L, static_cast<T*>(obj));
+}
+
+// Turns deferred destruction on or off for objects of type T in this state.
+// While it is on, the __gc metamethod no longer calls the deallocator itself;
+// it only queues the object, and the application destroys queued objects at a
+// time of its choosing with luaW_drainreleases (or takes them elsewhere with
+// luaW_takereleases). This keeps expensive destructors out of garbage
+// collection pauses. The type must already be registered, and types extending
+// T do not inherit the setting. Anything still queued when the state is
+// closed is destroyed then.
+template <typename T>
+void luaW_deferdestruction(lua_State* L, bool defer = true) {
+  lua_pushlightuserdata(L, luaW_releasequeuekey());  // ... key
+  lua_rawget(L, LUA_REGISTRYINDEX);                  // ... queue
+  if (defer && lua_isnil(L, -1)) {
+    lua_pop(L, 1);                                                // ...
+    void* block = lua_newuserdata(L, sizeof(luaW_ReleaseQueue));  // ... queue
+    new (block) luaW_ReleaseQueue();
+    lua_newtable(L);                                   // ... queue mt
+    lua_pushcfunction(L, luaW_releasequeuegc);         // ... queue mt gc
+    lua_setfield(L, -2, "__gc");                       // ... queue mt
+    lua_setmetatable(L, -2);                           // ... queue
+    lua_pushlightuserdata(L, luaW_releasequeuekey());  // ... queue key
+    lua_pushvalue(L, -2);                              // ... queue key queue
+    lua_rawset(L, LUA_REGISTRYINDEX);                  // ... queue
+  }
+  lua_pop(L, 1);                                     // ...
+  luaL_getmetatable(L, LuaWrapper<T>::classname);    // ... mt
+  lua_pushlightuserdata(L, luaW_releasequeuekey());  // ... mt key
+  if (defer) {
+    lua_pushboolean(L, true);  // ... mt key true
+  } else {
+    lua_pushnil(L);  // ... mt key nil
+  }
+  lua_rawset(L, -3);  // ... mt
+  lua_pop(L, 1);      // ...
+}
+
+// Destroys up to budget objects whose destruction was deferred, oldest first,
+// and returns how many are still waiting. This must be called from the thread
+// that owns the lua_State, at a point where running destructors is safe.
+inline size_t luaW_drainreleases(lua_State* L, size_t budget) {
+  lua_pushlightuserdata(L, luaW_releasequeuekey());  // ... key
+  lua_rawget(L, LUA_REGISTRYINDEX);                  // ... queue
+  luaW_ReleaseQueue* queue = static_cast<luaW_ReleaseQueue*>(lua_touserdata(L, -1));
+  lua_pop(L, 1);  // ...
+  if (!queue) return 0;
+  for (; budget > 0 && !queue->pending.empty(); --budget) {
+    luaW_PendingRelease release = std::move(queue->pending.front());
+    queue->pending.pop_front();
+    release(L);
+  }
+  return queue->pending.size();
+}
+
+// Removes every pending release from the state and returns them, so that they
+// can be run on another thread. Deallocators run this way must not touch the
+// lua_State, and should be invoked with NULL, e.g. release(NULL).
+inline std::deque<luaW_PendingRelease> luaW_takereleases(lua_State* L) {
+  std::deque<luaW_PendingRelease> pending;
+  lua_pushlightuserdata(L, luaW_releasequeuekey());  // ... key
+  lua_rawget(L, LUA_REGISTRYINDEX);                  // ... queue
+  luaW_ReleaseQueue* queue = static_cast<luaW_ReleaseQueue*>(lua_touserdata(L, -1));
+  lua_pop(L, 1);  // ...
+  if (queue) pending.swap(queue->pending);
+  return pending;
+}
+
 // This function is called from Lua, not C++
 //
 // The __gc metamethod handles cleaning up userdata. The userdata's reference
 // count is decremented and if this is the final reference to the userdata its
 // environment table is nil'd and pointer deleted with the destructor callback.
+// Userdata created by luaW_pushshared release their shared_ptr instead. For
+// types passed to luaW_deferdestruction, either is queued rather than done.
 template <typename T>
 int luaW_gc(lua_State* L) {
   // obj
+  luaW_Userdata* pud = static_cast<luaW_Userdata*>(lua_touserdata(L, 1));
+  if (!pud) return 0;  // A table given T's metatable by a script
   T* obj = luaW_to<T>(L, 1);
+  if (!obj) {
+    // Disposed and invalidated objects were already cleaned up by luaW_detach
+    if (pud->shared) static_cast<luaW_SharedUserdata*>(pud)->~luaW_SharedUserdata();
+    return 0;
+  }
+  luaW_ReleaseQueue* queue = luaW_deferredqueue(L, 1);
   LuaWrapper<T>::identifier(L, obj);        // obj key value storage id
   luaW_wrapperfield<T>(L, LUAW_HOLDS_KEY);  // obj id counts count holds
   lua_pushvalue(L, 2);                      // obj id counts count holds id
   lua_gettable(L, -2);                      // obj id counts count holds hold
   if (lua_toboolean(L, -1) && LuaWrapper<T>::deallocator) {
-    LuaWrapper<T>::deallocator(L, obj);
+    if (queue) {
+      queue->pending.push_back(luaW_PendingRelease{obj, luaW_deferreddeallocate<T>, std::shared_ptr<void>()});
+    } else {
+      LuaWrapper<T>::deallocator(L, obj);
+    }
   }
 
   luaW_wrapperfield<T>(L, LUAW_STORAGE_KEY);  // obj id counts count holds hold storage
@@ -443,6 +1692,48 @@ int luaW_gc(lua_State* L) {
   lua_settable(L, -3);                        // obj id counts count holds hold storage
 
   luaW_release<T>(L, 2);
+
+  // Objects pushed with luaW_pushshared drop their reference here
+  if (pud->shared) {
+    luaW_SharedUserdata* sud = static_cast<luaW_SharedUserdata*>(pud);
+    if (queue) {
+      queue->pending.push_back(luaW_PendingRelease{NULL, NULL, std::move(sud->owner)});
+    }
+    sud->~luaW_SharedUserdata();
+  }
+  return 0;
+}
+
+// This function is called from Lua, not C++
+//
+// Destroys an object right away rather than waiting for the garbage collector.
+// It is available to scripts as obj:dispose() and, on Lua 5.4 and later, as
+// the __close metamethod, so that `local obj <close> = T.new()` destroys obj
+// when it goes out of scope. The object's storage table, hold and cache entry
+// are removed, the deallocator is called if Lua owned it (or, for objects
+// pushed with luaW_pushshared, the userdata's reference is dropped), and the
+// userdata is marked as disposed so that luaW_check raises an error when it is
+// used again. Disposing an object twice does nothing. For types whose
+// destruction is deferred, the deallocator call or the reference is queued
+// just as luaW_gc would queue it.
+template <typename T>
+int luaW_dispose(lua_State* L) {
+  // obj
+  if (!luaW_is<T>(L, 1)) luaW_check<T>(L, 1);
+  T* obj = luaW_to<T>(L, 1);
+  if (!obj) return 0;
+  luaW_ReleaseQueue* queue = luaW_deferredqueue(L, 1);
+  luaW_Userdata* pud = static_cast<luaW_Userdata*>(lua_touserdata(L, 1));
+  if (queue && pud->shared) {
+    queue->pending.push_back(luaW_PendingRelease{NULL, NULL, std::move(static_cast<luaW_SharedUserdata*>(pud)->owner)});
+  }
+  if (luaW_detach<T>(L, obj) && LuaWrapper<T>::deallocator) {
+    if (queue) {
+      queue->pending.push_back(luaW_PendingRelease{obj, luaW_deferreddeallocate<T>, std::shared_ptr<void>()});
+    } else {
+      LuaWrapper<T>::deallocator(L, obj);
+    }
+  }
   return 0;
 }
 
@@ -495,6 +1786,104 @@ inline void luaW_initialize(lua_State* L) {
   lua_pop(L, 1);  // ...
 }
 
+// Copies the methods that the metatable at the absolute index mt inherits
+// into the metatable itself, in place of the copies made the last time, and
+// records them in its LUAW_FLATTENED_KEY table. A copy that has since been
+// replaced by something else is left alone. Only string keys that do not
+// start with two underscores are copied, so metamethods and LuaWrapper's own
+// fields and flags are not inherited any more than they are without
+// flattening. This is only used internally.
+inline void luaW_flattenmetatable(lua_State* L, int mt) {
+  // Remove the old copies
+  lua_pushstring(L, LUAW_FLATTENED_KEY);  // ... key
+  lua_rawget(L, mt);                      // ... flattened
+  for (lua_pushnil(L); lua_next(L, -2); lua_pop(L, 1)) {
+    // ... flattened k copy
+    lua_pushvalue(L, -2);  // ... flattened k copy k
+    lua_rawget(L, mt);     // ... flattened k copy mt[k]
+    bool replaced = !lua_rawequal(L, -1, -2);
+    lua_pop(L, 1);  // ... flattened k copy
+    if (replaced) continue;
+    lua_pushvalue(L, -2);  // ... flattened k copy k
+    lua_pushnil(L);        // ... flattened k copy k nil
+    lua_rawset(L, mt);     // ... flattened k copy
+  }
+  lua_pop(L, 1);  // ...
+
+  lua_newtable(L);  // ... flattened
+  int flattened = lua_gettop(L);
+  lua_pushvalue(L, mt);  // ... flattened mt
+  while (lua_getmetatable(L, -1)) {
+    // ... flattened child childmt
+    lua_pushstring(L, "__index");  // ... flattened child childmt "__index"
+    lua_rawget(L, -2);             // ... flattened child childmt parent
+    lua_replace(L, -3);            // ... flattened parent childmt
+    lua_pop(L, 1);                 // ... flattened parent
+    if (!lua_istable(L, -1)) break;
+
+    // Copies made into the parent are skipped; they are picked up from the
+    // ancestor that really defines them
+    lua_pushstring(L, LUAW_FLATTENED_KEY);  // ... flattened parent key
+    lua_rawget(L, -2);                      // ... flattened parent parentflattened
+    int parentflattened = lua_gettop(L);
+    for (lua_pushnil(L); lua_next(L, -3); lua_pop(L, 1)) {
+      // ... flattened parent parentflattened k v
+      if (lua_type(L, -2) != LUA_TSTRING || strncmp(lua_tostring(L, -2), "__", 2) == 0) continue;
+      if (lua_istable(L, parentflattened)) {
+        lua_pushvalue(L, -2);            // ... k v k
+        lua_rawget(L, parentflattened);  // ... k v copy
+        bool copied = lua_rawequal(L, -1, -2);
+        lua_pop(L, 1);  // ... k v
+        if (copied) continue;
+      }
+      lua_pushvalue(L, -2);  // ... k v k
+      lua_rawget(L, mt);     // ... k v mt[k]
+      bool defined = !lua_isnil(L, -1);
+      lua_pop(L, 1);  // ... k v
+      if (defined) continue;
+      lua_pushvalue(L, -2);      // ... k v k
+      lua_pushvalue(L, -2);      // ... k v k v
+      lua_rawset(L, mt);         // ... k v
+      lua_pushvalue(L, -2);      // ... k v k
+      lua_pushvalue(L, -2);      // ... k v k v
+      lua_rawset(L, flattened);  // ... k v
+    }
+    lua_pop(L, 1);  // ... flattened parent
+  }
+  lua_settop(L, flattened);               // ... flattened
+  lua_pushstring(L, LUAW_FLATTENED_KEY);  // ... flattened key
+  lua_insert(L, -2);                      // ... key flattened
+  lua_rawset(L, mt);                      // ...
+}
+
+// Refreshes the inherited methods copied into the metatable of every type
+// that has been flattened with luaW_flatten. This happens automatically when
+// a type is registered or extended, and after luaU_reload, but if a script
+// assigns a method directly to the metatable of a base class, this must be
+// called for flattened types to see it.
+inline void luaW_reflatten(lua_State* L) {
+  lua_getfield(L, LUA_REGISTRYINDEX, LUAW_WRAPPER_KEY);  // ... LuaWrapper
+  if (lua_istable(L, -1)) {
+    lua_getfield(L, -1, LUAW_STORAGE_KEY);  // ... LuaWrapper storage
+    for (lua_pushnil(L); lua_next(L, -2); lua_pop(L, 1)) {
+      // ... LuaWrapper storage classname store
+      if (lua_type(L, -2) != LUA_TSTRING) continue;
+      luaL_getmetatable(L, lua_tostring(L, -2));  // ... classname store mt
+      if (lua_istable(L, -1)) {
+        lua_pushstring(L, LUAW_FLATTENED_KEY);  // ... classname store mt key
+        lua_rawget(L, -2);                      // ... classname store mt flattened
+        bool flat = lua_istable(L, -1);
+        lua_pop(L, 1);  // ... classname store mt
+        if (flat) luaW_flattenmetatable(L, lua_gettop(L));
+      }
+      lua_pop(L, 1);  // ... classname store
+    }
+    lua_pop(L, 1);  // ... LuaWrapper
+  }
+  lua_pop(L, 1);  // ...
+  luaW_invalidatemethods(L);
+}
+
 // Run luaW_register or luaW_setfuncs to create a table and metatable for your
 // class.  These functions create a table with filled with the function from
 // the table argument in addition to the functions new and build (This is
@@ -528,9 +1917,15 @@ void luaW_setfuncs(lua_State* L, const char* classname, const luaL_Reg* table, c
   LuaWrapper<T>::identifier = identifier;
   LuaWrapper<T>::allocator = allocator;
   LuaWrapper<T>::deallocator = deallocator;
+  luaW_invalidatepostconstructors(L);
+  luaW_invalidatemethods(L);
 
-  const luaL_Reg defaulttable[] = {{"new", luaW_new<T>}, {NULL, NULL}};
-  const luaL_Reg defaultmetatable[] = {{"__index", luaW_index<T>}, {"__newindex", luaW_newindex<T>}, {"__gc", luaW_gc<T>}, {NULL, NULL}};
+  const luaL_Reg defaulttable[] = {{"new", luaW_new<T>}, {"newn", luaW_newn<T>}, {"newarray", luaW_newarray<T>}, {NULL, NULL}};
+  const luaL_Reg defaultmetatable[] = {{"__index", luaW_index<T>}, {"__newindex", luaW_newindex<T>}, {"__gc", luaW_gc<T>}, {"dispose", luaW_dispose<T>},
+#if LUA_VERSION_NUM >= 504
+                                       {"__close", luaW_dispose<T>},
+#endif
+                                       {NULL, NULL}};
 
   // Set up per-type tables
   lua_getfield(L, LUA_REGISTRYINDEX, LUAW_WRAPPER_KEY);  // ... LuaWrapper
@@ -547,7 +1942,7 @@ void luaW_setfuncs(lua_State* L, const char* classname, const luaL_Reg* table, c
 
   lua_getfield(L, -1, LUAW_CACHE_KEY);                // ... LuaWrapper LuaWrapper.cache
   lua_newtable(L);                                    // ... LuaWrapper LuaWrapper.cache {}
-  luaW_wrapperfield<T>(L, LUAW_CACHE_METATABLE_KEY);  // ... LuaWrapper LuaWrapper.cache {} cmt
+  lua_getfield(L, -3, LUAW_CACHE_METATABLE_KEY);      // ... LuaWrapper LuaWrapper.cache {} cmt
   lua_setmetatable(L, -2);                            // ... LuaWrapper LuaWrapper.cache {}
   lua_setfield(L, -2, LuaWrapper<T>::classname);      // ... LuaWrapper LuaWrapper.cache
 
@@ -562,7 +1957,14 @@ void luaW_setfuncs(lua_State* L, const char* classname, const luaL_Reg* table, c
   lua_newtable(L);                                     // ... T mt {}
   lua_setfield(L, -2, LUAW_EXTENDS_KEY);               // ... T mt
   luaW_registerfuncs(L, defaultmetatable, metatable);  // ... T mt
+  lua_newtable(L);                                     // ... T mt {}
+  lua_pushcfunction(L, luaW_metatablenewindex);        // ... T mt {} newindex
+  lua_setfield(L, -2, "__newindex");                   // ... T mt {}
+  lua_setmetatable(L, -2);                             // ... T mt
   lua_setfield(L, -2, "metatable");                    // ... T
+
+  // Types that inherit from T may hold copies of its methods
+  luaW_reflatten(L);
 }
 
 template <typename T>
@@ -572,13 +1974,36 @@ void luaW_register(lua_State* L, const char* classname, const luaL_Reg* table, c
   lua_setglobal(L, classname);                                                        // ... T
 }
 
+// Copies the methods T inherits into T's own metatable, so that looking one
+// up on a T takes a single table probe, however deep the inheritance goes,
+// rather than a miss at every level in between. Methods T defines itself still
+// win over inherited ones. The copies are kept up to date by luaW_reflatten.
+template <typename T>
+void luaW_flatten(lua_State* L) {
+  luaL_getmetatable(L, LuaWrapper<T>::classname);  // ... mt
+  lua_pushstring(L, LUAW_FLATTENED_KEY);           // ... mt key
+  lua_rawget(L, -2);                               // ... mt flattened
+  if (!lua_istable(L, -1)) {
+    lua_pushstring(L, LUAW_FLATTENED_KEY);  // ... mt nil key
+    lua_newtable(L);                        // ... mt nil key {}
+    lua_rawset(L, -4);                      // ... mt nil
+  }
+  lua_pop(L, 1);  // ... mt
+  luaW_flattenmetatable(L, lua_gettop(L));
+  lua_pop(L, 1);  // ...
+  luaW_invalidatemethods(L);
+}
+
 // luaW_extend is used to declare that class T inherits from class U. All
 // functions in the base class will be available to the derived class (except
 // when they share a function name, in which case the derived class's function
 // wins). This also allows luaW_to<T> to cast your object appropriately, as
 // casts straight through a void pointer do not work.
+//
+// If flatten is true, the inherited methods are copied into T's metatable as
+// with luaW_flatten.
 template <typename T, typename U>
-void luaW_extend(lua_State* L) {
+void luaW_extend(lua_State* L, bool flatten = false) {
   if (!LuaWrapper<T>::classname) {
     luaL_error(L, "attempting to call extend on a type that has not been registered");
   }
@@ -589,16 +2014,22 @@ void luaW_extend(lua_State* L) {
 
   LuaWrapper<T>::cast = luaW_cast<T, U>;
   LuaWrapper<T>::identifier = luaW_identify<T, U>;
-  LuaWrapper<T>::postconstructorrecurse = luaW_postconstructorinternal<U>;
+  LuaWrapper<T>::postconstructorrecurse = luaW_collectpostconstructors<U>;
+  luaW_invalidatepostconstructors(L);
+  luaW_invalidatemethods(L);
+  luaW_MemoryAccount* account = luaW_memoryaccount(L);
+  if (account) account->charges.clear();
 
   luaL_getmetatable(L, LuaWrapper<T>::classname);  // mt
   luaL_getmetatable(L, LuaWrapper<U>::classname);  // mt emt
 
   // Point T's metatable __index at U's metatable for inheritance
-  lua_newtable(L);                 // mt emt {}
-  lua_pushvalue(L, -2);            // mt emt {} emt
-  lua_setfield(L, -2, "__index");  // mt emt {}
-  lua_setmetatable(L, -3);         // mt emt
+  lua_newtable(L);                               // mt emt {}
+  lua_pushvalue(L, -2);                          // mt emt {} emt
+  lua_setfield(L, -2, "__index");                // mt emt {}
+  lua_pushcfunction(L, luaW_metatablenewindex);  // mt emt {} newindex
+  lua_setfield(L, -2, "__newindex");             // mt emt {}
+  lua_setmetatable(L, -3);                       // mt emt
 
   // Set up per-type tables to point at parent type
   lua_getfield(L, LUA_REGISTRYINDEX, LUAW_WRAPPER_KEY);  // ... LuaWrapper
@@ -632,6 +2063,9 @@ void luaW_extend(lua_State* L) {
   }
 
   lua_pop(L, 4);  // mt emt
+
+  if (flatten) luaW_flatten<T>(L);
+  luaW_reflatten(L);
 }
 
 #endif  // LUA_WRAPPER_H_
@@ -0,0 +1,232 @@
+/*
+ * Copyright (c) 2010-2013 Alexander Ames
+ * Alexander.Ames@gmail.com
+ */
+
+// luaU_Actor gives several threads safe access to one lua_State without a
+// mutex around every call. The actor owns the state and a thread of its own;
+// other threads post closures to it and get a std::future for each one. Only
+// the actor's thread ever touches the state.
+//
+// Posting is a single atomic exchange on a lock-free queue, and the actor's
+// thread runs everything it finds queued in one batch, giving each closure's
+// slot back with an atomic decrement as it finishes, so under load there is no
+// lock handoff per call. Locks are only taken to put an idle actor to sleep
+// (or wake it), and to park producers while the queue is full.
+//
+// For example:
+//
+// lua_State* L = luaL_newstate();
+// luaL_openlibs(L);
+// luaL_dofile(L, "service.lua");
+// luaU_Actor actor(L);  // actor now owns L
+//
+// // On any thread:
+// std::future<int> result = actor.post([](lua_State* L) {
+//   lua_getglobal(L, "handle");
+//   return lua_pcall(L, 0, 0, 0);
+// });
+//
+// A queue holds at most capacity closures that have been posted but not yet
+// finished. post blocks while it is full, and trypost returns an empty
+// std::optional instead. Closures must not let a Lua error escape (use
+// lua_pcall), but exceptions are passed along through the future. Destroying
+// the actor runs whatever is still queued, stops its thread and closes the
+// state.
+
+#ifndef LUAWRAPPERACTOR_HPP_
+#define LUAWRAPPERACTOR_HPP_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+#include "luawrapper.hpp"
+
+class luaU_Actor {
+ public:
+  explicit luaU_Actor(lua_State* L, size_t capacity = 1024) : L(L), capacity(capacity ? capacity : 1), head(&stub), tail(&stub), count(0), blocked(0), sleeping(false), stopping(false) {
+    stub.next.store(NULL, std::memory_order_relaxed);
+    worker = std::thread([this] { loop(); });
+  }
+
+  ~luaU_Actor() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping.store(true);
+    }
+    notempty.notify_one();
+    worker.join();
+    lua_close(L);
+  }
+
+  luaU_Actor(const luaU_Actor&) = delete;
+  luaU_Actor& operator=(const luaU_Actor&) = delete;
+
+  // Queues f to be called with the state on the actor's thread, waiting for
+  // room in the queue if it is full.
+  template <typename F>
+  std::future<std::invoke_result_t<F, lua_State*>> post(F f) {
+    reserve(true);
+    return enqueue(std::move(f));
+  }
+
+  // Like post, but returns an empty std::optional instead of waiting if the
+  // queue is full.
+  template <typename F>
+  std::optional<std::future<std::invoke_result_t<F, lua_State*>>> trypost(F f) {
+    if (!reserve(false)) return std::nullopt;
+    return enqueue(std::move(f));
+  }
+
+  // The number of closures that have been posted but have not finished.
+  size_t size() const { return count.load(); }
+
+ private:
+  struct Node {
+    std::atomic<Node*> next;
+    void (*run)(Node*, lua_State*);
+  };
+
+  template <typename R>
+  struct TaskNode : Node {
+    std::packaged_task<R(lua_State*)> task;
+    static void call(Node* node, lua_State* L) {
+      TaskNode* self = static_cast<TaskNode*>(node);
+      self->task(L);
+      delete self;
+    }
+  };
+
+  // Claims a slot in the queue. Returns false if wait is false and the queue
+  // is full.
+  bool reserve(bool wait) {
+    size_t n = count.load();
+    for (;;) {
+      if (n < capacity) {
+        if (count.compare_exchange_weak(n, n + 1)) return true;
+        continue;
+      }
+      if (!wait) return false;
+      std::unique_lock<std::mutex> lock(mutex);
+      blocked.fetch_add(1);
+      notfull.wait(lock, [&] {
+        n = count.load();
+        return n < capacity;
+      });
+      blocked.fetch_sub(1);
+    }
+  }
+
+  template <typename F>
+  std::future<std::invoke_result_t<F, lua_State*>> enqueue(F f) {
+    typedef std::invoke_result_t<F, lua_State*> R;
+    std::unique_ptr<TaskNode<R>> node;
+    try {
+      node.reset(new TaskNode<R>());
+      node->task = std::packaged_task<R(lua_State*)>(std::move(f));
+    } catch (...) {
+      // The actor waits for every claimed slot to be pushed, so give it back
+      release();
+      throw;
+    }
+    node->run = TaskNode<R>::call;
+    std::future<R> future = node->task.get_future();
+    push(node.release());
+    if (sleeping.load()) {
+      std::lock_guard<std::mutex> lock(mutex);
+      notempty.notify_one();
+    }
+    return future;
+  }
+
+  // Gives back a slot claimed by reserve, waking a producer waiting for one.
+  void release() {
+    count.fetch_sub(1);
+    if (blocked.load()) {
+      std::lock_guard<std::mutex> lock(mutex);
+      notfull.notify_one();
+    }
+  }
+
+  // The producer side of the queue: one exchange, then link the old head to
+  // the new node.
+  void push(Node* node) {
+    node->next.store(NULL, std::memory_order_relaxed);
+    Node* prev = head.exchange(node, std::memory_order_acq_rel);
+    prev->next.store(node, std::memory_order_release);
+  }
+
+  // The consumer side of the queue. Returns NULL if the queue is empty, or if
+  // a producer is between the two steps of push.
+  Node* pop() {
+    Node* first = tail;
+    Node* next = first->next.load(std::memory_order_acquire);
+    if (first == &stub) {
+      if (!next) return NULL;
+      tail = next;
+      first = next;
+      next = next->next.load(std::memory_order_acquire);
+    }
+    if (next) {
+      tail = next;
+      return first;
+    }
+    if (first != head.load(std::memory_order_acquire)) return NULL;
+    push(&stub);
+    next = first->next.load(std::memory_order_acquire);
+    if (next) {
+      tail = next;
+      return first;
+    }
+    return NULL;
+  }
+
+  void loop() {
+    for (;;) {
+      bool ran = false;
+      while (Node* node = pop()) {
+        // Release the slot as soon as the closure is done, rather than at the
+        // end of the batch, so one that blocks does not hold on to the slots
+        // of those that ran before it
+        node->run(node, L);
+        release();
+        ran = true;
+      }
+      if (ran) continue;
+      if (count.load()) {
+        // A producer has claimed a slot but not finished pushing yet
+        std::this_thread::yield();
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(mutex);
+      sleeping.store(true);
+      notempty.wait(lock, [&] { return count.load() != 0 || stopping.load(); });
+      sleeping.store(false);
+      if (count.load() == 0 && stopping.load()) return;
+    }
+  }
+
+  lua_State* L;
+  const size_t capacity;
+  Node stub;
+  std::atomic<Node*> head;
+  Node* tail;
+  std::atomic<size_t> count;
+  std::atomic<size_t> blocked;
+  std::atomic<bool> sleeping;
+  std::atomic<bool> stopping;
+  std::mutex mutex;
+  std::condition_variable notempty;
+  std::condition_variable notfull;
+  std::thread worker;
+};
+
+#endif  // LUAWRAPPERACTOR_HPP_
@@ -0,0 +1,214 @@
+/*
+ * Copyright (c) 2010-2013 Alexander Ames
+ * Alexander.Ames@gmail.com
+ */
+
+// luaU_loadcached loads a script the way luaL_loadfile does, but keeps the
+// compiled bytecode of every script it loads in a cache directory, so that
+// later loads of the same script, in this process or the next, skip parsing
+// and compiling it.
+//
+// For example:
+//
+// if (luaU_loadcached(L, "scripts/main.lua", "cache/bytecode") || lua_pcall(L, 0, 0, 0)) {
+//   printf("%s\n", lua_tostring(L, -1));
+// }
+//
+// Cache entries are named after a hash of the script's path and contents and
+// of the Lua release and number sizes the bytecode was produced by, so a
+// script that has changed, or a cache left behind by a different build of
+// Lua, is never used. An entry that fails to load for any other reason is
+// replaced from source. Cache files are memory-mapped where the platform
+// supports it, and are written to a temporary file and renamed into place, so
+// several processes can share a cache directory.
+//
+// Bytecode is loaded without verification, so the cache directory must be no
+// more writable than the scripts themselves. Entries for old versions of a
+// script are not removed.
+
+#ifndef LUAWRAPPERBYTECODE_HPP_
+#define LUAWRAPPERBYTECODE_HPP_
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <system_error>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define LUAU_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "luawrapper.hpp"
+
+// The contents of a file, memory-mapped where possible and read into memory
+// otherwise. This is only used internally.
+class luaU_FileContents {
+ public:
+  explicit luaU_FileContents(const std::string& path) : mapped(NULL), length(0) {
+#ifdef LUAU_MMAP
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      failure = errno;
+      return;
+    }
+    struct stat info;
+    if (fstat(fd, &info) == 0) {
+      if (info.st_size == 0) {
+        valid = true;
+      } else {
+        void* map = mmap(NULL, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+          mapped = map;
+          length = static_cast<size_t>(info.st_size);
+          valid = true;
+        }
+      }
+    }
+    close(fd);
+    if (valid) return;
+#endif
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file) {
+      failure = errno;
+      return;
+    }
+    char buffer[4096];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) contents.append(buffer, n);
+    valid = !ferror(file);
+    if (!valid) failure = errno;
+    fclose(file);
+  }
+
+  ~luaU_FileContents() {
+#ifdef LUAU_MMAP
+    if (mapped) munmap(mapped, length);
+#endif
+  }
+
+  luaU_FileContents(const luaU_FileContents&) = delete;
+  luaU_FileContents& operator=(const luaU_FileContents&) = delete;
+
+  bool ok() const { return valid; }
+  // The errno of the failure, if the file could not be read.
+  int error() const { return failure; }
+  const char* data() const { return mapped ? static_cast<const char*>(mapped) : contents.data(); }
+  size_t size() const { return mapped ? length : contents.size(); }
+
+ private:
+  void* mapped;
+  size_t length;
+  std::string contents;
+  bool valid = false;
+  int failure = 0;
+};
+
+// The header at the start of every cache file. This is only used internally.
+struct luaU_BytecodeHeader {
+  char magic[4];
+  uint32_t version;
+  uint64_t hash;
+};
+
+// 64-bit FNV-1a. This is only used internally.
+inline uint64_t luaU_hashbytes(const char* data, size_t size, uint64_t hash = 14695981039346656037ull) {
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= static_cast<unsigned char>(data[i]);
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+inline int luaU_bytecodewriter(lua_State*, const void* p, size_t size, void* ud) {
+  if (p) static_cast<std::string*>(ud)->append(static_cast<const char*>(p), size);
+  return 0;
+}
+
+inline int luaU_loadbytecode(lua_State* L, const char* data, size_t size, const char* chunkname) {
+#if LUA_VERSION_NUM >= 502
+  return luaL_loadbufferx(L, data, size, chunkname, "b");
+#else
+  return luaL_loadbuffer(L, data, size, chunkname);
+#endif
+}
+
+// Loads the script at path as a function and pushes it, using and updating the
+// bytecode cache in cachedir (which is created if needed). Returns 0 or an
+// error code and pushes an error message, as luaL_loadfile does. Failing to
+// read or write the cache is not an error; the script is just compiled from
+// source.
+inline int luaU_loadcached(lua_State* L, const char* path, const char* cachedir) {
+  std::string chunkname = std::string("@") + path;
+  luaU_FileContents source(path);
+  if (!source.ok()) {
+    lua_pushfstring(L, "cannot open %s: %s", path, strerror(source.error()));
+    return LUA_ERRFILE;
+  }
+
+  // Everything that determines the bytecode goes into the name of its entry
+  const char build[] = LUA_RELEASE;
+  const size_t sizes[] = {sizeof(lua_Number), sizeof(lua_Integer), sizeof(void*), sizeof(size_t)};
+  uint64_t hash = luaU_hashbytes(chunkname.data(), chunkname.size() + 1);
+  hash = luaU_hashbytes(build, sizeof(build), hash);
+  hash = luaU_hashbytes(reinterpret_cast<const char*>(sizes), sizeof(sizes), hash);
+  hash = luaU_hashbytes(source.data(), source.size(), hash);
+  char name[32];
+  snprintf(name, sizeof(name), "%016llx.luac", static_cast<unsigned long long>(hash));
+  std::filesystem::path entry = std::filesystem::path(cachedir) / name;
+
+  {
+    luaU_FileContents cached(entry.string());
+    luaU_BytecodeHeader header = {};
+    if (cached.size() > sizeof(header)) memcpy(&header, cached.data(), sizeof(header));
+    if (memcmp(header.magic, "LWBC", 4) == 0 && header.version == LUA_VERSION_NUM && header.hash == hash) {
+      if (luaU_loadbytecode(L, cached.data() + sizeof(luaU_BytecodeHeader), cached.size() - sizeof(luaU_BytecodeHeader), chunkname.c_str()) == 0) return 0;
+      lua_pop(L, 1);
+    }
+  }
+
+  // Skip a first line starting with '#', as luaL_loadfile does, but keep its
+  // newline so that line numbers stay the same
+  const char* code = source.data();
+  size_t codesize = source.size();
+  if (codesize > 0 && code[0] == '#') {
+    const char* newline = static_cast<const char*>(memchr(code, '\n', codesize));
+    codesize = newline ? codesize - static_cast<size_t>(newline - code) : 0;
+    code = newline ? newline : code + source.size();
+  }
+  int status = luaL_loadbuffer(L, code, codesize, chunkname.c_str());  // ... f
+  if (status != 0) return status;
+
+  luaU_BytecodeHeader header = {{'L', 'W', 'B', 'C'}, LUA_VERSION_NUM, hash};
+  std::string bytecode(reinterpret_cast<const char*>(&header), sizeof(header));
+#if LUA_VERSION_NUM >= 503
+  int dumped = lua_dump(L, luaU_bytecodewriter, &bytecode, 0);
+#else
+  int dumped = lua_dump(L, luaU_bytecodewriter, &bytecode);
+#endif
+  if (dumped == 0) {
+    std::error_code error;
+    std::filesystem::create_directories(cachedir, error);
+    std::filesystem::path temp = entry;
+#ifdef LUAU_MMAP
+    temp += "." + std::to_string(getpid());
+#endif
+    temp += "." + std::to_string(reinterpret_cast<uintptr_t>(&bytecode)) + ".tmp";
+    FILE* file = fopen(temp.string().c_str(), "wb");
+    if (file) {
+      bool written = fwrite(bytecode.data(), 1, bytecode.size(), file) == bytecode.size();
+      written = fclose(file) == 0 && written;
+      if (written) std::filesystem::rename(temp, entry, error);
+      if (!written || error) std::filesystem::remove(temp, error);
+    }
+  }
+  return 0;
+}
+
+#endif  // LUAWRAPPERBYTECODE_HPP_
@@ -0,0 +1,551 @@
+/*
+ * Copyright (c) 2010-2013 Alexander Ames
+ * Alexander.Ames@gmail.com
+ */
+
+// luaU_NumArray is a userdata holding a contiguous array of float, double or
+// int32_t values, for scripts that do element-wise math on large arrays. The
+// arithmetic metamethods and reductions run over the whole array in C++, using
+// AVX2 kernels when the CPU supports them and plain loops otherwise.
+//
+// Register each element type you need under a name of your choosing:
+//
+// luaU_registernumarray<float>(L, "FloatArray");
+//
+// In Lua, arrays are created from a size and an optional fill value, or from a
+// table of numbers, and are indexed from 1 like tables:
+//
+// local a = FloatArray.new(1000, 0.5)
+// local b = FloatArray.new{ 1, 2, 3 }
+// local c = (a + a) * 2 - 1   -- element-wise, with arrays or numbers
+// print(#c, c[1], c:sum(), c:dot(a), c:min(), c:max())
+// local d = c:clamp(0, 1)     -- a new array
+// local t = d:totable()
+//
+// Because these are ordinary LuaWrapper classes, C++ can use luaW_check to get
+// at the values directly:
+//
+// luaU_NumArray<float>* array = luaW_check<luaU_NumArray<float>>(L, 1);
+// float* data = array->values.data();
+//
+// Define LUAU_NO_SIMD to always use the plain loops.
+
+#ifndef LUAWRAPPERNUMARRAY_HPP_
+#define LUAWRAPPERNUMARRAY_HPP_
+
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+#include "luawrapper.hpp"
+#include "luawrapperutil.hpp"
+
+#if !defined(LUAU_NO_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LUAU_NUMARRAY_AVX2
+#define LUAU_TARGET_AVX2 __attribute__((target("avx2")))
+#include <immintrin.h>
+#endif
+
+template <typename U>
+class luaU_NumArray {
+ public:
+  luaU_NumArray() {}
+  explicit luaU_NumArray(size_t size, U value = U()) : values(size, value) {}
+
+  std::vector<U> values;
+};
+
+// Sums of float and double arrays are accumulated in their own type, sums of
+// int32_t arrays in 64 bits.
+template <typename U>
+struct luaU_NumArraySum {
+  typedef std::conditional_t<std::is_integral_v<U>, int64_t, U> type;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Kernels
+//
+// Each operation has a plain version and, where available, an AVX2 version.
+// The ones the CPU can run are picked once, the first time an array of a given
+// element type is used. This is only used internally.
+//
+
+template <typename U>
+struct luaU_NumArrayKernels {
+  typedef typename luaU_NumArraySum<U>::type Sum;
+  void (*add)(const U* a, const U* b, U* out, size_t n);
+  void (*sub)(const U* a, const U* b, U* out, size_t n);
+  void (*mul)(const U* a, const U* b, U* out, size_t n);
+  void (*adds)(const U* a, U s, U* out, size_t n);
+  void (*subs)(const U* a, U s, U* out, size_t n);
+  void (*rsubs)(const U* a, U s, U* out, size_t n);
+  void (*muls)(const U* a, U s, U* out, size_t n);
+  void (*clamp)(const U* a, U lo, U hi, U* out, size_t n);
+  U (*min)(const U* a, size_t n);
+  U (*max)(const U* a, size_t n);
+  Sum (*sum)(const U* a, size_t n);
+  Sum (*dot)(const U* a, const U* b, size_t n);
+};
+
+#ifdef LUAU_NUMARRAY_AVX2
+template <typename U>
+struct luaU_Avx2;
+
+template <>
+struct luaU_Avx2<float> {
+  typedef __m256 Vec;
+  static const size_t width = 8;
+  static LUAU_TARGET_AVX2 Vec load(const float* p) { return _mm256_loadu_ps(p); }
+  static LUAU_TARGET_AVX2 void store(float* p, Vec v) { _mm256_storeu_ps(p, v); }
+  static LUAU_TARGET_AVX2 Vec set1(float s) { return _mm256_set1_ps(s); }
+  static LUAU_TARGET_AVX2 Vec add(Vec a, Vec b) { return _mm256_add_ps(a, b); }
+  static LUAU_TARGET_AVX2 Vec sub(Vec a, Vec b) { return _mm256_sub_ps(a, b); }
+  static LUAU_TARGET_AVX2 Vec mul(Vec a, Vec b) { return _mm256_mul_ps(a, b); }
+  static LUAU_TARGET_AVX2 Vec min(Vec a, Vec b) { return _mm256_min_ps(a, b); }
+  static LUAU_TARGET_AVX2 Vec max(Vec a, Vec b) { return _mm256_max_ps(a, b); }
+};
+
+template <>
+struct luaU_Avx2<double> {
+  typedef __m256d Vec;
+  static const size_t width = 4;
+  static LUAU_TARGET_AVX2 Vec load(const double* p) { return _mm256_loadu_pd(p); }
+  static LUAU_TARGET_AVX2 void store(double* p, Vec v) { _mm256_storeu_pd(p, v); }
+  static LUAU_TARGET_AVX2 Vec set1(double s) { return _mm256_set1_pd(s); }
+  static LUAU_TARGET_AVX2 Vec add(Vec a, Vec b) { return _mm256_add_pd(a, b); }
+  static LUAU_TARGET_AVX2 Vec sub(Vec a, Vec b) { return _mm256_sub_pd(a, b); }
+  static LUAU_TARGET_AVX2 Vec mul(Vec a, Vec b) { return _mm256_mul_pd(a, b); }
+  static LUAU_TARGET_AVX2 Vec min(Vec a, Vec b) { return _mm256_min_pd(a, b); }
+  static LUAU_TARGET_AVX2 Vec max(Vec a, Vec b) { return _mm256_max_pd(a, b); }
+};
+
+template <>
+struct luaU_Avx2<int32_t> {
+  typedef __m256i Vec;
+  static const size_t width = 8;
+  static LUAU_TARGET_AVX2 Vec load(const int32_t* p) { return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)); }
+  static LUAU_TARGET_AVX2 void store(int32_t* p, Vec v) { _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), v); }
+  static LUAU_TARGET_AVX2 Vec set1(int32_t s) { return _mm256_set1_epi32(s); }
+  static LUAU_TARGET_AVX2 Vec add(Vec a, Vec b) { return _mm256_add_epi32(a, b); }
+  static LUAU_TARGET_AVX2 Vec sub(Vec a, Vec b) { return _mm256_sub_epi32(a, b); }
+  static LUAU_TARGET_AVX2 Vec mul(Vec a, Vec b) { return _mm256_mullo_epi32(a, b); }
+  static LUAU_TARGET_AVX2 Vec min(Vec a, Vec b) { return _mm256_min_epi32(a, b); }
+  static LUAU_TARGET_AVX2 Vec max(Vec a, Vec b) { return _mm256_max_epi32(a, b); }
+};
+#endif  // LUAU_NUMARRAY_AVX2
+
+// Signed integer overflow is undefined, so integers are added, subtracted and
+// multiplied as unsigned values, which wrap around the way the AVX2 kernels
+// (and Lua 5.3 integers) do.
+template <typename U>
+auto luaU_wrapping(U value) {
+  if constexpr (std::is_integral_v<U>) {
+    return static_cast<std::make_unsigned_t<U>>(value);
+  } else {
+    return value;
+  }
+}
+
+// Each operation knows how to apply itself to a pair of scalars and, when
+// available, to a pair of AVX2 vectors.
+#ifdef LUAU_NUMARRAY_AVX2
+#define LUAU_NUMARRAY_OP(name, expr, vecexpr)                                           \
+  struct name {                                                                         \
+    template <typename U>                                                               \
+    static U apply(U a, U b) {                                                          \
+      return expr;                                                                      \
+    }                                                                                   \
+    template <typename S>                                                               \
+    static LUAU_TARGET_AVX2 typename S::Vec vec(typename S::Vec a, typename S::Vec b) { \
+      return vecexpr;                                                                   \
+    }                                                                                   \
+  };
+#else
+#define LUAU_NUMARRAY_OP(name, expr, vecexpr) \
+  struct name {                               \
+    template <typename U>                     \
+    static U apply(U a, U b) {                \
+      return expr;                            \
+    }                                         \
+  };
+#endif
+LUAU_NUMARRAY_OP(luaU_OpAdd, static_cast<U>(luaU_wrapping(a) + luaU_wrapping(b)), S::add(a, b))
+LUAU_NUMARRAY_OP(luaU_OpSub, static_cast<U>(luaU_wrapping(a) - luaU_wrapping(b)), S::sub(a, b))
+LUAU_NUMARRAY_OP(luaU_OpRsub, static_cast<U>(luaU_wrapping(b) - luaU_wrapping(a)), S::sub(b, a))
+LUAU_NUMARRAY_OP(luaU_OpMul, static_cast<U>(luaU_wrapping(a) * luaU_wrapping(b)), S::mul(a, b))
+LUAU_NUMARRAY_OP(luaU_OpMin, b < a ? b : a, S::min(a, b))
+LUAU_NUMARRAY_OP(luaU_OpMax, a < b ? b : a, S::max(a, b))
+#undef LUAU_NUMARRAY_OP
+
+template <typename U, typename Op>
+void luaU_scalarmap(const U* a, const U* b, U* out, size_t n) {
+  for (size_t i = 0; i < n; ++i) out[i] = Op::apply(a[i], b[i]);
+}
+
+template <typename U, typename Op>
+void luaU_scalarmaps(const U* a, U s, U* out, size_t n) {
+  for (size_t i = 0; i < n; ++i) out[i] = Op::apply(a[i], s);
+}
+
+template <typename U>
+void luaU_scalarclamp(const U* a, U lo, U hi, U* out, size_t n) {
+  for (size_t i = 0; i < n; ++i) out[i] = luaU_OpMin::apply(luaU_OpMax::apply(a[i], lo), hi);
+}
+
+// Reductions assume n > 0
+template <typename U, typename Op>
+U luaU_scalarreduce(const U* a, size_t n) {
+  U result = a[0];
+  for (size_t i = 1; i < n; ++i) result = Op::apply(result, a[i]);
+  return result;
+}
+
+template <typename U>
+typename luaU_NumArraySum<U>::type luaU_scalarsum(const U* a, size_t n) {
+  typename luaU_NumArraySum<U>::type result = 0;
+  for (size_t i = 0; i < n; ++i) result += a[i];
+  return result;
+}
+
+template <typename U>
+typename luaU_NumArraySum<U>::type luaU_scalardot(const U* a, const U* b, size_t n) {
+  typedef typename luaU_NumArraySum<U>::type Sum;
+  Sum result = 0;
+  for (size_t i = 0; i < n; ++i) result = static_cast<Sum>(luaU_wrapping(result) + luaU_wrapping(static_cast<Sum>(a[i])) * luaU_wrapping(static_cast<Sum>(b[i])));
+  return result;
+}
+
+#ifdef LUAU_NUMARRAY_AVX2
+template <typename U, typename Op>
+LUAU_TARGET_AVX2 void luaU_avx2map(const U* a, const U* b, U* out, size_t n) {
+  typedef luaU_Avx2<U> S;
+  size_t i = 0;
+  for (; i + S::width <= n; i += S::width) S::store(out + i, Op::template vec<S>(S::load(a + i), S::load(b + i)));
+  for (; i < n; ++i) out[i] = Op::apply(a[i], b[i]);
+}
+
+template <typename U, typename Op>
+LUAU_TARGET_AVX2 void luaU_avx2maps(const U* a, U s, U* out, size_t n) {
+  typedef luaU_Avx2<U> S;
+  typename S::Vec vs = S::set1(s);
+  size_t i = 0;
+  for (; i + S::width <= n; i += S::width) S::store(out + i, Op::template vec<S>(S::load(a + i), vs));
+  for (; i < n; ++i) out[i] = Op::apply(a[i], s);
+}
+
+template <typename U>
+LUAU_TARGET_AVX2 void luaU_avx2clamp(const U* a, U lo, U hi, U* out, size_t n) {
+  typedef luaU_Avx2<U> S;
+  typename S::Vec vlo = S::set1(lo);
+  typename S::Vec vhi = S::set1(hi);
+  size_t i = 0;
+  for (; i + S::width <= n; i += S::width) S::store(out + i, S::min(S::max(S::load(a + i), vlo), vhi));
+  for (; i < n; ++i) out[i] = luaU_OpMin::apply(luaU_OpMax::apply(a[i], lo), hi);
+}
+
+template <typename U, typename Op>
+LUAU_TARGET_AVX2 U luaU_avx2reduce(const U* a, size_t n) {
+  typedef luaU_Avx2<U> S;
+  if (n < S::width) return luaU_scalarreduce<U, Op>(a, n);
+  typename S::Vec acc = S::load(a);
+  size_t i = S::width;
+  for (; i + S::width <= n; i += S::width) acc = Op::template vec<S>(acc, S::load(a + i));
+  U lanes[S::width];
+  S::store(lanes, acc);
+  U result = luaU_scalarreduce<U, Op>(lanes, S::width);
+  for (; i < n; ++i) result = Op::apply(result, a[i]);
+  return result;
+}
+
+// Only used for float and double, whose sums are accumulated in their own type
+template <typename U>
+LUAU_TARGET_AVX2 U luaU_avx2sum(const U* a, size_t n) {
+  typedef luaU_Avx2<U> S;
+  typename S::Vec acc = S::set1(0);
+  size_t i = 0;
+  for (; i + S::width <= n; i += S::width) acc = S::add(acc, S::load(a + i));
+  U lanes[S::width];
+  S::store(lanes, acc);
+  U result = luaU_scalarsum<U>(lanes, S::width);
+  for (; i < n; ++i) result += a[i];
+  return result;
+}
+
+template <typename U>
+LUAU_TARGET_AVX2 U luaU_avx2dot(const U* a, const U* b, size_t n) {
+  typedef luaU_Avx2<U> S;
+  typename S::Vec acc = S::set1(0);
+  size_t i = 0;
+  for (; i + S::width <= n; i += S::width) acc = S::add(acc, S::mul(S::load(a + i), S::load(b + i)));
+  U lanes[S::width];
+  S::store(lanes, acc);
+  U result = luaU_scalarsum<U>(lanes, S::width);
+  for (; i < n; ++i) result += a[i] * b[i];
+  return result;
+}
+
+inline bool luaU_hasavx2() {
+  static const bool hasavx2 = (__builtin_cpu_init(), __builtin_cpu_supports("avx2") != 0);
+  return hasavx2;
+}
+#endif  // LUAU_NUMARRAY_AVX2
+
+template <typename U>
+luaU_NumArrayKernels<U> luaU_selectkernels() {
+  luaU_NumArrayKernels<U> kernels;
+  kernels.add = luaU_scalarmap<U, luaU_OpAdd>;
+  kernels.sub = luaU_scalarmap<U, luaU_OpSub>;
+  kernels.mul = luaU_scalarmap<U, luaU_OpMul>;
+  kernels.adds = luaU_scalarmaps<U, luaU_OpAdd>;
+  kernels.subs = luaU_scalarmaps<U, luaU_OpSub>;
+  kernels.rsubs = luaU_scalarmaps<U, luaU_OpRsub>;
+  kernels.muls = luaU_scalarmaps<U, luaU_OpMul>;
+  kernels.clamp = luaU_scalarclamp<U>;
+  kernels.min = luaU_scalarreduce<U, luaU_OpMin>;
+  kernels.max = luaU_scalarreduce<U, luaU_OpMax>;
+  kernels.sum = luaU_scalarsum<U>;
+  kernels.dot = luaU_scalardot<U>;
+#ifdef LUAU_NUMARRAY_AVX2
+  if (luaU_hasavx2()) {
+    kernels.add = luaU_avx2map<U, luaU_OpAdd>;
+    kernels.sub = luaU_avx2map<U, luaU_OpSub>;
+    kernels.mul = luaU_avx2map<U, luaU_OpMul>;
+    kernels.adds = luaU_avx2maps<U, luaU_OpAdd>;
+    kernels.subs = luaU_avx2maps<U, luaU_OpSub>;
+    kernels.rsubs = luaU_avx2maps<U, luaU_OpRsub>;
+    kernels.muls = luaU_avx2maps<U, luaU_OpMul>;
+    kernels.clamp = luaU_avx2clamp<U>;
+    kernels.min = luaU_avx2reduce<U, luaU_OpMin>;
+    kernels.max = luaU_avx2reduce<U, luaU_OpMax>;
+    if constexpr (std::is_floating_point_v<U>) {
+      kernels.sum = luaU_avx2sum<U>;
+      kernels.dot = luaU_avx2dot<U>;
+    }
+  }
+#endif  // LUAU_NUMARRAY_AVX2
+  return kernels;
+}
+
+template <typename U>
+const luaU_NumArrayKernels<U>& luaU_numarraykernels() {
+  static const luaU_NumArrayKernels<U> kernels = luaU_selectkernels<U>();
+  return kernels;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Lua bindings
+//
+
+// Sets the array to size copies of value. Returns false rather than throwing
+// if there is not enough memory, so that the caller can raise a Lua error once
+// nothing on its stack needs destroying.
+template <typename U>
+bool luaU_fillnumarray(luaU_NumArray<U>* array, size_t size, U value = U()) {
+  if (size > array->values.max_size()) return false;
+  try {
+    array->values.assign(size, value);
+  } catch (const std::bad_alloc&) {
+    return false;
+  }
+  return true;
+}
+
+// Creates an array of size copies of value, or returns NULL if there is not
+// enough memory.
+template <typename U>
+luaU_NumArray<U>* luaU_allocnumarray(size_t size, U value = U()) {
+  luaU_NumArray<U>* array = new (std::nothrow) luaU_NumArray<U>();
+  if (array && !luaU_fillnumarray(array, size, value)) {
+    delete array;
+    array = NULL;
+  }
+  return array;
+}
+
+// NumArray.new(size [, value]) or NumArray.new{ values... }
+template <typename U>
+luaU_NumArray<U>* luaU_numarraynew(lua_State* L) {
+  const char* classname = LuaWrapper<luaU_NumArray<U>>::classname;
+  if (lua_istable(L, 1)) {
+    // Check every value before allocating anything, since an error raised
+    // while the array is only owned from here would skip deleting it
+    size_t size = luaW_rawlen(L, 1);
+    for (size_t i = 0; i < size; ++i) {
+      lua_rawgeti(L, 1, static_cast<int>(i + 1));  // ... value
+      luaU_check<U>(L, -1);
+      lua_pop(L, 1);  // ...
+    }
+    luaU_NumArray<U>* array = luaU_allocnumarray<U>(size);
+    if (!array) luaL_error(L, "not enough memory for %s of size %f", classname, static_cast<lua_Number>(size));
+    for (size_t i = 0; i < size; ++i) {
+      lua_rawgeti(L, 1, static_cast<int>(i + 1));  // ... value
+      array->values[i] = luaU_to<U>(L, -1);
+      lua_pop(L, 1);  // ...
+    }
+    return array;
+  }
+  lua_Integer size = luaL_optinteger(L, 1, 0);
+  size_t maxsize = std::vector<U>().max_size();
+  luaL_argcheck(L, size >= 0, 1, "size must not be negative");
+  luaL_argcheck(L, static_cast<unsigned long long>(size) <= maxsize, 1, "size is too large");
+  U value = lua_isnoneornil(L, 2) ? U() : luaU_check<U>(L, 2);
+  luaU_NumArray<U>* array = luaU_allocnumarray<U>(static_cast<size_t>(size), value);
+  if (!array) luaL_error(L, "not enough memory for %s of size %f", classname, static_cast<lua_Number>(size));
+  return array;
+}
+
+// Pushes a new array of the given size that Lua owns. Its values are only
+// allocated once Lua holds it, so that an error raised while pushing cannot
+// leak them.
+template <typename U>
+luaU_NumArray<U>* luaU_pushnumarray(lua_State* L, size_t size) {
+  const char* classname = LuaWrapper<luaU_NumArray<U>>::classname;
+  luaU_NumArray<U>* array = luaU_allocnumarray<U>(0);
+  if (!array) luaL_error(L, "not enough memory for %s", classname);
+  luaW_push<luaU_NumArray<U>>(L, array);
+  luaW_hold<luaU_NumArray<U>>(L, array);
+  if (!luaU_fillnumarray(array, size)) {
+    luaL_error(L, "not enough memory for %s of size %f", classname, static_cast<lua_Number>(size));
+  }
+  return array;
+}
+
+// The arithmetic metamethods accept two arrays of the same length, or an array
+// and a number on either side.
+template <typename U, char Op>
+int luaU_numarrayarith(lua_State* L) {
+  const luaU_NumArrayKernels<U>& kernels = luaU_numarraykernels<U>();
+  luaU_NumArray<U>* a = luaW_to<luaU_NumArray<U>>(L, 1);
+  luaU_NumArray<U>* b = luaW_to<luaU_NumArray<U>>(L, 2);
+  if (a && b) {
+    size_t size = a->values.size();
+    if (b->values.size() != size) {
+      return luaL_error(L, "%s sizes differ (%d and %d)", LuaWrapper<luaU_NumArray<U>>::classname, static_cast<int>(size), static_cast<int>(b->values.size()));
+    }
+    luaU_NumArray<U>* result = luaU_pushnumarray<U>(L, size);
+    void (*kernel)(const U*, const U*, U*, size_t) = Op == '+' ? kernels.add : Op == '-' ? kernels.sub : kernels.mul;
+    kernel(a->values.data(), b->values.data(), result->values.data(), size);
+  } else if (a) {
+    U s = luaU_check<U>(L, 2);
+    luaU_NumArray<U>* result = luaU_pushnumarray<U>(L, a->values.size());
+    void (*kernel)(const U*, U, U*, size_t) = Op == '+' ? kernels.adds : Op == '-' ? kernels.subs : kernels.muls;
+    kernel(a->values.data(), s, result->values.data(), a->values.size());
+  } else {
+    U s = luaU_check<U>(L, 1);
+    b = luaW_check<luaU_NumArray<U>>(L, 2);
+    luaU_NumArray<U>* result = luaU_pushnumarray<U>(L, b->values.size());
+    void (*kernel)(const U*, U, U*, size_t) = Op == '+' ? kernels.adds : Op == '-' ? kernels.rsubs : kernels.muls;
+    kernel(b->values.data(), s, result->values.data(), b->values.size());
+  }
+  return 1;
+}
+
+template <typename U>
+int luaU_numarraylen(lua_State* L) {
+  luaU_NumArray<U>* array = luaW_check<luaU_NumArray<U>>(L, 1);
+  lua_pushinteger(L, static_cast<lua_Integer>(array->values.size()));
+  return 1;
+}
+
+// Integer keys index the array, anything else is looked up as usual
+template <typename U>
+int luaU_numarrayindex(lua_State* L) {
+  if (lua_type(L, 2) == LUA_TNUMBER) {
+    luaU_NumArray<U>* array = luaW_check<luaU_NumArray<U>>(L, 1);
+    lua_Integer i = lua_tointeger(L, 2);
+    if (i >= 1 && static_cast<size_t>(i) <= array->values.size()) {
+      luaU_push(L, array->values[static_cast<size_t>(i - 1)]);
+    } else {
+      lua_pushnil(L);
+    }
+    return 1;
+  }
+  return luaW_index<luaU_NumArray<U>>(L);
+}
+
+template <typename U>
+int luaU_numarraynewindex(lua_State* L) {
+  if (lua_type(L, 2) == LUA_TNUMBER) {
+    luaU_NumArray<U>* array = luaW_check<luaU_NumArray<U>>(L, 1);
+    lua_Integer i = lua_tointeger(L, 2);
+    luaL_argcheck(L, i >= 1 && static_cast<size_t>(i) <= array->values.size(), 2, "index out of range");
+    array->values[static_cast<size_t>(i - 1)] = luaU_check<U>(L, 3);
+    return 0;
+  }
+  return luaW_newindex<luaU_NumArray<U>>(L);
+}
+
+template <typename U>
+int luaU_numarraysum(lua_State* L) {
+  luaU_NumArray<U>* array = luaW_check<luaU_NumArray<U>>(L, 1);
+  luaU_push(L, luaU_numarraykernels<U>().sum(array->values.data(), array->values.size()));
+  return 1;
+}
+
+template <typename U>
+int luaU_numarraydot(lua_State* L) {
+  luaU_NumArray<U>* a = luaW_check<luaU_NumArray<U>>(L, 1);
+  luaU_NumArray<U>* b = luaW_check<luaU_NumArray<U>>(L, 2);
+  luaL_argcheck(L, a->values.size() == b->values.size(), 2, "sizes differ");
+  luaU_push(L, luaU_numarraykernels<U>().dot(a->values.data(), b->values.data(), a->values.size()));
+  return 1;
+}
+
+// Returns nil for an empty array
+template <typename U, bool Max>
+int luaU_numarrayextreme(lua_State* L) {
+  luaU_NumArray<U>* array = luaW_check<luaU_NumArray<U>>(L, 1);
+  if (array->values.empty()) {
+    lua_pushnil(L);
+  } else {
+    const luaU_NumArrayKernels<U>& kernels = luaU_numarraykernels<U>();
+    luaU_push(L, (Max ? kernels.max : kernels.min)(array->values.data(), array->values.size()));
+  }
+  return 1;
+}
+
+template <typename U>
+int luaU_numarrayclamp(lua_State* L) {
+  luaU_NumArray<U>* array = luaW_check<luaU_NumArray<U>>(L, 1);
+  U lo = luaU_check<U>(L, 2);
+  U hi = luaU_check<U>(L, 3);
+  luaU_NumArray<U>* result = luaU_pushnumarray<U>(L, array->values.size());
+  luaU_numarraykernels<U>().clamp(array->values.data(), lo, hi, result->values.data(), array->values.size());
+  return 1;
+}
+
+template <typename U>
+int luaU_numarraytotable(lua_State* L) {
+  luaU_NumArray<U>* array = luaW_check<luaU_NumArray<U>>(L, 1);
+  luaU_push(L, array->values);
+  return 1;
+}
+
+// Registers luaU_NumArray<U> with LuaWrapper under the given name. U must be
+// float, double or int32_t. As with luaW_register, the class table is left on
+// the stack.
+template <typename U>
+void luaU_registernumarray(lua_State* L, const char* classname) {
+  static_assert(std::is_same_v<U, float> || std::is_same_v<U, double> || std::is_same_v<U, int32_t>, "luaU_NumArray supports float, double and int32_t");
+  static const luaL_Reg metatable[] = {
+      {"__add", luaU_numarrayarith<U, '+'>},
+      {"__sub", luaU_numarrayarith<U, '-'>},
+      {"__mul", luaU_numarrayarith<U, '*'>},
+      {"__len", luaU_numarraylen<U>},
+      {"__index", luaU_numarrayindex<U>},
+      {"__newindex", luaU_numarraynewindex<U>},
+      {"sum", luaU_numarraysum<U>},
+      {"dot", luaU_numarraydot<U>},
+      {"min", luaU_numarrayextreme<U, false>},
+      {"max", luaU_numarrayextreme<U, true>},
+      {"clamp", luaU_numarrayclamp<U>},
+      {"totable", luaU_numarraytotable<U>},
+      {NULL, NULL},
+  };
+  luaW_register<luaU_NumArray<U>>(L, classname, NULL, metatable, luaU_numarraynew<U>);
+}
+
+#endif  // LUAWRAPPERNUMARRAY_HPP_
@@ -0,0 +1,213 @@
+/*
+ * Copyright (c) 2010-2013 Alexander Ames
+ * Alexander.Ames@gmail.com
+ */
+
+// luaU_reload re-runs a script that has changed in a live lua_State, rather
+// than closing the state and registering every class again. The wrapped
+// objects, their storage tables, the cache and the holds are all left alone,
+// so existing userdata keep working, and they pick up the new methods through
+// their metatables.
+//
+// For example:
+//
+// if (luaU_loadcached(L, "scripts/player.lua", "cache") || luaU_reload(L, "scripts/player.lua")) {
+//   printf("%s\n", lua_tostring(L, -1));
+// }
+//
+// Each reload of a script first removes the methods its previous run added to
+// the metatables of the registered classes (restoring any C++ method it
+// replaced), and then runs the new version, so methods that were deleted from
+// the script go away as well. If the script raises an error, every class
+// metatable is put back the way it was before the reload, so objects never see
+// half of the old methods and half of the new ones.
+//
+// The work done besides running the script is proportional to the number of
+// methods of the registered classes, not to the number of live objects. Only
+// the class metatables are tracked; anything else the script assigns, such as
+// globals, is simply assigned again.
+
+#ifndef LUAWRAPPERRELOAD_HPP_
+#define LUAWRAPPERRELOAD_HPP_
+
+#include "luawrapper.hpp"
+#include "luawrapperutil.hpp"
+
+// The address of this is used as the registry key for the methods each script
+// added the last time it ran, and as the value recorded for a method that did
+// not exist before. This is only used internally.
+inline void* luaU_reloadkey() {
+  static char key;
+  return &key;
+}
+
+// Pushes a shallow copy of the table at the absolute index index. This is only
+// used internally.
+inline void luaU_copytable(lua_State* L, int index) {
+  lua_newtable(L);  // ... copy
+  for (lua_pushnil(L); lua_next(L, index); lua_pop(L, 1)) {
+    // ... copy k v
+    lua_pushvalue(L, -2);  // ... copy k v k
+    lua_pushvalue(L, -2);  // ... copy k v k v
+    lua_rawset(L, -5);     // ... copy k v
+  }
+}
+
+// Makes the table at the absolute index table hold exactly what the table at
+// the absolute index from holds. This is only used internally.
+inline void luaU_restoretable(lua_State* L, int table, int from) {
+  for (lua_pushnil(L); lua_next(L, table); lua_pop(L, 1)) {
+    // ... k v
+    lua_pushvalue(L, -2);  // ... k v k
+    lua_pushnil(L);        // ... k v k nil
+    lua_rawset(L, table);  // ... k v
+  }
+  for (lua_pushnil(L); lua_next(L, from); lua_pop(L, 1)) {
+    // ... k v
+    lua_pushvalue(L, -2);  // ... k v k
+    lua_pushvalue(L, -2);  // ... k v k v
+    lua_rawset(L, table);  // ... k v
+  }
+}
+
+// Pushes a table mapping the metatable of every class registered in this
+// state to a shallow copy of it. This is only used internally.
+inline void luaU_copymetatables(lua_State* L) {
+  lua_newtable(L);  // ... copies
+  int copies = lua_gettop(L);
+  lua_getfield(L, LUA_REGISTRYINDEX, LUAW_WRAPPER_KEY);  // ... copies LuaWrapper
+  if (lua_istable(L, -1)) {
+    lua_getfield(L, -1, LUAW_STORAGE_KEY);  // ... copies LuaWrapper storage
+    for (lua_pushnil(L); lua_next(L, -2); lua_pop(L, 1)) {
+      // ... copies LuaWrapper storage classname store
+      if (lua_type(L, -2) != LUA_TSTRING) continue;
+      luaL_getmetatable(L, lua_tostring(L, -2));  // ... classname store mt
+      if (lua_istable(L, -1)) {
+        luaU_copytable(L, lua_gettop(L));  // ... classname store mt copy
+        lua_rawset(L, copies);             // ... classname store
+      } else {
+        lua_pop(L, 1);  // ... classname store
+      }
+    }
+    lua_pop(L, 1);  // ... copies LuaWrapper
+  }
+  lua_pop(L, 1);  // ... copies
+}
+
+// Runs the function on the top of the stack, typically a script that has just
+// been loaded, as a new version of the script called name, as described above.
+// The function is popped. Returns 0 on success, or the error code of
+// lua_pcall and pushes the error message (with a traceback on Lua 5.2 and
+// later) if the script raised an error, in which case the class metatables
+// are left as they were.
+inline int luaU_reload(lua_State* L, const char* name) {
+  // ... f
+  int func = lua_gettop(L);
+  lua_pushcfunction(L, luaU_errorhandler);  // ... f handler
+  lua_insert(L, func);                      // ... handler f
+  int handler = func++;
+  luaU_copymetatables(L);  // ... handler f backups
+  int backups = lua_gettop(L);
+
+  lua_pushlightuserdata(L, luaU_reloadkey());  // ... backups key
+  lua_rawget(L, LUA_REGISTRYINDEX);            // ... backups reloads
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);                               // ... backups
+    lua_newtable(L);                             // ... backups reloads
+    lua_pushlightuserdata(L, luaU_reloadkey());  // ... backups reloads key
+    lua_pushvalue(L, -2);                        // ... backups reloads key reloads
+    lua_rawset(L, LUA_REGISTRYINDEX);            // ... backups reloads
+  }
+  int reloads = lua_gettop(L);
+
+  // Take out what the previous version of the script added
+  lua_getfield(L, reloads, name);  // ... reloads record
+  if (lua_istable(L, -1)) {
+    for (lua_pushnil(L); lua_next(L, -2); lua_pop(L, 1)) {
+      // ... reloads record mt defs
+      for (lua_pushnil(L); lua_next(L, -2); lua_pop(L, 1)) {
+        // ... reloads record mt defs k old
+        lua_pushvalue(L, -2);  // ... mt defs k old k
+        if (lua_touserdata(L, -2) == luaU_reloadkey()) {
+          lua_pushnil(L);  // ... mt defs k old k nil
+        } else {
+          lua_pushvalue(L, -2);  // ... mt defs k old k old
+        }
+        lua_rawset(L, -6);  // ... mt defs k old
+      }
+    }
+  }
+  lua_pop(L, 1);  // ... reloads
+
+  luaU_copymetatables(L);  // ... reloads bases
+  int bases = lua_gettop(L);
+
+  lua_pushvalue(L, func);                    // ... reloads bases f
+  int status = lua_pcall(L, 0, 0, handler);  // ... reloads bases
+  if (status != 0) {
+    // ... reloads bases msg
+    for (lua_pushnil(L); lua_next(L, backups); lua_pop(L, 1)) {
+      // ... msg mt backup
+      luaU_restoretable(L, lua_gettop(L) - 1, lua_gettop(L));
+    }
+    lua_replace(L, handler);  // ... msg f backups reloads bases
+    lua_settop(L, handler);   // ... msg
+  } else {
+    // Record what this version added or replaced, along with what was there
+    // before, so the next reload can take it out again
+    lua_newtable(L);  // ... reloads bases record
+    int record = lua_gettop(L);
+    for (lua_pushnil(L); lua_next(L, bases); lua_pop(L, 1)) {
+      // ... record mt base
+      int mt = lua_gettop(L) - 1;
+      int base = mt + 1;
+      lua_newtable(L);  // ... record mt base defs
+      int defs = base + 1;
+      bool changed = false;
+      for (lua_pushnil(L); lua_next(L, mt); lua_pop(L, 1)) {
+        // ... defs k v
+        lua_pushvalue(L, -2);  // ... defs k v k
+        lua_rawget(L, base);   // ... defs k v old
+        if (!lua_rawequal(L, -1, -2)) {
+          if (lua_isnil(L, -1)) {
+            lua_pop(L, 1);                               // ... defs k v
+            lua_pushlightuserdata(L, luaU_reloadkey());  // ... defs k v old
+          }
+          lua_pushvalue(L, -3);  // ... defs k v old k
+          lua_insert(L, -2);     // ... defs k v k old
+          lua_rawset(L, defs);   // ... defs k v
+          changed = true;
+        } else {
+          lua_pop(L, 1);  // ... defs k v
+        }
+      }
+      for (lua_pushnil(L); lua_next(L, base); lua_pop(L, 1)) {
+        // ... defs k old
+        lua_pushvalue(L, -2);  // ... defs k old k
+        lua_rawget(L, mt);     // ... defs k old v
+        if (lua_isnil(L, -1)) {
+          lua_pushvalue(L, -3);  // ... defs k old v k
+          lua_pushvalue(L, -3);  // ... defs k old v k old
+          lua_rawset(L, defs);   // ... defs k old v
+          changed = true;
+        }
+        lua_pop(L, 1);  // ... defs k old
+      }
+      if (changed) {
+        lua_pushvalue(L, mt);   // ... record mt base defs mt
+        lua_insert(L, -2);      // ... record mt base mt defs
+        lua_rawset(L, record);  // ... record mt base
+      } else {
+        lua_pop(L, 1);  // ... record mt base
+      }
+    }
+    lua_setfield(L, reloads, name);  // ... reloads bases
+    lua_settop(L, handler - 1);      // ...
+  }
+
+  luaW_reflatten(L);
+  luaW_invalidatepostconstructors(L);
+  return status;
+}
+
+#endif  // LUAWRAPPERRELOAD_HPP_
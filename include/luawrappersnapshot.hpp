@@ -0,0 +1,552 @@
+/*
+ * Copyright (c) 2010-2013 Alexander Ames
+ * Alexander.Ames@gmail.com
+ */
+
+// luaU_Snapshot saves the per-object state that scripts have attached to
+// wrapped objects, so a restarted process can put it back instead of having
+// scripts rebuild it. A snapshot covers every object of the types added to it
+// that has a storage table or is held by Lua, plus any other object of those
+// types that their storage tables refer to. For each object it records
+// whether Lua held it, whatever the type's save hook writes about the C++
+// object, and its storage table.
+//
+// For example:
+//
+// void SaveUnit(luaU_SnapshotWriter& out, Unit* unit) {
+//   out.write(unit->id);
+//   out.writestring(unit->name);
+// }
+//
+// Unit* LoadUnit(lua_State* L, luaU_SnapshotReader& in) {
+//   int id = in.read<int>();
+//   return new Unit(id, std::string(in.readstring()));
+// }
+//
+// luaU_Snapshot snapshot;
+// snapshot.addtype<Unit, SaveUnit, LoadUnit>();
+// std::string bytes = snapshot.save(L);
+// ...
+// // In the new process, after registering Unit:
+// snapshot.restore(L, data, size);  // data may point into a memory-mapped file
+//
+// The load hook can return a new object, which is then held by Lua if the
+// original was, or find the existing C++ object that corresponds to the saved
+// one. Returning NULL drops that object from the restore.
+//
+// The format is binary and compact: every string in the storage tables is
+// written once in a string table and referred to by index, and everything
+// else is length-prefixed or fixed size, in the machine's native byte order.
+// Storage tables may contain nil, booleans, numbers, strings, tables (shared
+// and cyclic references are preserved, metatables are not) and objects of the
+// added types. Other values (functions, threads and other userdata), and
+// tables nested more than luaU_Snapshot::maxdepth deep, are skipped along
+// with their key.
+
+#ifndef LUAWRAPPERSNAPSHOT_HPP_
+#define LUAWRAPPERSNAPSHOT_HPP_
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#include "luawrapper.hpp"
+
+// Appends fixed size values and length-prefixed strings to a buffer.
+class luaU_SnapshotWriter {
+ public:
+  explicit luaU_SnapshotWriter(std::string& out) : out(out) {}
+
+  template <typename U>
+  void write(U value) {
+    static_assert(std::is_arithmetic<U>::value, "luaU_SnapshotWriter only writes numeric and boolean values");
+    out.append(reinterpret_cast<const char*>(&value), sizeof(U));
+  }
+
+  void writestring(std::string_view str) {
+    write(static_cast<uint32_t>(str.size()));
+    out.append(str.data(), str.size());
+  }
+
+ private:
+  std::string& out;
+};
+
+// Reads back what a luaU_SnapshotWriter wrote, straight out of the memory it
+// is given. Reading past the end returns zeros and empty strings, and makes
+// ok return false.
+class luaU_SnapshotReader {
+ public:
+  luaU_SnapshotReader(const char* data, size_t size) : data(data), size(size), position(0), failed(false) {}
+
+  template <typename U>
+  U read() {
+    static_assert(std::is_arithmetic<U>::value, "luaU_SnapshotReader only reads numeric and boolean values");
+    U value = U();
+    if (size - position >= sizeof(U)) {
+      memcpy(&value, data + position, sizeof(U));
+      position += sizeof(U);
+    } else {
+      failed = true;
+    }
+    return value;
+  }
+
+  std::string_view readstring() { return readbytes(read<uint32_t>()); }
+
+  // Returns the next len bytes without copying them.
+  std::string_view readbytes(size_t len) {
+    if (failed || size - position < len) {
+      failed = true;
+      return std::string_view();
+    }
+    std::string_view bytes(data + position, len);
+    position += len;
+    return bytes;
+  }
+
+  bool ok() const { return !failed; }
+
+ private:
+  const char* data;
+  size_t size;
+  size_t position;
+  bool failed;
+};
+
+class luaU_Snapshot {
+ public:
+  // Includes objects of type T in snapshots. T must be registered with
+  // LuaWrapper in any state the snapshot is saved from or restored into.
+  template <typename T, void (*Save)(luaU_SnapshotWriter&, T*), T* (*Load)(lua_State*, luaU_SnapshotReader&)>
+  void addtype() {
+    types.push_back(Type{Thunks<T, Save, Load>::classname, Thunks<T, Save, Load>::to, Thunks<T, Save, Load>::identify, luaW_wrapperfield<T>, Thunks<T, Save, Load>::push, Thunks<T, Save, Load>::hold, Thunks<T, Save, Load>::save, Thunks<T, Save, Load>::load, Thunks<T, Save, Load>::discard});
+  }
+
+  // Returns the snapshot of L.
+  std::string save(lua_State* L) {
+    Saver saver(L, types);
+    return saver.run();
+  }
+
+  // Restores a snapshot into L, which must have every added type registered
+  // and must not already hold the objects being restored. On success, pushes
+  // an array of the restored objects (in the order they were saved, with
+  // holes where a load hook returned NULL) and returns true. If the data is
+  // malformed or names a type that was not added, pushes nothing and returns
+  // false. Objects that load hooks returned by then are left to the garbage
+  // collector if Lua was to hold them; the others are deleted with the type's
+  // deallocator unless Lua already had a userdata for them, as nothing would
+  // own them otherwise.
+  bool restore(lua_State* L, const char* data, size_t size) {
+    int top = lua_gettop(L);
+    Restorer restorer(L, types, data, size);
+    if (!restorer.run()) {
+      lua_settop(L, top);
+      restorer.discard();
+      return false;
+    }
+    return true;
+  }
+
+  // How deeply tables may nest in a storage table.
+  static const int maxdepth = 200;
+
+ private:
+  struct Type {
+    const char* (*classname)();
+    void* (*to)(lua_State*, int);
+    void (*identify)(lua_State*, void*);
+    void (*field)(lua_State*, const char*);
+    void (*push)(lua_State*, void*);
+    void (*hold)(lua_State*, void*);
+    void (*save)(luaU_SnapshotWriter&, void*);
+    void* (*load)(lua_State*, luaU_SnapshotReader&);
+    void (*discard)(lua_State*, void*);
+  };
+
+  template <typename T, void (*Save)(luaU_SnapshotWriter&, T*), T* (*Load)(lua_State*, luaU_SnapshotReader&)>
+  struct Thunks {
+    static const char* classname() { return LuaWrapper<T>::classname; }
+    static void* to(lua_State* L, int index) { return luaW_to<T>(L, index); }
+    static void identify(lua_State* L, void* obj) { LuaWrapper<T>::identifier(L, static_cast<T*>(obj)); }
+    static void push(lua_State* L, void* obj) { luaW_push<T>(L, static_cast<T*>(obj)); }
+    static void hold(lua_State* L, void* obj) { luaW_hold<T>(L, static_cast<T*>(obj)); }
+    static void save(luaU_SnapshotWriter& out, void* obj) { Save(out, static_cast<T*>(obj)); }
+    static void* load(lua_State* L, luaU_SnapshotReader& in) { return Load(L, in); }
+    static void discard(lua_State* L, void* obj) {
+      luaW_detach<T>(L, static_cast<T*>(obj));
+      if (LuaWrapper<T>::deallocator) LuaWrapper<T>::deallocator(L, static_cast<T*>(obj));
+    }
+  };
+
+  enum Tag : uint8_t { Nil, False, True, Integer, Number, String, Table, TableRef, Object, End };
+
+  struct Saver {
+    struct Entry {
+      uint32_t type;
+      void* obj;
+      bool held;
+    };
+
+    Saver(lua_State* L, const std::vector<Type>& types) : L(L), types(types), out(values) {}
+
+    std::string run() {
+      // Collect the objects with a storage table or a hold
+      for (uint32_t t = 0; t < types.size(); ++t) {
+        luaL_getmetatable(L, types[t].classname());  // ... mt
+        metatables[lua_topointer(L, -1)] = t;
+        lua_pop(L, 1);  // ...
+        collect(t, LUAW_STORAGE_KEY);
+        collect(t, LUAW_HOLDS_KEY);
+      }
+
+      // Write each object's storage table; this may find more objects
+      for (size_t i = 0; i < entries.size(); ++i) {
+        const Type& type = types[entries[i].type];
+        type.field(L, LUAW_STORAGE_KEY);   // ... storage
+        type.identify(L, entries[i].obj);  // ... storage id
+        lua_gettable(L, -2);               // ... storage store
+        writevalue(lua_gettop(L));
+        lua_pop(L, 2);  // ...
+      }
+
+      std::string result;
+      luaU_SnapshotWriter header(result);
+      result.append("LWSS", 4);
+      header.write<uint32_t>(LUA_VERSION_NUM);
+      header.write<uint32_t>(static_cast<uint32_t>(strings.size()));
+      for (const std::string* str : strings) header.writestring(*str);
+      header.write<uint32_t>(static_cast<uint32_t>(types.size()));
+      for (const Type& type : types) header.writestring(type.classname());
+      header.write<uint32_t>(static_cast<uint32_t>(entries.size()));
+      for (const Entry& entry : entries) {
+        std::string payload;
+        luaU_SnapshotWriter payloadwriter(payload);
+        types[entry.type].save(payloadwriter, entry.obj);
+        header.write<uint32_t>(entry.type);
+        header.write<uint8_t>(entry.held);
+        header.writestring(payload);
+      }
+      result.append(values);
+      return result;
+    }
+
+    // Adds every object keyed in T's storage or holds table.
+    void collect(uint32_t t, const char* field) {
+      types[t].field(L, field);           // ... table
+      types[t].field(L, LUAW_CACHE_KEY);  // ... table cache
+      lua_pushnil(L);                     // ... table cache id
+      while (lua_next(L, -3)) {
+        lua_pop(L, 1);         // ... table cache id
+        lua_pushvalue(L, -1);  // ... table cache id id
+        lua_gettable(L, -3);   // ... table cache id ud
+        if (lua_isuserdata(L, -1) && types[t].to(L, -1)) addobject(t, lua_gettop(L));
+        lua_pop(L, 1);  // ... table cache id
+      }
+      lua_pop(L, 2);  // ...
+    }
+
+    // Returns the position of the object of type t at index, adding it if it
+    // is new.
+    uint32_t addobject(uint32_t t, int index) {
+      const void* ud = lua_touserdata(L, index);
+      std::unordered_map<const void*, uint32_t>::iterator it = objects.find(ud);
+      if (it != objects.end()) return it->second;
+      void* obj = types[t].to(L, index);
+      types[t].field(L, LUAW_HOLDS_KEY);  // ... holds
+      types[t].identify(L, obj);          // ... holds id
+      lua_gettable(L, -2);                // ... holds hold
+      bool held = lua_toboolean(L, -1) != 0;
+      lua_pop(L, 2);  // ...
+      uint32_t position = static_cast<uint32_t>(entries.size());
+      entries.push_back(Entry{t, obj, held});
+      objects[ud] = position;
+      return position;
+    }
+
+    // Whether the value at index can be written. If it is an object of one
+    // of the types, t is set to its type.
+    bool saveable(int index, uint32_t* t) {
+      switch (lua_type(L, index)) {
+        case LUA_TNIL:
+        case LUA_TBOOLEAN:
+        case LUA_TNUMBER:
+        case LUA_TSTRING:
+          return true;
+        case LUA_TTABLE:
+          return depth < maxdepth || tables.count(lua_topointer(L, index)) != 0;
+        case LUA_TUSERDATA: {
+          if (!lua_getmetatable(L, index)) return false;  // ... mt
+          std::unordered_map<const void*, uint32_t>::iterator it = metatables.find(lua_topointer(L, -1));
+          lua_pop(L, 1);  // ...
+          if (it == metatables.end() || !types[it->second].to(L, index)) return false;
+          *t = it->second;
+          return true;
+        }
+        default:
+          return false;
+      }
+    }
+
+    void writevalue(int index) {
+      uint32_t t = 0;
+      switch (lua_type(L, index)) {
+        case LUA_TBOOLEAN:
+          out.write<uint8_t>(lua_toboolean(L, index) ? True : False);
+          break;
+        case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+          if (lua_isinteger(L, index)) {
+            out.write<uint8_t>(Integer);
+            out.write<int64_t>(lua_tointeger(L, index));
+            break;
+          }
+#endif
+          out.write<uint8_t>(Number);
+          out.write<double>(lua_tonumber(L, index));
+          break;
+        case LUA_TSTRING: {
+          size_t len;
+          const char* str = lua_tolstring(L, index, &len);
+          std::pair<std::unordered_map<std::string, uint32_t>::iterator, bool> result = stringindices.emplace(std::string(str, len), static_cast<uint32_t>(strings.size()));
+          if (result.second) strings.push_back(&result.first->first);
+          out.write<uint8_t>(String);
+          out.write<uint32_t>(result.first->second);
+          break;
+        }
+        case LUA_TTABLE:
+          writetable(index);
+          break;
+        case LUA_TUSERDATA:
+          if (saveable(index, &t)) {
+            out.write<uint8_t>(Object);
+            out.write<uint32_t>(addobject(t, index));
+            break;
+          }
+          out.write<uint8_t>(Nil);
+          break;
+        default:
+          out.write<uint8_t>(Nil);
+          break;
+      }
+    }
+
+    void writetable(int index) {
+      const void* table = lua_topointer(L, index);
+      std::unordered_map<const void*, uint32_t>::iterator it = tables.find(table);
+      if (it != tables.end()) {
+        out.write<uint8_t>(TableRef);
+        out.write<uint32_t>(it->second);
+        return;
+      }
+      if (!lua_checkstack(L, 3)) {
+        out.write<uint8_t>(Nil);
+        return;
+      }
+      tables[table] = static_cast<uint32_t>(tables.size());
+      out.write<uint8_t>(Table);
+      ++depth;
+      lua_pushnil(L);  // ... key
+      while (lua_next(L, index)) {
+        // ... key value
+        int top = lua_gettop(L);
+        uint32_t t;
+        if (saveable(top - 1, &t) && saveable(top, &t)) {
+          writevalue(top - 1);
+          writevalue(top);
+        }
+        lua_pop(L, 1);  // ... key
+      }
+      --depth;
+      out.write<uint8_t>(End);
+    }
+
+    lua_State* L;
+    const std::vector<Type>& types;
+    std::string values;
+    luaU_SnapshotWriter out;
+    std::vector<Entry> entries;
+    std::unordered_map<const void*, uint32_t> objects;
+    std::unordered_map<const void*, uint32_t> metatables;
+    std::unordered_map<const void*, uint32_t> tables;
+    std::unordered_map<std::string, uint32_t> stringindices;
+    std::vector<const std::string*> strings;
+    int depth = 0;
+  };
+
+  struct Restorer {
+    Restorer(lua_State* L, const std::vector<Type>& types, const char* data, size_t size) : L(L), types(types), in(data, size) {}
+
+    bool run() {
+      if (in.readbytes(4) != "LWSS" || in.read<uint32_t>() != LUA_VERSION_NUM) return false;
+      uint32_t stringcount = in.read<uint32_t>();
+      for (uint32_t i = 0; i < stringcount && in.ok(); ++i) strings.push_back(in.readstring());
+      uint32_t typecount = in.read<uint32_t>();
+      for (uint32_t i = 0; i < typecount && in.ok(); ++i) {
+        std::string_view name = in.readstring();
+        const Type* match = NULL;
+        for (const Type& type : types) {
+          if (type.classname() && name == type.classname()) match = &type;
+        }
+        if (!match) return false;
+        typemap.push_back(match);
+      }
+
+      // Create the objects
+      uint32_t objectcount = in.read<uint32_t>();
+      if (!in.ok()) return false;
+      lua_newtable(L);  // ... objs
+      int objs = lua_gettop(L);
+      lua_newtable(L);  // ... objs tables
+      tablesindex = lua_gettop(L);
+      for (uint32_t i = 0; i < objectcount; ++i) {
+        uint32_t t = in.read<uint32_t>();
+        bool held = in.read<uint8_t>() != 0;
+        std::string_view payload = in.readstring();
+        if (!in.ok() || t >= typemap.size()) return false;
+        luaU_SnapshotReader payloadreader(payload.data(), payload.size());
+        void* obj = typemap[t]->load(L, payloadreader);
+        objects.push_back(obj);
+        objecttypes.push_back(typemap[t]);
+        if (!obj) continue;
+        if (!held) {
+          typemap[t]->field(L, LUAW_CACHE_KEY);  // ... objs tables cache
+          typemap[t]->identify(L, obj);          // ... objs tables cache id
+          lua_gettable(L, -2);                   // ... objs tables cache ud
+          if (lua_isnil(L, -1)) created.push_back(i);
+          lua_pop(L, 2);  // ... objs tables
+        }
+        typemap[t]->push(L, obj);  // ... objs tables ud
+        lua_rawseti(L, objs, static_cast<int>(i + 1));
+        if (held) typemap[t]->hold(L, obj);
+      }
+
+      // Attach the storage tables
+      for (uint32_t i = 0; i < objectcount; ++i) {
+        if (!readvalue(objs)) return false;  // ... objs tables store
+        if (objects[i] && lua_istable(L, -1)) {
+          objecttypes[i]->field(L, LUAW_STORAGE_KEY);  // ... objs tables store storage
+          objecttypes[i]->identify(L, objects[i]);     // ... objs tables store storage id
+          lua_pushvalue(L, -3);                        // ... objs tables store storage id store
+          lua_settable(L, -3);                         // ... objs tables store storage
+          lua_pop(L, 1);                               // ... objs tables store
+        }
+        lua_pop(L, 1);  // ... objs tables
+      }
+      lua_pop(L, 1);  // ... objs
+      luaW_invalidatemethods(L);
+      return true;
+    }
+
+    // Deletes the objects that were created for entries Lua did not hold,
+    // after a failed run.
+    void discard() {
+      for (uint32_t i : created) objecttypes[i]->discard(L, objects[i]);
+    }
+
+    // Pushes the next value. Returns false, pushing nothing, if the data is
+    // malformed.
+    bool readvalue(int objs) {
+      uint8_t tag = in.read<uint8_t>();
+      return in.ok() && readvalue(objs, tag);
+    }
+
+    bool readvalue(int objs, uint8_t tag) {
+      if (!lua_checkstack(L, 4)) return false;
+      switch (tag) {
+        case Nil:
+          lua_pushnil(L);
+          return true;
+        case False:
+        case True:
+          lua_pushboolean(L, tag == True);
+          return true;
+        case Integer: {
+          int64_t value = in.read<int64_t>();
+          if (!in.ok()) return false;
+          lua_pushinteger(L, static_cast<lua_Integer>(value));
+          return true;
+        }
+        case Number: {
+          double value = in.read<double>();
+          if (!in.ok()) return false;
+          lua_pushnumber(L, value);
+          return true;
+        }
+        case String: {
+          uint32_t position = in.read<uint32_t>();
+          if (!in.ok() || position >= strings.size()) return false;
+          lua_pushlstring(L, strings[position].data(), strings[position].size());
+          return true;
+        }
+        case Table:
+          return readtable(objs);
+        case TableRef: {
+          uint32_t position = in.read<uint32_t>();
+          if (!in.ok() || position >= tablecount) return false;
+          lua_rawgeti(L, tablesindex, static_cast<int>(position + 1));  // ... table
+          return true;
+        }
+        case Object: {
+          uint32_t position = in.read<uint32_t>();
+          if (!in.ok() || position >= objects.size()) return false;
+          lua_rawgeti(L, objs, static_cast<int>(position + 1));  // ... ud
+          return true;
+        }
+        default:
+          return false;
+      }
+    }
+
+    bool readtable(int objs) {
+      if (depth >= maxdepth) return false;
+      int top = lua_gettop(L);
+      lua_newtable(L);       // ... table
+      lua_pushvalue(L, -1);  // ... table table
+      lua_rawseti(L, tablesindex, static_cast<int>(++tablecount));
+      ++depth;
+      for (;;) {
+        uint8_t tag = in.read<uint8_t>();
+        // A saved table never has a nil or NaN key
+        if (!in.ok() || tag == Nil) break;
+        if (tag == End) {
+          --depth;
+          return true;
+        }
+        if (!readvalue(objs, tag)) break;  // ... table key
+        if (lua_type(L, -1) == LUA_TNUMBER && lua_tonumber(L, -1) != lua_tonumber(L, -1)) break;
+        if (!readvalue(objs)) break;  // ... table key value
+        // Objects whose load hook returned NULL come back as nil
+        if (lua_isnil(L, -1) || lua_isnil(L, -2)) {
+          lua_pop(L, 2);  // ... table
+        } else {
+          lua_rawset(L, -3);  // ... table
+        }
+      }
+      --depth;
+      lua_settop(L, top);  // ...
+      return false;
+    }
+
+    lua_State* L;
+    const std::vector<Type>& types;
+    luaU_SnapshotReader in;
+    std::vector<std::string_view> strings;
+    std::vector<const Type*> typemap;
+    std::vector<void*> objects;
+    std::vector<const Type*> objecttypes;
+    std::vector<uint32_t> created;
+    int tablesindex = 0;
+    uint32_t tablecount = 0;
+    int depth = 0;
+  };
+
+  std::vector<Type> types;
+};
+
+#endif  // LUAWRAPPERSNAPSHOT_HPP_
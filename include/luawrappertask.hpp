@@ -0,0 +1,538 @@
+/*
+ * Copyright (c) 2010-2013 Alexander Ames
+ * Alexander.Ames@gmail.com
+ */
+
+// luaU_Task lets a bound function be written as a C++20 coroutine, so a script
+// that calls something slow (a file read, a request to another process) only
+// suspends its own Lua coroutine instead of blocking the whole state. When the
+// task has to wait, the calling Lua coroutine is yielded; when the task
+// finishes, the coroutine is resumed with the task's result as the return
+// value of the call. Thousands of such calls can be pending on one state at
+// once.
+//
+// Tasks are driven by a luaU_Executor, which is single threaded: everything,
+// including resuming Lua, happens inside luaU_Executor::run on the thread that
+// owns the lua_State. Anything a task awaits must hand the suspended coroutine
+// back to the executor with post (from the same thread) rather than resuming it
+// directly.
+//
+// For example:
+//
+// luaU_Task<std::string> ReadFile(std::string path) {
+//   std::string contents = co_await diskqueue.read(path);  // posts to the executor when done
+//   co_return contents;
+// }
+//
+// static luaL_Reg Files_table[] = {
+//     { "read", luaU_asyncstaticfunc(&ReadFile) },
+//     { NULL, NULL }
+// };
+//
+// luaU_Executor executor;
+// luaU_setexecutor(L, &executor);
+// ...
+// lua_getglobal(L, "main");
+// luaU_spawn(L, 0);
+// while (executor.pending()) { executor.run(); /* wait for I/O */ }
+//
+// And in Lua, from inside a coroutine:
+//
+// function main()
+//   local text = Files:read("config.txt")
+// end
+//
+// luaU_asyncfunc and luaU_asyncstaticfunc work like luaU_func and
+// luaU_staticfunc, but for functions that return a luaU_Task. If the task
+// finishes without ever suspending, its result is returned straight away and
+// nothing is yielded. If the task fails with an exception, the error is raised
+// in the script at the point of the call, except on Lua 5.1 which has no
+// continuations, where the call returns nil and the error message instead.
+// Tasks may co_await other tasks. Arguments are converted before the task
+// starts and must be taken by value, since the converted values are destroyed
+// before the script is suspended. Pointers to wrapped objects must stay valid
+// until the task finishes.
+// On Lua 5.2 and later, a script that resumes a coroutine waiting on a task
+// gets nothing back and the coroutine keeps waiting; on Lua 5.1 such a
+// coroutine must not be resumed by anything but the executor.
+//
+// This header is empty unless the compiler supports C++20 coroutines.
+
+#ifndef LUAWRAPPERTASK_HPP_
+#define LUAWRAPPERTASK_HPP_
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#define LUAU_TASKS
+
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include "luawrapper.hpp"
+#include "luawrapperutil.hpp"
+
+class luaU_Executor;
+
+// The part of a task's promise that does not depend on its result type. This
+// is only used internally.
+struct luaU_TaskPromiseBase {
+  struct FinalAwaiter {
+    bool await_ready() noexcept { return false; }
+    template <typename Promise>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept;
+    void await_resume() noexcept {}
+  };
+
+  std::suspend_always initial_suspend() noexcept { return {}; }
+  FinalAwaiter final_suspend() noexcept { return {}; }
+  void unhandled_exception() {
+    failed = true;
+    try {
+      throw;
+    } catch (const std::exception& e) {
+      error = e.what();
+    } catch (...) {
+      error = "unknown exception";
+    }
+  }
+
+  // Resumed when this task finishes, if another task is awaiting it
+  std::coroutine_handle<> continuation;
+  std::coroutine_handle<> self;
+  // Set when a Lua coroutine is waiting on this task. If executor is set but
+  // thread is not, the coroutine could not yield and the task is simply
+  // destroyed when it finishes
+  luaU_Executor* executor = NULL;
+  lua_State* thread = NULL;
+  int threadref = LUA_NOREF;
+  int (*pushresult)(lua_State*, luaU_TaskPromiseBase*) = NULL;
+  bool failed = false;
+  std::string error;
+};
+
+template <typename R>
+struct luaU_TaskPromise;
+
+template <typename R>
+class luaU_Task {
+ public:
+  typedef luaU_TaskPromise<R> promise_type;
+  typedef R value_type;
+
+  explicit luaU_Task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+  luaU_Task(luaU_Task&& other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+  luaU_Task(const luaU_Task&) = delete;
+  luaU_Task& operator=(const luaU_Task&) = delete;
+  ~luaU_Task() {
+    if (handle) handle.destroy();
+  }
+
+  // Starts the task and suspends the awaiting task until it finishes. A
+  // failure is rethrown in the awaiting task.
+  auto operator co_await() && {
+    struct Awaiter {
+      std::coroutine_handle<promise_type> handle;
+      bool await_ready() { return false; }
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) {
+        handle.promise().continuation = awaiting;
+        return handle;
+      }
+      R await_resume() {
+        promise_type& promise = handle.promise();
+        if (promise.failed) throw std::runtime_error(promise.error);
+        if constexpr (!std::is_void<R>::value) return std::move(*promise.value);
+      }
+    };
+    return Awaiter{handle};
+  }
+
+  // Gives up ownership of the coroutine. This is only used internally.
+  std::coroutine_handle<promise_type> release() { return std::exchange(handle, nullptr); }
+
+ private:
+  std::coroutine_handle<promise_type> handle;
+};
+
+template <typename R>
+struct luaU_TaskPromise : luaU_TaskPromiseBase {
+  luaU_Task<R> get_return_object() {
+    std::coroutine_handle<luaU_TaskPromise> handle = std::coroutine_handle<luaU_TaskPromise>::from_promise(*this);
+    self = handle;
+    return luaU_Task<R>(handle);
+  }
+  template <typename V>
+  void return_value(V&& v) {
+    value.emplace(std::forward<V>(v));
+  }
+
+  std::optional<R> value;
+};
+
+template <>
+struct luaU_TaskPromise<void> : luaU_TaskPromiseBase {
+  luaU_Task<void> get_return_object() {
+    std::coroutine_handle<luaU_TaskPromise> handle = std::coroutine_handle<luaU_TaskPromise>::from_promise(*this);
+    self = handle;
+    return luaU_Task<void>(handle);
+  }
+  void return_void() {}
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// The single-threaded executor that resumes suspended tasks and the Lua
+// coroutines waiting on them.
+//
+class luaU_Executor {
+ public:
+  // Queues handle to be resumed by the next call to run.
+  void post(std::coroutine_handle<> handle) { ready.push_back(handle); }
+
+  // An awaitable that suspends the current task until the next call to run.
+  auto yield() {
+    struct Awaiter {
+      luaU_Executor* executor;
+      bool await_ready() { return false; }
+      void await_suspend(std::coroutine_handle<> handle) { executor->post(handle); }
+      void await_resume() {}
+    };
+    return Awaiter{this};
+  }
+
+  // Resumes everything that has been posted, and every Lua coroutine whose
+  // task has finished, until there is nothing left to do without waiting.
+  // Returns the number of Lua coroutines that were resumed.
+  size_t run();
+
+  // The number of Lua coroutines waiting on a task.
+  size_t pending() const { return waiting; }
+
+  // Called with the Lua coroutine, with the error message at the top of its
+  // stack, when a coroutine resumed by run raises an error.
+  void (*errorhandler)(lua_State* thread) = NULL;
+
+  // Called when a task a Lua coroutine is waiting on finishes, when a
+  // coroutine starts waiting, and when it turns out it could not yield after
+  // all. These are only used internally.
+  void complete(luaU_TaskPromiseBase* promise) { completed.push_back(promise); }
+  void wait() { ++waiting; }
+  void unwait() { --waiting; }
+
+ private:
+  std::deque<std::coroutine_handle<>> ready;
+  std::deque<luaU_TaskPromiseBase*> completed;
+  size_t waiting = 0;
+};
+
+template <typename Promise>
+std::coroutine_handle<> luaU_TaskPromiseBase::FinalAwaiter::await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+  luaU_TaskPromiseBase& promise = handle.promise();
+  if (promise.continuation) return promise.continuation;
+  if (promise.executor) promise.executor->complete(&promise);
+  return std::noop_coroutine();
+}
+
+// Resumes a Lua coroutine with nargs values from the top of its stack. This
+// is only used internally.
+inline int luaU_resume(lua_State* thread, lua_State* from, int nargs) {
+#if LUA_VERSION_NUM >= 504
+  int nresults;
+  return lua_resume(thread, from, nargs, &nresults);
+#elif LUA_VERSION_NUM >= 502
+  return lua_resume(thread, from, nargs);
+#else
+  (void)from;
+  return lua_resume(thread, nargs);
+#endif
+}
+
+inline size_t luaU_Executor::run() {
+  size_t resumed = 0;
+  while (!ready.empty() || !completed.empty()) {
+    while (!ready.empty()) {
+      std::coroutine_handle<> handle = ready.front();
+      ready.pop_front();
+      handle.resume();
+    }
+    while (!completed.empty()) {
+      luaU_TaskPromiseBase* promise = completed.front();
+      completed.pop_front();
+      lua_State* thread = promise->thread;
+      int threadref = promise->threadref;
+      if (!thread) {
+        promise->self.destroy();
+        continue;
+      }
+      --waiting;
+      if (lua_status(thread) != LUA_YIELD) {
+        promise->self.destroy();
+        luaL_unref(thread, LUA_REGISTRYINDEX, threadref);
+        continue;
+      }
+#if LUA_VERSION_NUM >= 502
+      // The continuation only accepts a resume that starts with the promise
+      lua_pushlightuserdata(thread, promise);                // thread: promise
+      int nargs = 1 + promise->pushresult(thread, promise);  // thread: promise results...
+#else
+      int nargs = promise->pushresult(thread, promise);  // thread: results...
+#endif
+      promise->self.destroy();
+      int status = luaU_resume(thread, NULL, nargs);
+      if (status != 0 && status != LUA_YIELD && errorhandler) errorhandler(thread);
+      if (status != LUA_YIELD) lua_settop(thread, 0);
+      luaL_unref(thread, LUA_REGISTRYINDEX, threadref);
+      ++resumed;
+    }
+  }
+  return resumed;
+}
+
+// The address of this is the registry key of the state's executor. This is
+// only used internally.
+inline void* luaU_executorkey() {
+  static char key;
+  return &key;
+}
+
+// Sets the executor that drives the tasks started by scripts on L.
+inline void luaU_setexecutor(lua_State* L, luaU_Executor* executor) {
+  lua_pushlightuserdata(L, luaU_executorkey());  // ... key
+  lua_pushlightuserdata(L, executor);            // ... key executor
+  lua_rawset(L, LUA_REGISTRYINDEX);              // ...
+}
+
+inline luaU_Executor* luaU_getexecutor(lua_State* L) {
+  lua_pushlightuserdata(L, luaU_executorkey());  // ... key
+  lua_rawget(L, LUA_REGISTRYINDEX);              // ... executor
+  luaU_Executor* executor = static_cast<luaU_Executor*>(lua_touserdata(L, -1));
+  lua_pop(L, 1);  // ...
+  return executor;
+}
+
+// Calls the function below the nargs arguments at the top of the stack in a
+// new Lua coroutine, popping them. If it raises an error before its first
+// yield, the error message is left on the stack. Returns the status of the
+// first resume.
+inline int luaU_spawn(lua_State* L, int nargs) {
+  lua_State* thread = lua_newthread(L);  // ... f args... thread
+  lua_insert(L, -(nargs + 2));           // ... thread f args...
+  lua_xmove(L, thread, nargs + 1);       // ... thread
+  int status = luaU_resume(thread, L, nargs);
+  if (status != 0 && status != LUA_YIELD) {
+    lua_xmove(thread, L, 1);  // ... thread msg
+    lua_remove(L, -2);        // ... msg
+  } else {
+    if (status != LUA_YIELD) lua_settop(thread, 0);
+    lua_pop(L, 1);  // ...
+  }
+  return status;
+}
+
+// Pushes what a finished task returns to the Lua coroutine that was waiting on
+// it. On Lua 5.2 and later this starts with a flag that luaU_taskcontinue
+// turns back into either the results or an error. This is only used
+// internally.
+template <typename R>
+int luaU_pushtaskresult(lua_State* L, luaU_TaskPromiseBase* base) {
+  luaU_TaskPromise<R>* promise = static_cast<luaU_TaskPromise<R>*>(base);
+  int flag = LUA_VERSION_NUM >= 502 ? 1 : 0;
+  if (promise->failed) {
+    if (flag) {
+      lua_pushboolean(L, 0);  // false
+    } else {
+      lua_pushnil(L);  // nil
+    }
+    lua_pushlstring(L, promise->error.data(), promise->error.size());  // false|nil msg
+    return 2;
+  }
+  if (flag) lua_pushboolean(L, 1);  // [true]
+  if constexpr (std::is_void<R>::value) {
+    return flag;
+  } else {
+    luaU_pushelement(L, *promise->value);  // [true] value
+    return flag + 1;
+  }
+}
+
+#if LUA_VERSION_NUM >= 503
+inline int luaU_taskcontinue(lua_State* L, int, lua_KContext ctx);
+
+// Yields the running Lua coroutine while it waits on a task, leaving the
+// function's arguments and the promise at the absolute index marker where they
+// are. This is only used internally.
+inline int luaU_yieldtask(lua_State* L, int marker) {
+  return lua_yieldk(L, 0, marker, luaU_taskcontinue);
+}
+#elif LUA_VERSION_NUM >= 502
+inline int luaU_taskcontinue(lua_State* L);
+
+// Lua 5.2 cannot tell whether a coroutine may yield, so the yield happens in a
+// protected call, which returns the error if it could not. This is only used
+// internally.
+inline int luaU_taskyield(lua_State* L) {
+  return lua_yield(L, 0);
+}
+
+inline int luaU_yieldtask(lua_State* L, int marker) {
+  lua_pushcfunction(L, luaU_taskyield);  // args... promise yield
+  return lua_pcallk(L, 0, LUA_MULTRET, 0, marker, luaU_taskcontinue);
+}
+#endif
+
+#if LUA_VERSION_NUM >= 503
+inline int luaU_taskcontinue(lua_State* L, int, lua_KContext ctx) {
+  int marker = static_cast<int>(ctx);
+#elif LUA_VERSION_NUM >= 502
+inline int luaU_taskcontinue(lua_State* L) {
+  int marker = 0;
+  lua_getctx(L, &marker);
+#endif
+#if LUA_VERSION_NUM >= 502
+  // args... promise promise ok results...|msg
+  if (lua_gettop(L) <= marker || !lua_rawequal(L, marker, marker + 1)) {
+    // Something other than the executor resumed the coroutine, so go back to
+    // waiting. This only returns if Lua 5.2 could not yield
+    lua_settop(L, marker);  // args... promise
+    luaU_yieldtask(L, marker);
+    return lua_error(L);
+  }
+  if (!lua_toboolean(L, marker + 2)) return lua_error(L);
+  return lua_gettop(L) - (marker + 2);
+}
+#endif
+
+// Raises an error unless the running Lua coroutine can be yielded. On Lua 5.1
+// and 5.2 this only catches the main thread. This is only used internally.
+inline void luaU_checkyieldable(lua_State* L) {
+#if LUA_VERSION_NUM >= 503
+  if (!lua_isyieldable(L)) luaL_error(L, "attempt to call an asynchronous function outside a coroutine");
+#else
+  if (lua_pushthread(L)) luaL_error(L, "attempt to call an asynchronous function outside a coroutine");
+  lua_pop(L, 1);
+#endif
+}
+
+// Records that the running Lua coroutine waits on promise, so the executor
+// resumes it when the task finishes. This is only used internally.
+inline void luaU_waittask(lua_State* L, luaU_TaskPromiseBase* promise) {
+  lua_pushthread(L);  // ... thread
+  promise->threadref = luaL_ref(L, LUA_REGISTRYINDEX);
+  promise->thread = L;
+  promise->executor->wait();
+}
+
+// Starts the task and either returns its result right away or yields the
+// running Lua coroutine until it finishes. The task is only registered with
+// the executor once the coroutine is known to be able to yield. On Lua 5.2 and
+// later the yield does not return, so everything in this frame must be
+// trivially destructible, and the task is passed in as a bare handle that was
+// released by a function that has already returned. This is only used
+// internally.
+template <typename R>
+int luaU_awaittask(lua_State* L, std::coroutine_handle<luaU_TaskPromise<R>> handle) {
+  luaU_TaskPromise<R>& promise = handle.promise();
+  luaU_Executor* executor = luaU_getexecutor(L);
+  if (!executor) {
+    handle.destroy();
+    return luaL_error(L, "no luaU_Executor has been set for this state");
+  }
+  handle.resume();
+  if (handle.done()) {
+    int nresults = luaU_pushtaskresult<R>(L, &promise);  // ... [flag] results...
+    handle.destroy();
+#if LUA_VERSION_NUM >= 502
+    // Nothing was yielded, so handle the flag here instead of the continuation
+    int flag = lua_gettop(L) - nresults + 1;
+    if (!lua_toboolean(L, flag)) return lua_error(L);
+    lua_remove(L, flag);  // ... results...
+    --nresults;
+#endif
+    return nresults;
+  }
+
+  // If the yield below raises an error, the task is left to the executor to
+  // destroy once it finishes
+  promise.executor = executor;
+  promise.pushresult = luaU_pushtaskresult<R>;
+#if LUA_VERSION_NUM >= 503
+  // luaU_checkyieldable has already made sure the yield cannot fail
+  luaU_waittask(L, &promise);
+  lua_pushlightuserdata(L, static_cast<luaU_TaskPromiseBase*>(&promise));  // args... promise
+  return luaU_yieldtask(L, lua_gettop(L));
+#elif LUA_VERSION_NUM >= 502
+  luaU_waittask(L, &promise);
+  lua_pushlightuserdata(L, static_cast<luaU_TaskPromiseBase*>(&promise));  // args... promise
+  luaU_yieldtask(L, lua_gettop(L));                                        // args... promise msg
+  // The yield failed, so the coroutine is not waiting after all
+  luaL_unref(L, LUA_REGISTRYINDEX, promise.threadref);
+  promise.thread = NULL;
+  executor->unwait();
+  return lua_error(L);
+#else
+  // lua_yield raises an error before suspending anything if it cannot yield,
+  // and otherwise the coroutine only suspends once this function returns
+  int status = lua_yield(L, 0);
+  luaU_waittask(L, &promise);
+  return status;
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Wrappers for member and static functions that return a luaU_Task. As with
+// luaU_staticfunc, static functions are expected to be called with a colon.
+//
+#define luaU_asyncfunc(memberfunc) &luaU_AsyncMemberFuncWrapper<decltype(memberfunc), memberfunc>::call
+#define luaU_asyncstaticfunc(func) &luaU_AsyncStaticFuncWrapper<decltype(func), func>::call
+
+template <class MemFunPtrType, MemFunPtrType MemberFunc>
+struct luaU_AsyncMemberFuncWrapper;
+
+template <class T, class R, class... Args, luaU_Task<R> (T::*MemberFunc)(Args...)>
+struct luaU_AsyncMemberFuncWrapper<luaU_Task<R> (T::*)(Args...), MemberFunc> {
+  static_assert(!(std::is_reference<Args>::value || ...), "asynchronous functions must take their arguments by value");
+
+ public:
+  static int call(lua_State* L) {
+    luaU_checkyieldable(L);
+    return luaU_awaittask<R>(L, start(L, luaU_makeIntRange<2, sizeof...(Args)>()));
+  }
+
+ private:
+  // Converts the arguments and creates the task. The arguments are moved into
+  // the coroutine, and the converted values are destroyed when this returns,
+  // before the caller yields.
+  template <int... indices>
+  static std::coroutine_handle<luaU_TaskPromise<R>> start(lua_State* L, luaU_IntPack<indices...>) {
+    return (luaW_check<T>(L, 1)->*MemberFunc)(luaU_check<typename luaU_RemoveConstRef<Args>::type>(L, indices)...).release();
+  }
+};
+
+template <class FunPtrType, FunPtrType Func>
+struct luaU_AsyncStaticFuncWrapper;
+
+template <class R, class... Args, luaU_Task<R> (*Func)(Args...)>
+struct luaU_AsyncStaticFuncWrapper<luaU_Task<R> (*)(Args...), Func> {
+  static_assert(!(std::is_reference<Args>::value || ...), "asynchronous functions must take their arguments by value");
+
+ public:
+  static int call(lua_State* L) {
+    luaU_checkyieldable(L);
+    return luaU_awaittask<R>(L, start(L, luaU_makeIntRange<2, sizeof...(Args)>()));
+  }
+
+ private:
+  // As in luaU_AsyncMemberFuncWrapper
+  template <int... indices>
+  static std::coroutine_handle<luaU_TaskPromise<R>> start([[maybe_unused]] lua_State* L, luaU_IntPack<indices...>) {
+    return (*Func)(luaU_check<typename luaU_RemoveConstRef<Args>::type>(L, indices)...).release();
+  }
+};
+
+#endif  // __cpp_impl_coroutine
+
+#endif  // LUAWRAPPERTASK_HPP_
@@ -16,8 +16,18 @@
 #ifndef LUAWRAPPERUTILS_HPP_
 #define LUAWRAPPERUTILS_HPP_
 
+#include <array>
+#include <atomic>
 #include <cstdint>
+#include <iterator>
+#include <map>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <tuple>
 #include <type_traits>
+#include <unordered_map>
+#include <vector>
 
 #include "luawrapper.hpp"
 
@@ -39,9 +49,19 @@ struct luaU_RemoveConstRef {
 // operate on your own simple types rather than register your type with
 // LuaWrapper, especially with small objects.
 //
+// Types that are not given their own luaU_is, luaU_to or luaU_check are
+// forwarded to luaU_Convert<U>, which may be partially specialized to handle a
+// whole family of types at once (see the standard containers below).
+//
+
+template <typename U, typename Enable = void>
+struct luaU_Convert;
 
 // clang-format off
-template <typename U> bool luaU_is(lua_State* L, int index);
+template <typename U> bool luaU_is   (lua_State* L, int index) { return luaU_Convert<U>::is(L, index);    }
+template <typename U> U    luaU_to   (lua_State* L, int index) { return luaU_Convert<U>::to(L, index);    }
+template <typename U> U    luaU_check(lua_State* L, int index) { return luaU_Convert<U>::check(L, index); }
+
 template <> inline bool luaU_is<bool>       (lua_State* L, int index) { return lua_isboolean(L, index); }
 template <> inline bool luaU_is<uint8_t>    (lua_State* L, int index) { return lua_isnumber(L, index); }
 template <> inline bool luaU_is<int8_t>     (lua_State* L, int index) { return lua_isnumber(L, index); }
@@ -54,9 +74,8 @@ template <> inline bool luaU_is<int64_t>    (lua_State* L, int index) { return l
 template <> inline bool luaU_is<float>      (lua_State* L, int index) { return lua_isnumber(L, index);  }
 template <> inline bool luaU_is<double>     (lua_State* L, int index) { return lua_isnumber(L, index);  }
 template <> inline bool luaU_is<const char*>(lua_State* L, int index) { return lua_isstring(L, index);  }
+template <> inline bool luaU_is<std::string_view>(lua_State* L, int index) { return lua_isstring(L, index); }
 
-template <typename U>
-U luaU_to(lua_State* L, int index);
 template <> inline bool        luaU_to(lua_State* L, int index) { return lua_toboolean(L, index) != 0;                   }
 template <> inline uint8_t     luaU_to(lua_State* L, int index) { return static_cast<uint8_t>(lua_tointeger(L, index));  }
 template <> inline int8_t      luaU_to(lua_State* L, int index) { return static_cast<int8_t>(lua_tointeger(L, index));   }
@@ -70,8 +89,11 @@ template <> inline float       luaU_to(lua_State* L, int index) { return static_
 template <> inline double      luaU_to(lua_State* L, int index) { return static_cast<double>(lua_tonumber(L, index));    }
 template <> inline const char* luaU_to(lua_State* L, int index) { return lua_tostring(L, index);                         }
 
-template <typename U>
-U luaU_check(lua_State* L, int index);
+// The std::string_view version borrows the string from Lua rather than copying
+// it. The view is only valid while the value stays on the stack, which is the
+// case for the arguments of functions wrapped with luaU_func.
+template <> inline std::string_view luaU_to(lua_State* L, int index) { size_t len; const char* str = lua_tolstring(L, index, &len); return str ? std::string_view(str, len) : std::string_view(); }
+
 template <> inline bool        luaU_check(lua_State* L, int index) {  return lua_toboolean(L, index) != 0;                       }
 template <> inline uint8_t     luaU_check(lua_State* L, int index) {  return static_cast<uint8_t>(luaL_checkinteger(L, index));  }
 template <> inline int8_t      luaU_check(lua_State* L, int index) {  return static_cast<int8_t>(luaL_checkinteger(L, index));   }
@@ -84,6 +106,7 @@ template <> inline int64_t     luaU_check(lua_State* L, int index) {  return sta
 template <> inline float       luaU_check(lua_State* L, int index) {  return static_cast<float>(luaL_checknumber(L, index));     }
 template <> inline double      luaU_check(lua_State* L, int index) {  return static_cast<double>(luaL_checknumber(L, index));    }
 template <> inline const char* luaU_check(lua_State* L, int index) {  return luaL_checkstring(L, index);                         }
+template <> inline std::string_view luaU_check(lua_State* L, int index) { size_t len; const char* str = luaL_checklstring(L, index, &len); return std::string_view(str, len); }
 
 inline void luaU_push(lua_State* L, bool        value) { lua_pushboolean(L, value); }
 template <class T>
@@ -92,6 +115,17 @@ inline std::enable_if_t<std::is_integral_v<T> && !std::is_same_v<T, bool>>
 inline void luaU_push(lua_State* L, float       value) { lua_pushnumber(L, value);  }
 inline void luaU_push(lua_State* L, double      value) { lua_pushnumber(L, value);  }
 inline void luaU_push(lua_State* L, const char* value) { lua_pushstring(L, value);  }
+inline void luaU_push(lua_State* L, std::string_view value) { lua_pushlstring(L, value.data(), value.size()); }
+
+// Code written for older versions of LuaWrapper defined these std::string
+// conversions itself. Either remove those definitions or define
+// LUAU_NO_STD_STRING before including this file to keep using them.
+#ifndef LUAU_NO_STD_STRING
+template <> inline bool        luaU_is<std::string>(lua_State* L, int index) { return lua_isstring(L, index); }
+template <> inline std::string luaU_to            (lua_State* L, int index) { size_t len; const char* str = lua_tolstring(L, index, &len); return str ? std::string(str, len) : std::string(); }
+template <> inline std::string luaU_check         (lua_State* L, int index) { size_t len; const char* str = luaL_checklstring(L, index, &len); return std::string(str, len);              }
+inline void luaU_push(lua_State* L, const std::string& value) { lua_pushlstring(L, value.data(), value.size()); }
+#endif  // LUAU_NO_STD_STRING
 // clang-format on
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -109,6 +143,347 @@ U luaU_opt(lua_State* L, int index, const U& fallback = U()) {
   }
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// luaU_is, luaU_to, luaU_check and luaU_push also understand the standard
+// containers std::vector, std::array, std::map, std::unordered_map and
+// std::optional of any type they support, including other containers.
+// Sequences are converted to and from arrays, maps to and from tables keyed by
+// the converted keys, and an empty std::optional is nil.
+//
+// Tables are created presized with lua_createtable and read and written with
+// the raw accessors, so metamethods are never invoked. As with luaU_getfield,
+// containers of const char* are not supported since the strings would be
+// popped from the stack before they could be used (and likewise for
+// std::string_view).
+//
+// e.g.
+//
+// std::vector<int> ids = luaU_check<std::vector<int>>(L, 1);
+// luaU_push(L, std::map<int, double>{{1, 0.5}, {2, 0.25}});
+//
+
+template <typename U>
+void luaU_push(lua_State* L, const std::optional<U>& value);
+template <typename U, typename A>
+void luaU_push(lua_State* L, const std::vector<U, A>& value);
+template <typename U, size_t N>
+void luaU_push(lua_State* L, const std::array<U, N>& value);
+template <typename K, typename V, typename C, typename A>
+void luaU_push(lua_State* L, const std::map<K, V, C, A>& value);
+template <typename K, typename V, typename H, typename E, typename A>
+void luaU_push(lua_State* L, const std::unordered_map<K, V, H, E, A>& value);
+
+// Reads the value at index with either luaU_check or luaU_to. This is only
+// used internally.
+template <typename U, bool Check>
+U luaU_read(lua_State* L, int index) {
+  static_assert(!std::is_same<U, const char*>::value, "Containers of const char*'s are not supported. (The strings will be popped from the stack.)");
+  static_assert(!std::is_same<U, std::string_view>::value, "Containers of std::string_view's are not supported. (The strings will be popped from the stack.)");
+  if constexpr (Check) {
+    return luaU_check<U>(L, index);
+  } else {
+    return luaU_to<U>(L, index);
+  }
+}
+
+template <typename Sequence>
+void luaU_pushsequence(lua_State* L, const Sequence& value) {
+  lua_createtable(L, static_cast<int>(value.size()), 0);  // ... {}
+  int i = 1;
+  for (const auto& element : value) {
+    luaU_push(L, element);    // ... {} element
+    lua_rawseti(L, -2, i++);  // ... {}
+  }
+}
+
+template <typename Map>
+void luaU_pushmap(lua_State* L, const Map& value) {
+  lua_createtable(L, 0, static_cast<int>(value.size()));  // ... {}
+  for (const auto& entry : value) {
+    luaU_push(L, entry.first);   // ... {} k
+    luaU_push(L, entry.second);  // ... {} k v
+    lua_rawset(L, -3);           // ... {}
+  }
+}
+
+template <typename Map, bool Check>
+Map luaU_readmap(lua_State* L, int index) {
+  Map result;
+  if (Check) {
+    luaL_checktype(L, index, LUA_TTABLE);
+  } else if (!lua_istable(L, index)) {
+    return result;
+  }
+  for (lua_pushnil(L); lua_next(L, luaW_correctindex(L, index, 1)); lua_pop(L, 1)) {
+    // ... k v
+    // The key is converted from a copy, since converting it in place could
+    // turn a number into a string and confuse lua_next
+    lua_pushvalue(L, -2);  // ... k v k
+    typename Map::key_type key = luaU_read<typename Map::key_type, Check>(L, -1);
+    typename Map::mapped_type val = luaU_read<typename Map::mapped_type, Check>(L, -2);
+    result.emplace(std::move(key), std::move(val));
+    lua_pop(L, 1);  // ... k v
+  }
+  return result;
+}
+
+template <typename U>
+void luaU_push(lua_State* L, const std::optional<U>& value) {
+  if (value) {
+    luaU_push(L, *value);
+  } else {
+    lua_pushnil(L);
+  }
+}
+
+template <typename U, typename A>
+void luaU_push(lua_State* L, const std::vector<U, A>& value) {
+  luaU_pushsequence(L, value);
+}
+
+template <typename U, size_t N>
+void luaU_push(lua_State* L, const std::array<U, N>& value) {
+  luaU_pushsequence(L, value);
+}
+
+template <typename K, typename V, typename C, typename A>
+void luaU_push(lua_State* L, const std::map<K, V, C, A>& value) {
+  luaU_pushmap(L, value);
+}
+
+template <typename K, typename V, typename H, typename E, typename A>
+void luaU_push(lua_State* L, const std::unordered_map<K, V, H, E, A>& value) {
+  luaU_pushmap(L, value);
+}
+
+template <typename U>
+struct luaU_Convert<std::optional<U>> {
+  static bool is(lua_State* L, int index) { return lua_isnoneornil(L, index) || luaU_is<U>(L, index); }
+  static std::optional<U> to(lua_State* L, int index) { return lua_isnoneornil(L, index) ? std::optional<U>() : std::optional<U>(luaU_to<U>(L, index)); }
+  static std::optional<U> check(lua_State* L, int index) { return lua_isnoneornil(L, index) ? std::optional<U>() : std::optional<U>(luaU_check<U>(L, index)); }
+};
+
+template <typename U, typename A>
+struct luaU_Convert<std::vector<U, A>> {
+  static bool is(lua_State* L, int index) { return lua_istable(L, index); }
+  static std::vector<U, A> to(lua_State* L, int index) { return read<false>(L, index); }
+  static std::vector<U, A> check(lua_State* L, int index) { return read<true>(L, index); }
+
+ private:
+  template <bool Check>
+  static std::vector<U, A> read(lua_State* L, int index) {
+    std::vector<U, A> result;
+    if (Check) {
+      luaL_checktype(L, index, LUA_TTABLE);
+    } else if (!lua_istable(L, index)) {
+      return result;
+    }
+    size_t size = luaW_rawlen(L, index);
+    result.reserve(size);
+    for (size_t i = 1; i <= size; ++i) {
+      lua_rawgeti(L, index, static_cast<int>(i));  // ... element
+      result.push_back(luaU_read<U, Check>(L, -1));
+      lua_pop(L, 1);  // ...
+    }
+    return result;
+  }
+};
+
+template <typename U, size_t N>
+struct luaU_Convert<std::array<U, N>> {
+  static bool is(lua_State* L, int index) { return lua_istable(L, index); }
+  static std::array<U, N> to(lua_State* L, int index) { return read<false>(L, index); }
+  static std::array<U, N> check(lua_State* L, int index) { return read<true>(L, index); }
+
+ private:
+  template <bool Check>
+  static std::array<U, N> read(lua_State* L, int index) {
+    std::array<U, N> result{};
+    if (Check) {
+      luaL_checktype(L, index, LUA_TTABLE);
+    } else if (!lua_istable(L, index)) {
+      return result;
+    }
+    for (size_t i = 0; i < N; ++i) {
+      lua_rawgeti(L, index, static_cast<int>(i + 1));  // ... element
+      result[i] = luaU_read<U, Check>(L, -1);
+      lua_pop(L, 1);  // ...
+    }
+    return result;
+  }
+};
+
+template <typename K, typename V, typename C, typename A>
+struct luaU_Convert<std::map<K, V, C, A>> {
+  static bool is(lua_State* L, int index) { return lua_istable(L, index); }
+  static std::map<K, V, C, A> to(lua_State* L, int index) { return luaU_readmap<std::map<K, V, C, A>, false>(L, index); }
+  static std::map<K, V, C, A> check(lua_State* L, int index) { return luaU_readmap<std::map<K, V, C, A>, true>(L, index); }
+};
+
+template <typename K, typename V, typename H, typename E, typename A>
+struct luaU_Convert<std::unordered_map<K, V, H, E, A>> {
+  static bool is(lua_State* L, int index) { return lua_istable(L, index); }
+  static std::unordered_map<K, V, H, E, A> to(lua_State* L, int index) { return luaU_readmap<std::unordered_map<K, V, H, E, A>, false>(L, index); }
+  static std::unordered_map<K, V, H, E, A> check(lua_State* L, int index) { return luaU_readmap<std::unordered_map<K, V, H, E, A>, true>(L, index); }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// luaU_pushview pushes a read-only view of a C++ container instead of copying
+// it into a table. The view is a small userdata that looks up elements in the
+// live container only when a script asks for them, so a script that reads a
+// handful of entries from a large container only pays for those.
+//
+// Random access containers (std::vector, std::array, std::deque) are indexed
+// from 1 like Lua arrays, and on Lua 5.2 and later support ipairs(view).
+// Associative containers (std::map, std::unordered_map) are indexed by key.
+// Both support #view, and on Lua 5.2 and later pairs(view). Elements that are
+// pointers to classes are pushed with luaW_push, everything else with
+// luaU_push.
+//
+// e.g.
+//
+// const std::vector<Foo*>& foos = world->GetFoos();
+// luaU_pushview(L, foos);
+//
+// The view refers to the container directly: the container must outlive it,
+// and must not be modified while a script is iterating over it.
+//
+
+template <typename C, typename = void>
+struct luaU_IsMap : std::false_type {};
+
+template <typename C>
+struct luaU_IsMap<C, std::void_t<typename C::mapped_type>> : std::true_type {};
+
+template <typename U>
+void luaU_pushelement(lua_State* L, const U& value) {
+  if constexpr (std::is_pointer_v<U> && std::is_class_v<std::remove_pointer_t<U>>) {
+    typedef std::remove_const_t<std::remove_pointer_t<U>> T;
+    luaW_push<T>(L, const_cast<T*>(value));
+  } else {
+    luaU_push(L, value);
+  }
+}
+
+// The address of this is the registry key of the metatable shared by all views
+// of Container. This is only used internally.
+template <typename Container>
+void* luaU_viewkey() {
+  static char key;
+  return &key;
+}
+
+template <typename Container>
+const Container& luaU_checkview(lua_State* L, int index) {
+  const Container** view = static_cast<const Container**>(lua_touserdata(L, index));
+  bool valid = false;
+  if (view && lua_getmetatable(L, index)) {               // ... mt
+    lua_pushlightuserdata(L, luaU_viewkey<Container>());  // ... mt key
+    lua_rawget(L, LUA_REGISTRYINDEX);                     // ... mt viewmt
+    valid = lua_rawequal(L, -1, -2) != 0;
+    lua_pop(L, 2);  // ...
+  }
+  if (!valid) luaL_argerror(L, index, "container view expected");
+  return **view;
+}
+
+template <typename Container>
+int luaU_viewindex(lua_State* L) {
+  // view key
+  const Container& container = luaU_checkview<Container>(L, 1);
+  if constexpr (luaU_IsMap<Container>::value) {
+    typedef typename Container::key_type K;
+    if (luaU_is<K>(L, 2)) {
+      typename Container::const_iterator it = container.find(luaU_to<K>(L, 2));
+      if (it != container.end()) {
+        luaU_pushelement(L, it->second);  // view key value
+        return 1;
+      }
+    }
+  } else {
+    if (lua_type(L, 2) == LUA_TNUMBER) {
+      lua_Integer i = lua_tointeger(L, 2);
+      if (i >= 1 && static_cast<size_t>(i) <= container.size()) {
+        luaU_pushelement(L, container[static_cast<size_t>(i - 1)]);  // view key value
+        return 1;
+      }
+    }
+  }
+  lua_pushnil(L);  // view key nil
+  return 1;
+}
+
+template <typename Container>
+int luaU_viewlen(lua_State* L) {
+  lua_pushinteger(L, static_cast<lua_Integer>(luaU_checkview<Container>(L, 1).size()));
+  return 1;
+}
+
+// A stateless iterator: given the previous key, returns the next key and
+// value. Associative containers find the previous key again, so each step
+// costs one lookup.
+template <typename Container>
+int luaU_viewnext(lua_State* L) {
+  // view key
+  const Container& container = luaU_checkview<Container>(L, 1);
+  if constexpr (luaU_IsMap<Container>::value) {
+    typename Container::const_iterator it = container.begin();
+    if (!lua_isnil(L, 2)) {
+      it = container.find(luaU_to<typename Container::key_type>(L, 2));
+      if (it == container.end()) return luaL_error(L, "invalid key to 'next'");
+      ++it;
+    }
+    if (it == container.end()) return 0;
+    luaU_pushelement(L, it->first);   // view key nextkey
+    luaU_pushelement(L, it->second);  // view key nextkey value
+  } else {
+    size_t i = lua_isnil(L, 2) ? 0 : static_cast<size_t>(lua_tointeger(L, 2));
+    if (i >= container.size()) return 0;
+    lua_pushinteger(L, static_cast<lua_Integer>(i + 1));  // view key nextkey
+    luaU_pushelement(L, container[i]);                    // view key nextkey value
+  }
+  return 2;
+}
+
+template <typename Container>
+int luaU_viewpairs(lua_State* L) {
+  luaU_checkview<Container>(L, 1);
+  lua_pushcfunction(L, luaU_viewnext<Container>);  // view next
+  lua_pushvalue(L, 1);                             // view next view
+  lua_pushnil(L);                                  // view next view nil
+  return 3;
+}
+
+template <typename Container>
+void luaU_pushview(lua_State* L, const Container& container) {
+  *static_cast<const Container**>(lua_newuserdata(L, sizeof(const Container*))) = &container;  // ... view
+  lua_pushlightuserdata(L, luaU_viewkey<Container>());                                         // ... view key
+  lua_rawget(L, LUA_REGISTRYINDEX);                                                            // ... view mt
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);                                        // ... view
+    lua_newtable(L);                                      // ... view mt
+    lua_pushcfunction(L, luaU_viewindex<Container>);      // ... view mt __index
+    lua_setfield(L, -2, "__index");                       // ... view mt
+    lua_pushcfunction(L, luaU_viewlen<Container>);        // ... view mt __len
+    lua_setfield(L, -2, "__len");                         // ... view mt
+    lua_pushcfunction(L, luaU_viewpairs<Container>);      // ... view mt __pairs
+    lua_setfield(L, -2, "__pairs");                       // ... view mt
+#if LUA_VERSION_NUM == 502 || LUA_VERSION_NUM == 503
+    // Later versions of ipairs go through __index instead
+    if constexpr (!luaU_IsMap<Container>::value) {
+      lua_pushcfunction(L, luaU_viewpairs<Container>);  // ... view mt __ipairs
+      lua_setfield(L, -2, "__ipairs");                  // ... view mt
+    }
+#endif
+    lua_pushlightuserdata(L, luaU_viewkey<Container>());  // ... view mt key
+    lua_pushvalue(L, -2);                                 // ... view mt key mt
+    lua_rawset(L, LUA_REGISTRYINDEX);                     // ... view mt
+  }
+  lua_setmetatable(L, -2);  // ... view
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 // These are just some functions I've always felt should exist
@@ -117,6 +492,7 @@ U luaU_opt(lua_State* L, int index, const U& fallback = U()) {
 template <typename U>
 inline U luaU_getfield(lua_State* L, int index, const char* field) {
   static_assert(!std::is_same<U, const char*>::value, "luaU_getfield is not safe to use on const char*'s. (The string will be popped from the stack.)");
+  static_assert(!std::is_same<U, std::string_view>::value, "luaU_getfield is not safe to use on std::string_view's. (The string will be popped from the stack.)");
   lua_getfield(L, index, field);
   U val = luaU_to<U>(L, -1);
   lua_pop(L, 1);
@@ -126,6 +502,7 @@ inline U luaU_getfield(lua_State* L, int index, const char* field) {
 template <typename U>
 inline U luaU_checkfield(lua_State* L, int index, const char* field) {
   static_assert(!std::is_same<U, const char*>::value, "luaU_checkfield is not safe to use on const char*'s. (The string will be popped from the stack.)");
+  static_assert(!std::is_same<U, std::string_view>::value, "luaU_checkfield is not safe to use on std::string_view's. (The string will be popped from the stack.)");
   lua_getfield(L, index, field);
   U val = luaU_check<U>(L, -1);
   lua_pop(L, 1);
@@ -135,6 +512,7 @@ inline U luaU_checkfield(lua_State* L, int index, const char* field) {
 template <typename U>
 inline U luaU_optfield(lua_State* L, int index, const char* field, const U& fallback = U()) {
   static_assert(!std::is_same<U, const char*>::value, "luaU_getfield is not safe to use on const char*'s. (The string will be popped from the stack.)");
+  static_assert(!std::is_same<U, std::string_view>::value, "luaU_optfield is not safe to use on std::string_view's. (The string will be popped from the stack.)");
   lua_getfield(L, index, field);
   U val = luaU_opt<U>(L, -1, fallback);
   lua_pop(L, 1);
@@ -147,6 +525,157 @@ inline void luaU_setfield(lua_State* L, int index, const char* field, U val) {
   lua_setfield(L, luaW_correctindex(L, index, 1), field);
 }
 
+///////////////////////////////////////////////////////////////////////////////
+//
+// luaU_Key is a field name that is interned once per lua_State. Each call to
+// lua_getfield or lua_setfield has to hash the C string to find the matching
+// Lua string, which adds up when the same fields are read in a loop. Every
+// luaU_Key is given a number the first time it is used, and the first time it
+// is used on a state its string is created and stored at that number in a
+// table of interned keys. Every later use fetches it with lua_rawgeti instead.
+//
+// Each luaU_Key keeps its number for the life of the process, so keys should
+// have static storage duration rather than be created on every call. Other
+// than taking an interned name, the luaU_getfield, luaU_checkfield,
+// luaU_optfield and luaU_setfield overloads that take a luaU_Key behave exactly
+// like the ones that take a const char*, including __index and __newindex.
+//
+// e.g.
+//
+// static const luaU_Key kX("x");
+// float x = luaU_getfield<float>(L, 1, kX);
+//
+// With C++20, luaU_field<"x"> names the same kind of key without declaring it
+// first:
+//
+// float x = luaU_getfield<float>(L, 1, luaU_field<"x">);
+//
+struct luaU_Key {
+  explicit constexpr luaU_Key(const char* keyname) : name(keyname), slot(0) {}
+  const char* name;
+  mutable std::atomic<int> slot;  // Index in each state's interned keys, or 0 before first use
+};
+
+#if defined(__cpp_nontype_template_args) && __cpp_nontype_template_args >= 201911L
+template <size_t N>
+struct luaU_FixedString {
+  constexpr luaU_FixedString(const char (&str)[N]) {
+    for (size_t i = 0; i < N; ++i) value[i] = str[i];
+  }
+  char value[N];
+};
+
+template <luaU_FixedString Name>
+inline const luaU_Key luaU_field(Name.value);
+#endif
+
+// The registry key under which each state records the reference to its table
+// of interned keys. The table holds this address at index 1 to identify itself.
+inline char* luaU_keyskey() {
+  static char key;
+  return &key;
+}
+
+// Hands out the number of each luaU_Key. 1 is taken by the table's marker.
+inline std::atomic<int>& luaU_keycount() {
+  static std::atomic<int> count(2);
+  return count;
+}
+
+// Pushes this state's table of interned keys. Each thread remembers the
+// registry reference it last found, so while it keeps using the same state
+// the table is fetched with lua_rawgeti rather than a registry hash lookup.
+inline void luaU_pushkeys(lua_State* L) {
+  static thread_local int ref = LUA_NOREF;
+  if (ref > 0) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ref);  // ... keys
+    if (lua_istable(L, -1)) {
+      lua_rawgeti(L, -1, 1);  // ... keys marker
+      bool found = lua_touserdata(L, -1) == luaU_keyskey();
+      lua_pop(L, 1);  // ... keys
+      if (found) return;
+    }
+    lua_pop(L, 1);  // ...
+  }
+  lua_pushlightuserdata(L, luaU_keyskey());  // ... key
+  lua_rawget(L, LUA_REGISTRYINDEX);          // ... ref
+  if (lua_isnumber(L, -1)) {
+    ref = static_cast<int>(lua_tointeger(L, -1));
+    lua_pop(L, 1);                           // ...
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ref);  // ... keys
+  } else {
+    lua_pop(L, 1);                                 // ...
+    lua_newtable(L);                               // ... keys
+    lua_pushlightuserdata(L, luaU_keyskey());      // ... keys marker
+    lua_rawseti(L, -2, 1);                         // ... keys
+    lua_pushvalue(L, -1);                          // ... keys keys
+    int keysref = luaL_ref(L, LUA_REGISTRYINDEX);  // ... keys
+    lua_pushlightuserdata(L, luaU_keyskey());      // ... keys key
+    lua_pushinteger(L, keysref);                   // ... keys key ref
+    lua_rawset(L, LUA_REGISTRYINDEX);              // ... keys
+    ref = keysref;
+  }
+}
+
+// Pushes the interned string for key, interning it first if this is the first
+// time it has been used on this state.
+inline void luaU_pushkey(lua_State* L, const luaU_Key& key) {
+  int slot = key.slot.load(std::memory_order_acquire);
+  if (slot == 0) {
+    int fresh = luaU_keycount().fetch_add(1);
+    if (key.slot.compare_exchange_strong(slot, fresh)) slot = fresh;
+  }
+  luaU_pushkeys(L);          // ... keys
+  lua_rawgeti(L, -1, slot);  // ... keys str
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);                // ... keys
+    lua_pushstring(L, key.name);  // ... keys str
+    lua_pushvalue(L, -1);         // ... keys str str
+    lua_rawseti(L, -3, slot);     // ... keys str
+  }
+  lua_remove(L, -2);  // ... str
+}
+
+template <typename U>
+inline U luaU_getfield(lua_State* L, int index, const luaU_Key& field) {
+  static_assert(!std::is_same<U, const char*>::value, "luaU_getfield is not safe to use on const char*'s. (The string will be popped from the stack.)");
+  static_assert(!std::is_same<U, std::string_view>::value, "luaU_getfield is not safe to use on std::string_view's. (The string will be popped from the stack.)");
+  luaU_pushkey(L, field);
+  lua_gettable(L, luaW_correctindex(L, index, 1));
+  U val = luaU_to<U>(L, -1);
+  lua_pop(L, 1);
+  return val;
+}
+
+template <typename U>
+inline U luaU_checkfield(lua_State* L, int index, const luaU_Key& field) {
+  static_assert(!std::is_same<U, const char*>::value, "luaU_checkfield is not safe to use on const char*'s. (The string will be popped from the stack.)");
+  static_assert(!std::is_same<U, std::string_view>::value, "luaU_checkfield is not safe to use on std::string_view's. (The string will be popped from the stack.)");
+  luaU_pushkey(L, field);
+  lua_gettable(L, luaW_correctindex(L, index, 1));
+  U val = luaU_check<U>(L, -1);
+  lua_pop(L, 1);
+  return val;
+}
+
+template <typename U>
+inline U luaU_optfield(lua_State* L, int index, const luaU_Key& field, const U& fallback = U()) {
+  static_assert(!std::is_same<U, const char*>::value, "luaU_optfield is not safe to use on const char*'s. (The string will be popped from the stack.)");
+  static_assert(!std::is_same<U, std::string_view>::value, "luaU_optfield is not safe to use on std::string_view's. (The string will be popped from the stack.)");
+  luaU_pushkey(L, field);
+  lua_gettable(L, luaW_correctindex(L, index, 1));
+  U val = luaU_opt<U>(L, -1, fallback);
+  lua_pop(L, 1);
+  return val;
+}
+
+template <typename U>
+inline void luaU_setfield(lua_State* L, int index, const luaU_Key& field, U val) {
+  luaU_pushkey(L, field);
+  luaU_push(L, val);
+  lua_settable(L, luaW_correctindex(L, index, 2));
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 // A set of trivial getter and setter templates. These templates are designed
@@ -420,6 +949,131 @@ int luaU_getsetandrelease(lua_State* L) {
   }
 }
 
+///////////////////////////////////////////////////////////////////////////////
+//
+// luaU_gather and luaU_scatter read or write one numeric (or boolean) member
+// of every object in an array with a single call, instead of one getter or
+// setter call per object. The type is looked up once per call, and objects
+// whose metatable is exactly T's skip the rest of luaW_check.
+//
+// static luaL_Reg Foo_table[] =
+// {
+//     { "GatherHealth", luaU_gather<Foo, int, &Foo::health> },
+//     { "ScatterHealth", luaU_scatter<Foo, int, &Foo::health> },
+//     { NULL, NULL }
+// };
+//
+// In Lua, Foo.GatherHealth(foos) returns an array holding each object's
+// health. Passing an existing table as a second argument fills and returns
+// that table instead, so a script can reuse one buffer every frame.
+// Foo.ScatterHealth(foos, values) sets each object's health from the matching
+// entry of values, or to values itself if it is a single value.
+//
+// The same names can also be used from C++ with a range of T* to push an
+// array of values, or to fill the range from an array on the stack:
+//
+// luaU_gather<Foo, int, &Foo::health>(L, foos.begin(), foos.end());
+// luaU_scatter<Foo, int, &Foo::health>(L, -1, foos.begin(), foos.end());
+//
+
+// Converts the value at the given index to a T*, the way luaW_check would. If
+// it is a userdata whose metatable is the one at mtindex, which must be T's,
+// the pointer is read straight out of the userdata. position is only used in
+// the error message.
+template <typename T>
+T* luaU_checkelement(lua_State* L, int index, int mtindex, int position) {
+  if (lua_type(L, index) == LUA_TUSERDATA && lua_getmetatable(L, index)) {  // ... mt
+    bool exact = lua_rawequal(L, -1, mtindex) != 0;
+    lua_pop(L, 1);  // ...
+    if (exact) {
+      luaW_Userdata* pud = static_cast<luaW_Userdata*>(lua_touserdata(L, index));
+      luaW_validate(pud);
+      if (pud->data) return static_cast<T*>(pud->data);
+    }
+  }
+  T* obj = luaW_to<T>(L, index);
+  if (!obj) {
+    luaL_error(L, "%s expected at position %d, got %s", LuaWrapper<T>::classname, position, luaL_typename(L, index));
+  }
+  return obj;
+}
+
+template <typename T, typename U, U T::* Member>
+int luaU_gather(lua_State* L) {
+  static_assert(std::is_arithmetic_v<U>, "luaU_gather only supports numeric and boolean members");
+  // objs [out]
+  luaL_checktype(L, 1, LUA_TTABLE);
+  int count = static_cast<int>(luaW_rawlen(L, 1));
+  if (lua_istable(L, 2)) {
+    lua_settop(L, 2);  // objs out
+  } else {
+    lua_settop(L, 1);              // objs
+    lua_createtable(L, count, 0);  // objs out
+  }
+  luaL_getmetatable(L, LuaWrapper<T>::classname);  // objs out mt
+  for (int i = 1; i <= count; ++i) {
+    lua_rawgeti(L, 1, i);  // objs out mt obj
+    T* obj = luaU_checkelement<T>(L, -1, 3, i);
+    lua_pop(L, 1);               // objs out mt
+    luaU_push(L, obj->*Member);  // objs out mt value
+    lua_rawseti(L, 2, i);        // objs out mt
+  }
+  // Trim anything left over in a reused table
+  for (int i = count + 1;; ++i) {
+    lua_rawgeti(L, 2, i);  // objs out mt value
+    bool done = lua_isnil(L, -1);
+    lua_pop(L, 1);  // objs out mt
+    if (done) break;
+    lua_pushnil(L);        // objs out mt nil
+    lua_rawseti(L, 2, i);  // objs out mt
+  }
+  lua_pop(L, 1);  // objs out
+  return 1;
+}
+
+template <typename T, typename U, U T::* Member>
+int luaU_scatter(lua_State* L) {
+  static_assert(std::is_arithmetic_v<U>, "luaU_scatter only supports numeric and boolean members");
+  // objs values
+  luaL_checktype(L, 1, LUA_TTABLE);
+  int count = static_cast<int>(luaW_rawlen(L, 1));
+  bool broadcast = !lua_istable(L, 2);
+  U value = broadcast ? luaU_check<U>(L, 2) : U();
+  luaL_argcheck(L, broadcast || luaW_rawlen(L, 2) >= static_cast<size_t>(count), 2, "fewer values than objects");
+  lua_settop(L, 2);                                // objs values
+  luaL_getmetatable(L, LuaWrapper<T>::classname);  // objs values mt
+  for (int i = 1; i <= count; ++i) {
+    lua_rawgeti(L, 1, i);  // objs values mt obj
+    T* obj = luaU_checkelement<T>(L, -1, 3, i);
+    lua_pop(L, 1);  // objs values mt
+    if (!broadcast) {
+      lua_rawgeti(L, 2, i);  // objs values mt value
+      value = luaU_check<U>(L, -1);
+      lua_pop(L, 1);  // objs values mt
+    }
+    obj->*Member = value;
+  }
+  return 0;
+}
+
+template <typename T, typename U, U T::* Member, typename Iterator>
+void luaU_gather(lua_State* L, Iterator first, Iterator last) {
+  lua_createtable(L, static_cast<int>(std::distance(first, last)), 0);  // ... {}
+  for (int i = 1; first != last; ++first, ++i) {
+    luaU_push(L, (*first)->*Member);  // ... {} value
+    lua_rawseti(L, -2, i);            // ... {}
+  }
+}
+
+template <typename T, typename U, U T::* Member, typename Iterator>
+void luaU_scatter(lua_State* L, int index, Iterator first, Iterator last) {
+  for (int i = 1; first != last; ++first, ++i) {
+    lua_rawgeti(L, index, i);  // ... value
+    (*first)->*Member = luaU_check<U>(L, -1);
+    lua_pop(L, 1);  // ...
+  }
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 // luaU_func is a special macro that expands into a simple function wrapper.
@@ -663,6 +1317,737 @@ int luaU_build(lua_State* L) {
   return 0;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+//
+// luaU_build can also be given a table of typed setters, in which case the
+// keys of the table are matched against it directly and the values are
+// written into the object from C++, without looking up the setter through
+// __index or calling into Lua. The setters are created with luaU_assign,
+// which accepts the same member variables and setter functions as luaU_set.
+//
+// For example:
+//
+// static const luaU_BuildField<Foo> Foo_fields[] =
+// {
+//     { "X", luaU_assign<Foo, int, &Foo::x> },
+//     { "Y", luaU_assign<Foo, int, &Foo::SetY> },
+//     { NULL, NULL }
+// };
+//
+// static luaL_Reg Foo_metatable[] =
+// {
+//     { LUAW_POSTCTOR_KEY, luaU_build<Foo, Foo_fields> },
+//     { NULL, NULL }
+// };
+//
+// Keys that are not in the field table fall back to the behavior of
+// luaU_build<T> above, i.e. f:Key(value) is called. luaU_buildstrict raises an
+// error for them instead. A value that can not be converted to the type of its
+// field raises an error naming the field. The first time a field table is used
+// on a state a Lua table mapping its names to their setters is built and kept
+// in the registry, so matching a key is a single raw table lookup.
+//
+
+template <typename T>
+struct luaU_BuildField {
+  const char* name;
+  void (*assign)(lua_State* L, T* obj, int index, const char* name);
+};
+
+// Raises an error naming the field being built if the value at index can not
+// be converted to a U, rather than letting luaU_check report it as a bad
+// argument of the build function. This is only used internally.
+template <typename U>
+void luaU_checkbuild(lua_State* L, int index, const char* name) {
+  if (!std::is_same<U, bool>::value && !luaU_is<U>(L, index)) {
+    luaL_error(L, "field '%s' can not be set from a %s", name, luaL_typename(L, index));
+  }
+}
+
+// As above, for fields holding pointers to wrapped objects, which may also be
+// set to nil. This is only used internally.
+template <typename U>
+void luaU_checkbuildobject(lua_State* L, int index, const char* name) {
+  if (!lua_isnil(L, index) && !luaW_is<U>(L, index)) {
+    luaL_error(L, "field '%s' can not be set from a %s", name, luaL_typename(L, index));
+  }
+}
+
+template <typename T, typename U, U T::* Member>
+void luaU_assign(lua_State* L, T* obj, int index, const char* name) {
+  luaU_checkbuild<U>(L, index, name);
+  obj->*Member = luaU_check<U>(L, index);
+}
+
+template <typename T, typename U, U* T::* Member>
+void luaU_assign(lua_State* L, T* obj, int index, const char* name) {
+  luaU_checkbuildobject<U>(L, index, name);
+  obj->*Member = luaW_opt<U>(L, index);
+}
+
+template <typename T, typename U, const U* T::* Member>
+void luaU_assign(lua_State* L, T* obj, int index, const char* name) {
+  luaU_checkbuildobject<U>(L, index, name);
+  obj->*Member = luaW_opt<U>(L, index);
+}
+
+template <typename T, typename U, void (T::*Setter)(U)>
+void luaU_assign(lua_State* L, T* obj, int index, const char* name) {
+  luaU_checkbuild<U>(L, index, name);
+  (obj->*Setter)(luaU_check<U>(L, index));
+}
+
+template <typename T, typename U, void (T::*Setter)(const U&)>
+void luaU_assign(lua_State* L, T* obj, int index, const char* name) {
+  luaU_checkbuild<U>(L, index, name);
+  (obj->*Setter)(luaU_check<U>(L, index));
+}
+
+template <typename T, typename U, void (T::*Setter)(U*)>
+void luaU_assign(lua_State* L, T* obj, int index, const char* name) {
+  luaU_checkbuildobject<U>(L, index, name);
+  (obj->*Setter)(luaW_opt<U>(L, index));
+}
+
+// Pushes the table mapping the names in Fields to their index in Fields,
+// creating it if this is the first time it has been used on this state. This
+// is only used internally.
+template <typename T, const luaU_BuildField<T>* Fields>
+void luaU_pushbuildfields(lua_State* L) {
+  void* id = const_cast<luaU_BuildField<T>*>(Fields);
+  lua_pushlightuserdata(L, id);      // ... id
+  lua_rawget(L, LUA_REGISTRYINDEX);  // ... fields
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);  // ...
+    int count = 0;
+    while (Fields[count].name) ++count;
+    lua_createtable(L, 0, count);  // ... fields
+    for (int i = 0; i < count; ++i) {
+      lua_pushstring(L, Fields[i].name);  // ... fields name
+      lua_pushinteger(L, i);              // ... fields name i
+      lua_rawset(L, -3);                  // ... fields
+    }
+    lua_pushlightuserdata(L, id);      // ... fields id
+    lua_pushvalue(L, -2);              // ... fields id fields
+    lua_rawset(L, LUA_REGISTRYINDEX);  // ... fields
+  }
+}
+
+template <typename T, const luaU_BuildField<T>* Fields, bool Strict>
+int luaU_buildfields(lua_State* L) {
+  // obj {}
+  T* obj = luaW_check<T>(L, 1);
+  if (lua_type(L, 2) == LUA_TTABLE) {
+    lua_settop(L, 2);                    // obj {}
+    luaU_pushbuildfields<T, Fields>(L);  // obj {} fields
+    for (lua_pushnil(L); lua_next(L, 2); lua_pop(L, 1)) {
+      // obj {} fields k v
+      lua_pushvalue(L, -2);  // obj {} fields k v k
+      lua_rawget(L, 3);      // obj {} fields k v i
+      if (lua_isnumber(L, -1)) {
+        int i = static_cast<int>(lua_tointeger(L, -1));
+        lua_pop(L, 1);  // obj {} fields k v
+        Fields[i].assign(L, obj, 5, Fields[i].name);
+      } else if (Strict) {
+        if (lua_type(L, 4) == LUA_TSTRING) {
+          return luaL_error(L, "%s has no field '%s' to build", LuaWrapper<T>::classname, lua_tostring(L, 4));
+        }
+        return luaL_error(L, "%s can not be built from a %s key", LuaWrapper<T>::classname, luaL_typename(L, 4));
+      } else {
+        lua_pop(L, 1);         // obj {} fields k v
+        lua_pushvalue(L, -2);  // obj {} fields k v k
+        lua_gettable(L, 1);    // obj {} fields k v ud[k]
+        lua_pushvalue(L, 1);   // obj {} fields k v ud[k] ud
+        lua_pushvalue(L, -3);  // obj {} fields k v ud[k] ud v
+        lua_call(L, 2, 0);     // obj {} fields k v
+      }
+    }
+  }
+  return 0;
+}
+
+template <typename T, const luaU_BuildField<T>* Fields>
+int luaU_build(lua_State* L) {
+  return luaU_buildfields<T, Fields, false>(L);
+}
+
+template <typename T, const luaU_BuildField<T>* Fields>
+int luaU_buildstrict(lua_State* L) {
+  return luaU_buildfields<T, Fields, true>(L);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// luaU_Soa keeps a large number of small records as a structure of arrays:
+// each member named in its template arguments is stored in a std::vector of
+// its own, so C++ code can run over a single column in a tight loop. Lua sees
+// the store as an array of handles whose fields read and write the columns
+// directly, without a C++ object, cache entry or storage table per record.
+//
+// For example:
+//
+// struct Particle { float x, y, vx, vy; };
+// typedef luaU_Soa<Particle, &Particle::x, &Particle::y, &Particle::vx, &Particle::vy> Particles;
+// static const char* const Particles_fields[] = { "x", "y", "vx", "vy" };
+//
+// luaU_registersoa<Particles>(L, "Particles", Particles_fields);
+// luaU_pushsoa(L, &particles);
+// lua_setglobal(L, "particles");
+//
+// In Lua, particles:add() appends a default record and returns its handle,
+// particles[i] returns the handle of the ith record, #particles is the number
+// of records, and handles are used like tables with the fields named above:
+//
+// local p = particles:add()
+// p.vx = 2
+// for i = 1, #particles do local q = particles[i]; q.x = q.x + q.vx end
+//
+// Each particles[i] creates a new handle userdata, so loops over many records
+// can use particles:get(i, field) and particles:set(i, field, value) instead,
+// which read and write the columns without allocating anything:
+//
+// for i = 1, #particles do particles:set(i, "x", particles:get(i, "x") + particles:get(i, "vx")) end
+//
+// While in C++:
+//
+// std::vector<float>& x = particles.column<0>();
+// const std::vector<float>& vx = particles.column<2>();
+// for (size_t i = 0; i < particles.size(); ++i) x[i] += vx[i];
+//
+// The store belongs to C++ and must outlive the Lua references to it. A
+// handle is only the store and the record's index, so handles to records
+// beyond the end of a store that has shrunk raise an error when used.
+//
+
+template <typename M>
+struct luaU_MemberType;
+
+template <typename T, typename U>
+struct luaU_MemberType<U T::*> {
+  typedef U type;
+};
+
+template <typename T, auto... Members>
+class luaU_Soa {
+ public:
+  static const char* classname;
+  static std::string handlename;
+
+  size_t size() const { return count; }
+
+  // Appends a record and returns its index
+  size_t add(const T& record = T()) {
+    std::apply([&](auto&... cols) { (cols.push_back(record.*Members), ...); }, columns);
+    return count++;
+  }
+
+  T get(size_t index) const {
+    T record;
+    std::apply([&](const auto&... cols) { ((record.*Members = cols[index]), ...); }, columns);
+    return record;
+  }
+
+  void set(size_t index, const T& record) {
+    std::apply([&](auto&... cols) { ((cols[index] = record.*Members), ...); }, columns);
+  }
+
+  void resize(size_t size) {
+    std::apply([&](auto&... cols) { (cols.resize(size), ...); }, columns);
+    count = size;
+  }
+
+  void clear() { resize(0); }
+
+  template <size_t I>
+  auto& column() {
+    return std::get<I>(columns);
+  }
+
+  template <size_t I>
+  const auto& column() const {
+    return std::get<I>(columns);
+  }
+
+  // Calls f with the column at the given (zero based) position
+  template <typename F>
+  void visit(size_t position, F f) {
+    size_t i = 0;
+    std::apply([&](auto&... cols) { ((i++ == position ? f(cols) : void()), ...); }, columns);
+  }
+
+ private:
+  std::tuple<std::vector<typename luaU_MemberType<decltype(Members)>::type>...> columns;
+  size_t count = 0;
+};
+// clang-format off
+template <typename T, auto... Members> const char* luaU_Soa<T, Members...>::classname;
+template <typename T, auto... Members> std::string luaU_Soa<T, Members...>::handlename;
+// clang-format on
+
+// The userdata pushed for each record. This is only used internally.
+template <typename Soa>
+struct luaU_SoaHandle {
+  Soa* store;
+  size_t index;
+};
+
+template <typename Soa>
+luaU_SoaHandle<Soa>* luaU_checksoahandle(lua_State* L, int index) {
+  luaU_SoaHandle<Soa>* handle = static_cast<luaU_SoaHandle<Soa>*>(luaL_checkudata(L, index, Soa::handlename.c_str()));
+  if (handle->index >= handle->store->size()) {
+    luaL_error(L, "%s record %d no longer exists", Soa::classname, static_cast<int>(handle->index + 1));
+  }
+  return handle;
+}
+
+template <typename Soa>
+void luaU_pushsoahandle(lua_State* L, Soa* store, size_t index) {
+  void* block = lua_newuserdata(L, sizeof(luaU_SoaHandle<Soa>));  // ... handle
+  new (block) luaU_SoaHandle<Soa>{store, index};
+  luaL_getmetatable(L, Soa::handlename.c_str());  // ... handle mt
+  lua_setmetatable(L, -2);                        // ... handle
+}
+
+// The position of the column named by the key at the given index, looked up in
+// the field table in the first upvalue. This is only used internally.
+template <typename Soa>
+size_t luaU_soacolumn(lua_State* L, int index) {
+  lua_pushvalue(L, index);             // ... key
+  lua_rawget(L, lua_upvalueindex(1));  // ... position
+  if (lua_isnil(L, -1)) {
+    luaL_error(L, "%s has no field '%s'", Soa::classname, lua_tostring(L, index));
+  }
+  size_t position = static_cast<size_t>(lua_tointeger(L, -1));
+  lua_pop(L, 1);  // ...
+  return position;
+}
+
+// handle[key]
+template <typename Soa>
+int luaU_soahandleindex(lua_State* L) {
+  // handle key
+  luaU_SoaHandle<Soa>* handle = luaU_checksoahandle<Soa>(L, 1);
+  handle->store->visit(luaU_soacolumn<Soa>(L, 2), [L, handle](auto& col) {
+    typedef typename std::decay_t<decltype(col)>::value_type U;
+    luaU_push(L, static_cast<U>(col[handle->index]));  // handle key value
+  });
+  return 1;
+}
+
+// handle[key] = value
+template <typename Soa>
+int luaU_soahandlenewindex(lua_State* L) {
+  // handle key value
+  luaU_SoaHandle<Soa>* handle = luaU_checksoahandle<Soa>(L, 1);
+  handle->store->visit(luaU_soacolumn<Soa>(L, 2), [L, handle](auto& col) {
+    typedef typename std::decay_t<decltype(col)>::value_type U;
+    col[handle->index] = luaU_check<U>(L, 3);
+  });
+  return 0;
+}
+
+// store[i] returns the handle of the ith record, store.add the add method
+template <typename Soa>
+int luaU_soaindex(lua_State* L) {
+  // store key
+  Soa* store = *static_cast<Soa**>(luaL_checkudata(L, 1, Soa::classname));
+  if (lua_type(L, 2) == LUA_TNUMBER) {
+    lua_Integer i = lua_tointeger(L, 2);
+    if (i >= 1 && static_cast<size_t>(i) <= store->size()) {
+      luaU_pushsoahandle(L, store, static_cast<size_t>(i - 1));  // store key handle
+    } else {
+      lua_pushnil(L);  // store key nil
+    }
+  } else {
+    lua_getmetatable(L, 1);  // store key mt
+    lua_pushvalue(L, 2);     // store key mt key
+    lua_rawget(L, -2);       // store key mt mt[key]
+  }
+  return 1;
+}
+
+// Converts the record number at the given index of store to a zero based
+// index, raising an error if there is no such record. This is only used
+// internally.
+template <typename Soa>
+size_t luaU_checksoarecord(lua_State* L, Soa* store, int index) {
+  lua_Integer i = luaL_checkinteger(L, index);
+  if (i < 1 || static_cast<size_t>(i) > store->size()) {
+    luaL_error(L, "%s record %d does not exist", Soa::classname, static_cast<int>(i));
+  }
+  return static_cast<size_t>(i - 1);
+}
+
+// store:get(i, key)
+template <typename Soa>
+int luaU_soaget(lua_State* L) {
+  // store i key
+  Soa* store = *static_cast<Soa**>(luaL_checkudata(L, 1, Soa::classname));
+  size_t index = luaU_checksoarecord(L, store, 2);
+  store->visit(luaU_soacolumn<Soa>(L, 3), [L, index](auto& col) {
+    typedef typename std::decay_t<decltype(col)>::value_type U;
+    luaU_push(L, static_cast<U>(col[index]));  // store i key value
+  });
+  return 1;
+}
+
+// store:set(i, key, value)
+template <typename Soa>
+int luaU_soaset(lua_State* L) {
+  // store i key value
+  Soa* store = *static_cast<Soa**>(luaL_checkudata(L, 1, Soa::classname));
+  size_t index = luaU_checksoarecord(L, store, 2);
+  store->visit(luaU_soacolumn<Soa>(L, 3), [L, index](auto& col) {
+    typedef typename std::decay_t<decltype(col)>::value_type U;
+    col[index] = luaU_check<U>(L, 4);
+  });
+  return 0;
+}
+
+template <typename Soa>
+int luaU_soalen(lua_State* L) {
+  Soa* store = *static_cast<Soa**>(luaL_checkudata(L, 1, Soa::classname));
+  lua_pushinteger(L, static_cast<lua_Integer>(store->size()));
+  return 1;
+}
+
+template <typename Soa>
+int luaU_soaadd(lua_State* L) {
+  Soa* store = *static_cast<Soa**>(luaL_checkudata(L, 1, Soa::classname));
+  luaU_pushsoahandle(L, store, store->add());
+  return 1;
+}
+
+// Creates the metatables used by stores of type Soa and their handles. fields
+// names the columns of Soa, in the same order as its template arguments.
+template <typename Soa, size_t N>
+void luaU_registersoa(lua_State* L, const char* classname, const char* const (&fields)[N]) {
+  Soa::classname = classname;
+  Soa::handlename = std::string(classname) + ".handle";
+
+  lua_createtable(L, 0, N);  // ... fields
+  for (size_t i = 0; i < N; ++i) {
+    lua_pushinteger(L, static_cast<lua_Integer>(i));  // ... fields i
+    lua_setfield(L, -2, fields[i]);                   // ... fields
+  }
+  luaL_newmetatable(L, Soa::handlename.c_str());        // ... fields mt
+  lua_pushvalue(L, -2);                                 // ... fields mt fields
+  lua_pushcclosure(L, luaU_soahandleindex<Soa>, 1);     // ... fields mt __index
+  lua_setfield(L, -2, "__index");                       // ... fields mt
+  lua_pushvalue(L, -2);                                 // ... fields mt fields
+  lua_pushcclosure(L, luaU_soahandlenewindex<Soa>, 1);  // ... fields mt __newindex
+  lua_setfield(L, -2, "__newindex");                    // ... fields mt
+  lua_pop(L, 1);                                        // ... fields
+
+  luaL_newmetatable(L, classname);           // ... fields mt
+  lua_pushcfunction(L, luaU_soaindex<Soa>);  // ... fields mt __index
+  lua_setfield(L, -2, "__index");            // ... fields mt
+  lua_pushcfunction(L, luaU_soalen<Soa>);    // ... fields mt __len
+  lua_setfield(L, -2, "__len");              // ... fields mt
+  lua_pushcfunction(L, luaU_soaadd<Soa>);    // ... fields mt add
+  lua_setfield(L, -2, "add");                // ... fields mt
+  lua_pushvalue(L, -2);                      // ... fields mt fields
+  lua_pushcclosure(L, luaU_soaget<Soa>, 1);  // ... fields mt get
+  lua_setfield(L, -2, "get");                // ... fields mt
+  lua_pushvalue(L, -2);                      // ... fields mt fields
+  lua_pushcclosure(L, luaU_soaset<Soa>, 1);  // ... fields mt set
+  lua_setfield(L, -2, "set");                // ... fields mt
+  lua_pop(L, 2);                             // ...
+}
+
+// Pushes a userdata through which Lua can use store. Pushing the same store
+// more than once creates separate userdata that share the same records.
+template <typename Soa>
+void luaU_pushsoa(lua_State* L, Soa* store) {
+  *static_cast<Soa**>(lua_newuserdata(L, sizeof(Soa*))) = store;  // ... store
+  luaL_getmetatable(L, Soa::classname);                           // ... store mt
+  lua_setmetatable(L, -2);                                        // ... store
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// luaU_MethodRef calls a Lua method on wrapped objects from C++. It is meant
+// for callbacks that are invoked often, such as per-frame event handlers that
+// scripts define on objects or their metatables. The method is looked up
+// through __index once per class and the function it resolved to is cached
+// under the object's metatable, so later calls on any object of that class
+// skip the lookup. Objects that have had a function stored on them are
+// checked in their own storage table first, since it may override the
+// class's method. The cached functions are dropped and looked up again when
+// the state's luaW_methodsversion says something that could change the
+// lookup has happened since.
+//
+// For example:
+//
+// luaU_MethodRef<Foo, bool(float)> ontick(L, "OnTick");
+// ...
+// std::optional<bool> keepgoing = ontick.call(foo, dt);
+// if (!keepgoing) printf("OnTick failed: %s\n", ontick.error());
+//
+// Arguments are pushed with luaU_push (or luaW_push, for pointers to wrapped
+// classes) and the result is converted with luaU_to after checking it with
+// luaU_is. call returns an empty std::optional if the method is missing,
+// raises an error, or returns a value of the wrong type, and a plain bool when
+// R is void. In either case error() then returns the message, which stays
+// valid until the next call; no std::string is created along the way.
+//
+// A luaU_MethodRef must be destroyed before the lua_State it was created for
+// is closed.
+//
+template <typename T, typename Signature>
+class luaU_MethodRef;
+
+template <typename T, typename R, typename... Args>
+class luaU_MethodRef<T, R(Args...)> {
+ public:
+  typedef typename std::conditional<std::is_void<R>::value, bool, std::optional<R>>::type Result;
+
+  luaU_MethodRef(lua_State* L, const char* name) : L(L), version(0), methodsversion(luaW_methodsversion(L)) {
+    lua_pushstring(L, name);  // ... name
+    nameref = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_newtable(L);  // ... cache
+    cacheref = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_pushboolean(L, 0);  // ... false
+    errorref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+
+  ~luaU_MethodRef() {
+    luaL_unref(L, LUA_REGISTRYINDEX, nameref);
+    luaL_unref(L, LUA_REGISTRYINDEX, cacheref);
+    luaL_unref(L, LUA_REGISTRYINDEX, errorref);
+  }
+
+  luaU_MethodRef(const luaU_MethodRef&) = delete;
+  luaU_MethodRef& operator=(const luaU_MethodRef&) = delete;
+
+  // Calls target:name(args...). The stack is left as it was found.
+  Result call(T* target, Args... args) {
+    if (!target) {
+      lua_pushfstring(L, "attempt to call method '%s' on a NULL %s", name(), LuaWrapper<T>::classname);  // ... msg
+      seterror();                                                                                        // ...
+      return Result();
+    }
+    if (!pushmethod(target)) return Result();  // ... f ud
+    (luaU_pushelement(L, args), ...);          // ... f ud args...
+    if (lua_pcall(L, 1 + sizeof...(Args), std::is_void<R>::value ? 0 : 1, 0) != 0) {
+      seterror(true);  // ...
+      return Result();
+    }
+    if constexpr (std::is_void<R>::value) {
+      return true;
+    } else {
+      // ... result
+      Result result;
+      if (converts(L, -1)) {
+        result = convert(L, -1);
+        lua_pop(L, 1);  // ...
+      } else {
+        lua_pushfstring(L, "method '%s' returned a %s value", name(), luaL_typename(L, -1));  // ... result msg
+        lua_remove(L, -2);                                                                    // ... msg
+        seterror();                                                                           // ...
+      }
+      return result;
+    }
+  }
+
+  // The message describing why the last call failed.
+  const char* error() const {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, errorref);  // ... msg
+    const char* msg = lua_tostring(L, -1);
+    lua_pop(L, 1);  // ...
+    return msg ? msg : "";
+  }
+
+ private:
+  // Pushes the function name resolves to on target followed by target's
+  // userdata, or records an error if target has no such method or its
+  // __index raised one.
+  bool pushmethod(T* target) {
+    if (version != *methodsversion) {
+      lua_newtable(L);                              // ... cache
+      lua_rawseti(L, LUA_REGISTRYINDEX, cacheref);  // ...
+      version = *methodsversion;
+    }
+    luaW_push<T>(L, target);  // ... ud
+    if (static_cast<luaW_Userdata*>(lua_touserdata(L, -1))->functions) {
+      // A value in the object's own storage table takes precedence
+      luaW_wrapperfield<T>(L, LUAW_STORAGE_KEY);   // ... ud storage
+      LuaWrapper<T>::identifier(L, target);        // ... ud storage id
+      lua_rawget(L, -2);                           // ... ud storage store
+      if (lua_istable(L, -1)) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, nameref);  // ... ud storage store name
+        lua_rawget(L, -2);                           // ... ud storage store f
+        if (!lua_isnil(L, -1)) return checkmethod();
+        lua_pop(L, 1);  // ... ud storage store
+      }
+      lua_pop(L, 2);  // ... ud
+    }
+    lua_getmetatable(L, -1);                      // ... ud mt
+    lua_rawgeti(L, LUA_REGISTRYINDEX, cacheref);  // ... ud mt cache
+    lua_pushvalue(L, -2);                         // ... ud mt cache mt
+    lua_rawget(L, -2);                            // ... ud mt cache f
+    if (lua_isnil(L, -1)) {
+      lua_pop(L, 1);                               // ... ud mt cache
+      lua_pushcfunction(L, lookup);                // ... ud mt cache lookup
+      lua_pushvalue(L, -4);                        // ... ud mt cache lookup ud
+      lua_rawgeti(L, LUA_REGISTRYINDEX, nameref);  // ... ud mt cache lookup ud name
+      if (lua_pcall(L, 2, 1, 0) != 0) {
+        // ... ud mt cache err
+        lua_replace(L, -4);  // ... err mt cache
+        lua_pop(L, 2);       // ... err
+        seterror(true);      // ...
+        return false;
+      }
+      // ... ud mt cache f
+      if (lua_isfunction(L, -1)) {
+        lua_pushvalue(L, -3);  // ... ud mt cache f mt
+        lua_pushvalue(L, -2);  // ... ud mt cache f mt f
+        lua_rawset(L, -4);     // ... ud mt cache f
+      }
+    }
+    return checkmethod();
+  }
+
+  // Finishes pushmethod from ... ud x y f, leaving ... f ud if f is a function
+  bool checkmethod() {
+    if (!lua_isfunction(L, -1)) {
+      const char* type = luaL_typename(L, -1);
+      lua_pop(L, 4);                                                                 // ...
+      lua_pushfstring(L, "attempt to call a %s value (method '%s')", type, name());  // ... msg
+      seterror();                                                                    // ...
+      return false;
+    }
+    lua_replace(L, -3);  // ... ud f y
+    lua_pop(L, 1);       // ... ud f
+    lua_insert(L, -2);   // ... f ud
+    return true;
+  }
+
+  // Runs ud[name] for pushmethod, so that an erroring __index is caught
+  static int lookup(lua_State* L) {
+    // ud name
+    lua_gettable(L, 1);  // ud f
+    return 1;
+  }
+
+  // Moves the message at the top of the stack into the error slot. If raised
+  // is set, the value is an error object, which is described if it is not a
+  // string.
+  void seterror(bool raised = false) {
+    if (raised && !lua_isstring(L, -1)) {
+      lua_pushfstring(L, "(error object is a %s value)", luaL_typename(L, -1));  // ... err msg
+      lua_remove(L, -2);                                                         // ... msg
+    }
+    lua_rawseti(L, LUA_REGISTRYINDEX, errorref);  // ...
+  }
+
+  const char* name() const {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, nameref);  // ... name
+    const char* str = lua_tostring(L, -1);
+    lua_pop(L, 1);  // ...
+    return str;
+  }
+
+  static bool converts(lua_State* L, int index) {
+    if constexpr (std::is_pointer<R>::value && std::is_class<typename std::remove_pointer<R>::type>::value) {
+      return lua_isnil(L, index) || luaW_is<typename std::remove_pointer<R>::type>(L, index);
+    } else {
+      return luaU_is<R>(L, index);
+    }
+  }
+
+  static R convert(lua_State* L, int index) {
+    if constexpr (std::is_pointer<R>::value && std::is_class<typename std::remove_pointer<R>::type>::value) {
+      return luaW_to<typename std::remove_pointer<R>::type>(L, index);
+    } else {
+      return luaU_to<R>(L, index);
+    }
+  }
+
+  lua_State* L;
+  unsigned version;
+  const unsigned* methodsversion;
+  int nameref;
+  int cacheref;
+  int errorref;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// luaU_foreachcall calls the function at index func once for every object in
+// the range [first, last), passing the object followed by args. It is the
+// batched equivalent of pushing each object and calling lua_pcall in a loop:
+// the message handler and the converted arguments are pushed once and reused
+// for every call, and each object's cached userdata is looked up directly in
+// its type's cache table. An error in one call does not stop the others; each
+// failure is returned with the object's position in the range.
+//
+// For example:
+//
+// lua_getglobal(L, "OnTick");
+// std::vector<luaU_CallError> errors = luaU_foreachcall<Unit>(L, -1, units.begin(), units.end(), dt);
+// lua_pop(L, 1);
+// for (const luaU_CallError& error : errors) printf("unit %zu: %s\n", error.position, error.message.c_str());
+//
+// Return values are discarded. The stack is left as it was found.
+//
+
+struct luaU_CallError {
+  size_t position;
+  std::string message;
+};
+
+// The message handler used by luaU_foreachcall, which adds a traceback to the
+// error message on Lua 5.2 and later. This is only used internally.
+inline int luaU_errorhandler(lua_State* L) {
+  const char* msg = lua_tostring(L, 1);
+  if (!msg) msg = lua_pushfstring(L, "(error object is a %s value)", luaL_typename(L, 1));
+#if LUA_VERSION_NUM >= 502
+  luaL_traceback(L, L, msg, 1);
+#else
+  lua_pushstring(L, msg);
+#endif
+  return 1;
+}
+
+template <typename T, typename Iterator, typename... Args>
+std::vector<luaU_CallError> luaU_foreachcall(lua_State* L, int func, Iterator first, Iterator last, Args... args) {
+  if (func < 0 && func > LUA_REGISTRYINDEX) func = lua_gettop(L) + func + 1;
+  lua_pushcfunction(L, luaU_errorhandler);  // ... handler
+  int handler = lua_gettop(L);
+  (luaU_pushelement(L, args), ...);         // ... handler args...
+  luaW_wrapperfield<T>(L, LUAW_CACHE_KEY);  // ... handler args... cache
+  int cache = lua_gettop(L);
+
+  std::vector<luaU_CallError> errors;
+  for (size_t i = 0; first != last; ++first, ++i) {
+    T* obj = *first;
+    lua_pushvalue(L, func);  // ... f
+    if (obj) {
+      LuaWrapper<T>::identifier(L, obj);  // ... f id
+      lua_rawget(L, cache);               // ... f ud
+      if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);         // ... f
+        luaW_push<T>(L, obj);  // ... f ud
+      }
+    } else {
+      lua_pushnil(L);  // ... f nil
+    }
+    for (int arg = handler + 1; arg < cache; ++arg) {
+      lua_pushvalue(L, arg);  // ... f ud args...
+    }
+    if (lua_pcall(L, 1 + sizeof...(Args), 0, handler) != 0) {
+      // ... msg
+      size_t len;
+      const char* msg = lua_tolstring(L, -1, &len);
+      errors.push_back(luaU_CallError{i, std::string(msg, len)});
+      lua_pop(L, 1);  // ...
+    }
+  }
+  lua_settop(L, handler - 1);  // ...
+  return errors;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 // Takes the object of type T at the top of the stack and stores it in on a
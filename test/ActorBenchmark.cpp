@@ -0,0 +1,69 @@
+// Measures how many calls per second a luaU_Actor runs when several producer
+// threads post to it at once. Each call runs a small Lua function, so the
+// numbers mostly reflect the cost of posting and of handing results back.
+//
+// Usage: luawrapper_actor_benchmark [calls per producer]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <future>
+#include <thread>
+#include <vector>
+extern "C" {
+#include "lauxlib.h"
+#include "lua.h"
+#include "lualib.h"
+}
+
+#include "luawrapperactor.hpp"
+
+// Posts calls closures from each of producers threads, each waiting for its
+// results in batches so that the queue stays full, and returns the number of
+// calls run per second.
+static double callspersecond(int producers, int calls) {
+  lua_State* L = luaL_newstate();
+  luaL_openlibs(L);
+  luaL_dostring(L, "function add(a, b) return a + b end");
+  luaU_Actor actor(L);
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (int t = 0; t < producers; ++t) {
+    threads.emplace_back([&actor, calls] {
+      const int batch = 256;
+      std::vector<std::future<lua_Integer>> results;
+      results.reserve(batch);
+      for (int i = 0; i < calls; ++i) {
+        results.push_back(actor.post([i](lua_State* L) {
+          lua_getglobal(L, "add");
+          lua_pushinteger(L, i);
+          lua_pushinteger(L, 1);
+          lua_Integer sum = lua_pcall(L, 2, 1, 0) == 0 ? lua_tointeger(L, -1) : 0;
+          lua_pop(L, 1);
+          return sum;
+        }));
+        if (results.size() == batch || i == calls - 1) {
+          for (std::future<lua_Integer>& result : results) result.get();
+          results.clear();
+        }
+      }
+    });
+  }
+  for (std::thread& thread : threads) thread.join();
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  return producers * static_cast<double>(calls) / elapsed.count();
+}
+
+int main(int argc, char** argv) {
+  int calls = argc > 1 ? atoi(argv[1]) : 200000;
+  if (calls <= 0) {
+    fprintf(stderr, "usage: %s [calls per producer]\n", argv[0]);
+    return 1;
+  }
+  printf("%9s %15s\n", "producers", "calls/second");
+  for (int producers = 1; producers <= 8; producers *= 2) {
+    printf("%9d %15.0f\n", producers, callspersecond(producers, calls));
+  }
+  return 0;
+}
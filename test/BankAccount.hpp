@@ -1,5 +1,5 @@
-#ifndef EXAMPLE_HPP_
-#define EXAMPLE_HPP_
+#ifndef BANKACCOUNT_HPP_
+#define BANKACCOUNT_HPP_
 
 class BankAccount {
  public:
@@ -18,4 +18,4 @@ class BankAccount {
   static float s_totalMoneyInBank;
 };
 
-#endif  // EXAMPLE_HPP_
+#endif  // BANKACCOUNT_HPP_
@@ -1,8 +1,8 @@
-#ifndef LUAEXAMPLE_HPP_
-#define LUAEXAMPLE_HPP_
+#ifndef LUABANKACCOUNT_HPP_
+#define LUABANKACCOUNT_HPP_
 
 struct lua_State;
 
 int luaopen_BankAccount(lua_State*);
 
-#endif  // LUAEXAMPLE_HPP_
+#endif  // LUABANKACCOUNT_HPP_
@@ -1,45 +1,26 @@
 #ifndef LUACUSTOMTYPES_H_
 #define LUACUSTOMTYPES_H_
 
-#include <string>
-
 #include "Vector2D.hpp"
 #include "lua.h"
 #include "luawrapper.hpp"
 #include "luawrapperutil.hpp"
 
-// LuaWrapper knows about primitive types like ints and floats, but it doesn't
-// know about things like std::strings or other more complicated types.
-// Sometimes, rather than register the type with LuaWrapper, it's easier to
-// be able to convert it to and from Lua's primitive types, like strings or
-// tables.
+// LuaWrapper knows about primitive types like ints and floats, strings and the
+// standard containers, but it doesn't know about your own types. Sometimes,
+// rather than register the type with LuaWrapper, it's easier to be able to
+// convert it to and from Lua's primitive types, like strings or tables.
 //
 // To do this, you must write luaU_check, luaU_to and luaU_push functions for
 // your type. You don't always need all three, it depends on if you're pushing
 // objects to Lua, getting objects from Lua, or both.
 
-// This example uses std::string, but if you have other custom string types it
-// should be easy to write versions of those functions too
-
-template <>
-bool luaU_is<std::string>(lua_State* L, int index) {
-  return lua_isstring(L, index);
-}
-
-template <>
-std::string luaU_check(lua_State* L, int index) {
-  return std::string(luaL_checkstring(L, index));
-}
-
-template <>
-std::string luaU_to(lua_State* L, int index) {
-  return std::string(lua_tostring(L, index));
-}
-
-static void luaU_push(lua_State* L, const std::string& val) { lua_pushstring(L, val.c_str()); }
-
 // These two functions let me convert a simple Vector2D structure into a Lua
-// table holding the x and y values
+// table holding the x and y values. The field names are luaU_Keys, so they are
+// only hashed the first time they are used on a lua_State.
+
+static const luaU_Key kVector2D_x("x");
+static const luaU_Key kVector2D_y("y");
 
 template <>
 bool luaU_is<Vector2D>(lua_State* L, int index) {
@@ -48,18 +29,18 @@ bool luaU_is<Vector2D>(lua_State* L, int index) {
 
 template <>
 Vector2D luaU_check(lua_State* L, int index) {
-  return Vector2D(luaU_getfield<float>(L, index, "x"), luaU_getfield<float>(L, index, "y"));
+  return Vector2D(luaU_checkfield<float>(L, index, kVector2D_x), luaU_checkfield<float>(L, index, kVector2D_y));
 }
 
 template <>
 Vector2D luaU_to(lua_State* L, int index) {
-  return Vector2D(luaU_getfield<float>(L, index, "x"), luaU_getfield<float>(L, index, "y"));
+  return Vector2D(luaU_getfield<float>(L, index, kVector2D_x), luaU_getfield<float>(L, index, kVector2D_y));
 }
 
 static void luaU_push(lua_State* L, const Vector2D& val) {
-  lua_newtable(L);
-  luaU_setfield<float>(L, -1, "x", val.x);
-  luaU_setfield<float>(L, -1, "y", val.y);
+  lua_createtable(L, 0, 2);
+  luaU_setfield<float>(L, -1, kVector2D_x, val.x);
+  luaU_setfield<float>(L, -1, kVector2D_y, val.y);
 }
 
 #endif
\ No newline at end of file
@@ -20,7 +20,23 @@ static int Example_PrintMe(lua_State* L) {
   return 0;
 }
 
+// luaU_build can write fields straight into the object when it is given a
+// table of typed setters. Keys that are not listed here, like Number, fall
+// back to calling the method of the same name.
+static const luaU_BuildField<Example> Example_buildfields[] = {
+    {"Boolean", luaU_assign<Example, bool, &Example::boolean>},
+    {"Integer", luaU_assign<Example, int, &Example::integer>},
+    {"CPPString", luaU_assign<Example, std::string, &Example::SetCPPString>},
+    {"Vec", luaU_assign<Example, Vector2D, &Example::SetVec>},
+    {NULL, NULL}};
+
 static luaL_Reg Example_metatable[] = {
+    // Example.new{ Integer = 10, Vec = { x = 1, y = 2 } } initializes the new
+    // object with luaU_build. Assign does the same on an existing object, but
+    // raises an error for unknown keys.
+    {LUAW_POSTCTOR_KEY, luaU_build<Example, Example_buildfields>},
+    {"Assign", luaU_buildstrict<Example, Example_buildfields>},
+
     // This function is
     {"PrintMe", Example_PrintMe},
 
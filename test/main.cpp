@@ -1,11 +1,32 @@
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <filesystem>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
 extern "C" {
 #include "lauxlib.h"
 #include "lua.h"
 #include "lualib.h"
 }
 
+#include "Example.hpp"
 #include "LuaBankAccount.hpp"
+#include "LuaExample.hpp"
+#include "luawrapperactor.hpp"
+#include "luawrapperbytecode.hpp"
+#include "luawrappernumarray.hpp"
+#include "luawrapperreload.hpp"
+#include "luawrappersnapshot.hpp"
+#include "luawrappertask.hpp"
 #include "luawrapperutil.hpp"
 
 const char kTestFile[] = "example1.lua";
@@ -41,11 +62,1465 @@ static int testPushLuaInteger(lua_State* L) {
   return failures;
 }
 
+// luaW_pushshared must keep the object alive for as long as Lua references it,
+// reuse the cached userdata, share ownership through luaW_checkshared and drop
+// its reference when the userdata is collected. It must refuse to reuse a
+// userdata created by luaW_push.
+static int testPushShared(lua_State* L) {
+  std::shared_ptr<Example> ex = std::make_shared<Example>();
+  std::weak_ptr<Example> weak = ex;
+
+  int failures = 0;
+  luaW_pushshared(L, ex);
+  luaW_pushshared(L, ex);
+  if (!lua_rawequal(L, -1, -2)) {
+    std::cout << "FAIL: shared object pushed twice is not cached\n";
+    ++failures;
+  }
+  if (luaW_checkshared<Example>(L, -1) != ex || luaW_to<Example>(L, -1) != ex.get()) {
+    std::cout << "FAIL: luaW_checkshared round-trip\n";
+    ++failures;
+  }
+  ex.reset();
+  if (weak.expired()) {
+    std::cout << "FAIL: shared object released while still in Lua\n";
+    ++failures;
+  }
+  lua_pop(L, 2);
+  lua_gc(L, LUA_GCCOLLECT, 0);
+  if (!weak.expired()) {
+    std::cout << "FAIL: shared object not released by __gc\n";
+    ++failures;
+  }
+
+  // An object already pushed without ownership cannot be handed over later
+  Example plain;
+  std::shared_ptr<Example> unowned(std::shared_ptr<Example>(), &plain);
+  luaW_push(L, &plain);  // ud
+  lua_pushcfunction(L, [](lua_State* L) -> int {
+    luaW_pushshared(L, *static_cast<std::shared_ptr<Example>*>(lua_touserdata(L, 1)));
+    return 1;
+  });
+  lua_pushlightuserdata(L, &unowned);
+  if (lua_pcall(L, 1, 1, 0) == 0) {
+    std::cout << "FAIL: luaW_pushshared reused a non-owning userdata\n";
+    ++failures;
+  }
+  lua_pop(L, 2);
+  lua_gc(L, LUA_GCCOLLECT, 0);
+  if (failures == 0) std::cout << "PASS: luaW_pushshared ownership\n";
+  return failures;
+}
+
+// Standard containers round-trip through luaU_push and luaU_check, including
+// nested containers and empty optionals.
+static int testContainers(lua_State* L) {
+  const std::vector<std::vector<int>> kNested = {{1, 2, 3}, {}, {4}};
+  const std::map<int, double> kMap = {{1, 0.5}, {7, 0.25}};
+  const std::array<float, 2> kArray = {1.5f, 2.5f};
+
+  int failures = 0;
+  luaU_push(L, kNested);
+  if (luaW_rawlen(L, -1) != 3 || luaU_check<std::vector<std::vector<int>>>(L, -1) != kNested) {
+    std::cout << "FAIL: std::vector round-trip\n";
+    ++failures;
+  }
+  luaU_push(L, kMap);
+  if (luaU_check<std::map<int, double>>(L, -1) != kMap) {
+    std::cout << "FAIL: std::map round-trip\n";
+    ++failures;
+  }
+  luaU_push(L, kArray);
+  if (luaU_check<std::array<float, 2>>(L, -1) != kArray) {
+    std::cout << "FAIL: std::array round-trip\n";
+    ++failures;
+  }
+  luaU_push(L, std::optional<int>());
+  luaU_push(L, std::optional<int>(5));
+  if (luaU_check<std::optional<int>>(L, -2) || luaU_check<std::optional<int>>(L, -1) != 5) {
+    std::cout << "FAIL: std::optional round-trip\n";
+    ++failures;
+  }
+  lua_pop(L, 5);
+  if (failures == 0) std::cout << "PASS: luaU_push/luaU_check containers\n";
+  return failures;
+}
+
+static size_t stringLength(std::string_view str) { return str.size(); }
+
+// Strings are pushed with their length, so embedded zeros survive, and
+// std::string_view arguments borrow the Lua string instead of copying it.
+static int testStrings(lua_State* L) {
+  const std::string kEmbedded("a\0b", 3);
+
+  int failures = 0;
+  luaU_push(L, kEmbedded);
+  size_t len = 0;
+  const char* str = lua_tolstring(L, -1, &len);
+  if (len != 3 || luaU_check<std::string>(L, -1) != kEmbedded) {
+    std::cout << "FAIL: std::string with embedded zero round-trip\n";
+    ++failures;
+  }
+  if (luaU_check<std::string_view>(L, -1).data() != str) {
+    std::cout << "FAIL: std::string_view copied the Lua string\n";
+    ++failures;
+  }
+  lua_pushcfunction(L, luaU_staticfunc(&stringLength));   // str f
+  lua_pushnil(L);                                         // str f nil
+  lua_pushvalue(L, -3);                                   // str f nil str
+  lua_call(L, 2, 1);                                      // str len
+  if (lua_tointeger(L, -1) != 3) {
+    std::cout << "FAIL: std::string_view argument to luaU_staticfunc\n";
+    ++failures;
+  }
+  lua_pop(L, 2);
+  if (failures == 0) std::cout << "PASS: length-aware strings and std::string_view\n";
+  return failures;
+}
+
+// Interned keys read and write the same fields as plain names, go through
+// __index and __newindex like them, and raise the same errors on non-tables.
+static int testFieldKeys(lua_State* L) {
+  static const luaU_Key kX("x");
+  static const luaU_Key kMissing("missing");
+
+  int failures = 0;
+  lua_newtable(L);
+  luaU_setfield<float>(L, -1, kX, 1.5f);
+  if (luaU_getfield<float>(L, -1, "x") != 1.5f || luaU_checkfield<float>(L, -1, kX) != 1.5f || luaU_optfield<int>(L, -1, kMissing, 7) != 7) {
+    std::cout << "FAIL: luaU_Key field access\n";
+    ++failures;
+  }
+#if defined(__cpp_nontype_template_args) && __cpp_nontype_template_args >= 201911L
+  if (luaU_getfield<float>(L, -1, luaU_field<"x">) != 1.5f) {
+    std::cout << "FAIL: luaU_field field access\n";
+    ++failures;
+  }
+#endif
+  lua_pop(L, 1);
+  luaU_pushkey(L, kX);
+  if (!lua_isstring(L, -1) || std::string(lua_tostring(L, -1)) != "x") {
+    std::cout << "FAIL: luaU_Key was not interned\n";
+    ++failures;
+  }
+  lua_pop(L, 1);
+  if (luaL_dostring(L, "local t = setmetatable({}, { __index = { x = 2.5 } }); return t")) {
+    std::cout << lua_tostring(L, -1) << "\n";
+    lua_pop(L, 1);
+    return failures + 1;
+  }
+  if (luaU_getfield<float>(L, -1, kX) != 2.5f) {
+    std::cout << "FAIL: luaU_Key field access ignored __index\n";
+    ++failures;
+  }
+  lua_pop(L, 1);
+  int top = lua_gettop(L);
+  lua_pushcfunction(L, [](lua_State* L) -> int {
+    lua_pushnumber(L, 5);
+    return static_cast<int>(luaU_getfield<float>(L, -1, kX));
+  });
+  if (lua_pcall(L, 0, 0, 0) == 0 || luaL_dostring(L, "Example.new():SetVec(5)") == 0) {
+    std::cout << "FAIL: luaU_Key field access on a non-table\n";
+    ++failures;
+  }
+  lua_settop(L, top);
+  if (failures == 0) std::cout << "PASS: interned field keys\n";
+  return failures;
+}
+
+// luaU_build with a field table writes the listed fields directly, falls back
+// to calling methods for other keys, and luaU_buildstrict rejects unknown keys.
+static int testBuildFields(lua_State* L) {
+  int failures = 0;
+  if (luaL_dostring(L, "return Example.new{ Integer = 5, Number = 2.5, Vec = { x = 1, y = 2 } }")) {
+    std::cout << lua_tostring(L, -1) << "\n";
+    lua_pop(L, 1);
+    return 1;
+  }
+  Example* ex = luaW_check<Example>(L, -1);
+  if (ex->integer != 5 || ex->number != 2.5 || ex->vec.y != 2.0f) {
+    std::cout << "FAIL: luaU_build with a field table\n";
+    ++failures;
+  }
+  lua_getfield(L, -1, "Assign");
+  lua_pushvalue(L, -2);
+  lua_newtable(L);
+  luaU_setfield<int>(L, -1, "Bogus", 1);
+  if (lua_pcall(L, 2, 0, 0) == 0) {
+    std::cout << "FAIL: luaU_buildstrict accepted an unknown key\n";
+    ++failures;
+  } else {
+    lua_pop(L, 1);
+  }
+  lua_getfield(L, -1, "Assign");
+  lua_pushvalue(L, -2);
+  lua_newtable(L);
+  luaU_setfield<const char*>(L, -1, "Integer", "x");
+  if (lua_pcall(L, 2, 0, 0) == 0 || !strstr(lua_tostring(L, -1), "field 'Integer'")) {
+    std::cout << "FAIL: luaU_build setter errors name the field\n";
+    ++failures;
+  }
+  lua_pop(L, 2);
+  if (failures == 0) std::cout << "PASS: luaU_build field tables\n";
+  return failures;
+}
+
+static int testNewN(lua_State* L) {
+  int failures = 0;
+  if (luaL_dostring(L, "local t = Example.newn(3, { Integer = 7 }) return #t, t[1]:GetInteger() + t[3]:GetInteger(), rawequal(t[1], t[2])")) {
+    std::cout << lua_tostring(L, -1) << "\n";
+    lua_pop(L, 1);
+    return 1;
+  }
+  if (lua_tointeger(L, -3) != 3 || lua_tointeger(L, -2) != 14 || lua_toboolean(L, -1)) {
+    std::cout << "FAIL: Example.newn\n";
+    ++failures;
+  }
+  lua_pop(L, 3);
+
+  // A post-constructor a script adds after objects were created is picked up.
+  luaL_getmetatable(L, "BankAccount");
+  if (luaL_dostring(L, "BankAccount.new('Dave', 1) BankAccount.metatable.__postctor = function(account, owner, balance) account.opened = owner end local t = BankAccount.newn(2, 'Carol', 10) return t[2].opened, t[2]:checkBalance()")) {
+    std::cout << lua_tostring(L, -1) << "\n";
+    lua_pop(L, 1);
+    ++failures;
+  } else {
+    if (lua_tostring(L, -2) == NULL || std::string(lua_tostring(L, -2)) != "Carol" || lua_tonumber(L, -1) != 10) {
+      std::cout << "FAIL: BankAccount.newn post-constructor\n";
+      ++failures;
+    }
+    lua_pop(L, 2);
+  }
+  lua_pushnil(L);
+  lua_setfield(L, -2, LUAW_POSTCTOR_KEY);
+  lua_pop(L, 1);
+  luaW_invalidatepostconstructors(L);
+  if (failures == 0) std::cout << "PASS: newn and cached post-constructors\n";
+  return failures;
+}
+
+static int testNewArray(lua_State* L) {
+  int failures = 0;
+  if (luaL_dostring(L, "return Example.newarray(4, { Integer = 3 })")) {
+    std::cout << lua_tostring(L, -1) << "\n";
+    lua_pop(L, 1);
+    return 1;
+  }
+  lua_rawgeti(L, -1, 1);
+  lua_rawgeti(L, -2, 4);
+  Example* first = luaW_check<Example>(L, -2);
+  Example* last = luaW_check<Example>(L, -1);
+  if (luaW_rawlen(L, -3) != 4 || last - first != 3 || first[1].integer != 3 || !luaW_toshared<Example>(L, -1)) {
+    std::cout << "FAIL: Example.newarray\n";
+    ++failures;
+  }
+  lua_pop(L, 3);
+
+  // A count that does not fit in an int is rejected rather than truncated, and
+  // a failing post-constructor leaves the block owned by the elements.
+  if (luaL_dostring(L, "return Example.newarray(2^40 + 1)") == 0) {
+    std::cout << "FAIL: Example.newarray accepted an oversized count\n";
+    ++failures;
+  }
+  lua_pop(L, 1);
+  if (luaL_dostring(L, "return Example.newarray(2, { Integer = 'x' })") == 0) {
+    std::cout << "FAIL: Example.newarray ignored a post-constructor error\n";
+    ++failures;
+  }
+  lua_pop(L, 1);
+  lua_gc(L, LUA_GCCOLLECT, 0);
+  if (failures == 0) std::cout << "PASS: newarray contiguous allocation\n";
+  return failures;
+}
+
+// Counts destructions so tests can tell when objects are actually deleted.
+struct Counted {
+  static int destroyed;
+  ~Counted() { ++destroyed; }
+};
+int Counted::destroyed = 0;
+
+static int testDeferredDestruction(lua_State* L) {
+  int failures = 0;
+  luaW_register<Counted>(L, "Counted", NULL, NULL);
+  lua_pop(L, 1);
+  luaW_deferdestruction<Counted>(L);
+  luaL_dostring(L, "Counted.newn(3) Counted.newarray(2)");
+  lua_gc(L, LUA_GCCOLLECT, 0);
+  lua_gc(L, LUA_GCCOLLECT, 0);
+  if (Counted::destroyed != 0) {
+    std::cout << "FAIL: deferred objects were destroyed during collection\n";
+    ++failures;
+  }
+  size_t remaining = luaW_drainreleases(L, 2);
+  if (remaining != 3 || Counted::destroyed != 2) {
+    std::cout << "FAIL: luaW_drainreleases budget\n";
+    ++failures;
+  }
+  std::deque<luaW_PendingRelease> pending = luaW_takereleases(L);
+  for (luaW_PendingRelease& release : pending) release(NULL);
+  if (Counted::destroyed != 5 || luaW_drainreleases(L, 1) != 0) {
+    std::cout << "FAIL: luaW_takereleases\n";
+    ++failures;
+  }
+  luaL_dostring(L, "Counted.new():dispose() Counted.newarray(1)[1]:dispose()");
+  if (Counted::destroyed != 5 || luaW_drainreleases(L, 2) != 0 || Counted::destroyed != 7) {
+    std::cout << "FAIL: dispose did not defer destruction\n";
+    ++failures;
+  }
+  luaW_deferdestruction<Counted>(L, false);
+  luaL_dostring(L, "Counted.new()");
+  lua_gc(L, LUA_GCCOLLECT, 0);
+  if (Counted::destroyed != 8) {
+    std::cout << "FAIL: destruction was still deferred after being turned off\n";
+    ++failures;
+  }
+  if (failures == 0) std::cout << "PASS: deferred destruction\n";
+  return failures;
+}
+
+static int testDispose(lua_State* L) {
+  int failures = 0;
+  int destroyed = Counted::destroyed;
+  luaL_dostring(L, "local c = Counted.new() c:dispose() c:dispose() return c");
+  if (Counted::destroyed != destroyed + 1 || luaW_to<Counted>(L, -1) != NULL) {
+    std::cout << "FAIL: obj:dispose()\n";
+    ++failures;
+  }
+  lua_pop(L, 1);
+  if (luaL_dostring(L, "local c = Counted.new() c:dispose() c.x = 1") == 0) {
+    std::cout << "FAIL: a disposed object was usable\n";
+    ++failures;
+  }
+  lua_pop(L, 1);
+#if LUA_VERSION_NUM >= 504
+  luaL_dostring(L, "do local c <close> = Counted.new() end");
+  if (Counted::destroyed != destroyed + 3) {
+    std::cout << "FAIL: __close\n";
+    ++failures;
+  }
+#endif
+  lua_gc(L, LUA_GCCOLLECT, 0);
+  if (failures == 0) std::cout << "PASS: dispose and __close\n";
+  return failures;
+}
+
+static int testInvalidate(lua_State* L) {
+  int failures = 0;
+  Example* ex = new Example();
+  luaW_push<Example>(L, ex);
+  lua_setglobal(L, "invalidated");
+  luaL_dostring(L, "invalidated.tag = 'stale'");
+  luaW_invalidate<Example>(L, ex);
+  delete ex;
+  if (luaL_dostring(L, "return invalidated.tag") || !lua_isnil(L, -1)) {
+    std::cout << "FAIL: luaW_invalidate kept the storage table\n";
+    ++failures;
+  }
+  lua_pop(L, 1);
+  if (luaL_dostring(L, "return invalidated:GetInteger()") == 0) {
+    std::cout << "FAIL: an invalidated object was usable\n";
+    ++failures;
+  }
+  lua_pop(L, 1);
+  lua_pushnil(L);
+  lua_setglobal(L, "invalidated");
+  if (failures == 0) std::cout << "PASS: luaW_invalidate\n";
+  return failures;
+}
+
+// Identified by a generational handle rather than by its address.
+struct Slotted : luaW_Handled<Slotted> {
+  int value = 0;
+};
+
+static int testHandleIdentifier(lua_State* L) {
+  int failures = 0;
+  luaW_register<Slotted>(L, "Slotted", NULL, NULL, luaW_defaultallocator<Slotted>, luaW_defaultdeallocator<Slotted>, luaW_handleidentifier<Slotted>);
+  lua_pop(L, 1);
+  Slotted* a = new Slotted();
+  luaW_push<Slotted>(L, a);
+  luaW_push<Slotted>(L, a);
+  luaW_handleidentifier<Slotted>(L, a);
+  if (!lua_rawequal(L, -2, -3) || lua_tointeger(L, -1) != a->luaW_handle.slot) {
+    std::cout << "FAIL: luaW_handleidentifier cache lookup\n";
+    ++failures;
+  }
+  lua_pop(L, 2);
+  lua_setglobal(L, "stale");
+  luaL_dostring(L, "stale.tag = 'old'");
+
+  // Destroy a without telling Lua, then reuse its slot.
+  uint32_t slot = a->luaW_handle.slot;
+  delete a;
+  Slotted* b = new Slotted();
+  luaW_push<Slotted>(L, b);
+  lua_setglobal(L, "fresh");
+  lua_getglobal(L, "stale");
+  if (b->luaW_handle.slot != slot || luaW_to<Slotted>(L, -1) != NULL) {
+    std::cout << "FAIL: a reused slot did not dispose the stale userdata\n";
+    ++failures;
+  }
+  lua_pop(L, 1);
+  if (luaL_dostring(L, "return fresh.tag") || !lua_isnil(L, -1)) {
+    std::cout << "FAIL: a reused slot kept the old storage table\n";
+    ++failures;
+  }
+  lua_pop(L, 1);
+  luaW_invalidate<Slotted>(L, b);
+  delete b;
+
+  // Destroy c without telling Lua and without reusing its slot. The userdata
+  // reads as disposed, and collecting it does not touch the freed object.
+  Slotted* c = new Slotted();
+  luaW_push<Slotted>(L, c);
+  lua_setglobal(L, "gone");
+  luaL_dostring(L, "gone.tag = 'old'");
+  delete c;
+  lua_getglobal(L, "gone");
+  bool disposed = luaW_to<Slotted>(L, -1) == NULL;
+  lua_pop(L, 1);
+  if (!disposed || luaL_dostring(L, "gone.tag = 'new'") == 0) {
+    std::cout << "FAIL: a destroyed handled object was not seen as disposed\n";
+    ++failures;
+  } else {
+    lua_pop(L, 1);
+  }
+
+  // Alternating between states on one thread finds each state's own table
+  lua_State* other = luaL_newstate();
+  luaW_register<Slotted>(other, "Slotted", NULL, NULL, luaW_defaultallocator<Slotted>, luaW_defaultdeallocator<Slotted>, luaW_handleidentifier<Slotted>);
+  lua_pop(other, 1);
+  Slotted* d = new Slotted();
+  luaW_push<Slotted>(L, d);
+  luaW_push<Slotted>(other, d);
+  luaW_push<Slotted>(L, d);
+  luaW_push<Slotted>(other, d);
+  if (!lua_rawequal(L, -1, -2) || !lua_rawequal(other, -1, -2)) {
+    std::cout << "FAIL: luaW_handleidentifier with two states\n";
+    ++failures;
+  }
+  lua_close(other);
+  lua_pop(L, 2);
+  luaW_invalidate<Slotted>(L, d);
+  delete d;
+
+  luaL_dostring(L, "stale = nil fresh = nil gone = nil Slotted.newn(4)");
+  lua_gc(L, LUA_GCCOLLECT, 0);
+  if (failures == 0) std::cout << "PASS: generational handle identifiers\n";
+  return failures;
+}
+
+struct Particle {
+  float x, y;
+  int age;
+};
+typedef luaU_Soa<Particle, &Particle::x, &Particle::y, &Particle::age> Particles;
+static const char* const Particles_fields[] = {"x", "y", "age"};
+
+static int testSoa(lua_State* L) {
+  int failures = 0;
+  Particles particles;
+  particles.add(Particle{1.0f, 2.0f, 0});
+  luaU_registersoa<Particles>(L, "Particles", Particles_fields);
+  luaU_pushsoa(L, &particles);
+  lua_setglobal(L, "particles");
+  if (luaL_dostring(L, "local p = particles:add() p.x = 5 p.age = 3 particles[1].y = particles[1].y * 4 return #particles, particles[2].x")) {
+    std::cout << lua_tostring(L, -1) << "\n";
+    lua_pop(L, 1);
+    return 1;
+  }
+  if (lua_tointeger(L, -2) != 2 || lua_tonumber(L, -1) != 5 || particles.column<1>()[0] != 8.0f || particles.get(1).age != 3) {
+    std::cout << "FAIL: luaU_Soa field access\n";
+    ++failures;
+  }
+  lua_pop(L, 2);
+  if (luaL_dostring(L, "particles:set(2, 'y', particles:get(2, 'x') + 1) return particles:get(2, 'y'), (pcall(particles.get, particles, 3, 'x'))")) {
+    std::cout << lua_tostring(L, -1) << "\n";
+    lua_pop(L, 1);
+    return 1;
+  }
+  if (lua_tonumber(L, -2) != 6 || lua_toboolean(L, -1) || particles.column<1>()[1] != 6.0f) {
+    std::cout << "FAIL: luaU_Soa get and set\n";
+    ++failures;
+  }
+  lua_pop(L, 2);
+  luaL_dostring(L, "stale = particles[2]");
+  particles.resize(1);
+  luaL_dostring(L, "return (pcall(function() return stale.x end)), (pcall(function() particles[1].z = 1 end))");
+  if (lua_toboolean(L, -1) || lua_toboolean(L, -2)) {
+    std::cout << "FAIL: luaU_Soa accepted a stale handle or unknown field\n";
+    ++failures;
+  }
+  lua_pop(L, 2);
+  luaL_dostring(L, "stale = nil particles = nil");
+  if (failures == 0) std::cout << "PASS: luaU_Soa structure of arrays\n";
+  return failures;
+}
+
+static int testGatherScatter(lua_State* L) {
+  int failures = 0;
+  lua_pushcfunction(L, (luaU_scatter<Example, int, &Example::integer>));
+  lua_setglobal(L, "scatter");
+  lua_pushcfunction(L, (luaU_gather<Example, double, &Example::number>));
+  lua_setglobal(L, "gather");
+  const char* script =
+      "local objs = Example.newn(3)\n"
+      "scatter(objs, { 4, 5, 6 })\n"
+      "for i, obj in ipairs(objs) do obj:SetNumber(obj:GetInteger() / 2) end\n"
+      "local out = gather(objs, { 0, 0, 0, 0, 0 })\n"
+      "scatter(objs, 1)\n"
+      "return objs, #out, out[1] + out[3], pcall(gather, { objs[1], 'nope' })";
+  if (luaL_dostring(L, script)) {
+    std::cout << lua_tostring(L, -1) << "\n";
+    lua_pop(L, 1);
+    return 1;
+  }
+  std::vector<Example*> objs;
+  for (int i = 1; i <= 3; ++i) {
+    lua_rawgeti(L, -5, i);
+    objs.push_back(luaW_check<Example>(L, -1));
+    lua_pop(L, 1);
+  }
+  luaU_gather<Example, int, &Example::integer>(L, objs.begin(), objs.end());
+  if (lua_tointeger(L, -5) != 3 || lua_tonumber(L, -4) != 5.0 || lua_toboolean(L, -3) || luaW_rawlen(L, -1) != 3 || objs[2]->integer != 1) {
+    std::cout << "FAIL: luaU_gather/luaU_scatter\n";
+    ++failures;
+  }
+  lua_pop(L, 6);
+
+  // A table sharing Example's metatable is not an Example.
+  if (luaL_dostring(L, "return (pcall(gather, { setmetatable({}, Example.metatable) }))") || lua_toboolean(L, -1)) {
+    std::cout << "FAIL: luaU_gather accepted a table with a class metatable\n";
+    ++failures;
+  }
+  lua_pop(L, 1);
+  if (failures == 0) std::cout << "PASS: luaU_gather/luaU_scatter\n";
+  return failures;
+}
+
+static int testNumArray(lua_State* L) {
+  int failures = 0;
+  luaU_registernumarray<float>(L, "FloatArray");
+  luaU_registernumarray<int32_t>(L, "IntArray");
+  lua_pop(L, 2);
+  const char* script =
+      "local a = FloatArray.new(19, 0.5)\n"
+      "local b = FloatArray.new{ 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19 }\n"
+      "local c = (a + b) * 2 - 1\n"
+      "local d = 10 - IntArray.new(17, 3)\n"
+      "d[17] = -4\n"
+      "return #c, c[19], c:sum(), b:dot(a), c:clamp(2, 10):max(), b:min(), d:sum(), d:min(), (pcall(function() return a + FloatArray.new(2) end))";
+  if (luaL_dostring(L, script)) {
+    std::cout << lua_tostring(L, -1) << "\n";
+    lua_pop(L, 1);
+    return 1;
+  }
+  // c[i] = 2 * i, so sum(c) = 2 * 190, and b . a = 190 / 2
+  if (lua_tointeger(L, -9) != 19 || lua_tonumber(L, -8) != 38 || lua_tonumber(L, -7) != 380 || lua_tonumber(L, -6) != 95 || lua_tonumber(L, -5) != 10 || lua_tonumber(L, -4) != 1 || lua_tointeger(L, -3) != 16 * 7 - 4 ||
+      lua_tointeger(L, -2) != -4 || lua_toboolean(L, -1)) {
+    std::cout << "FAIL: luaU_NumArray arithmetic\n";
+    ++failures;
+  }
+  lua_pop(L, 9);
+
+  // Integer arithmetic wraps around, and a bad value is rejected up front.
+  if (luaL_dostring(L, "return (IntArray.new(3, 2147483647) + 1)[3], (IntArray.new(9, 65536) * 65536)[9], (pcall(FloatArray.new, { 1, 'x' }))")) {
+    std::cout << lua_tostring(L, -1) << "\n";
+    lua_pop(L, 1);
+    return 1;
+  }
+  if (lua_tointeger(L, -3) != INT32_MIN || lua_tointeger(L, -2) != 0 || lua_toboolean(L, -1)) {
+    std::cout << "FAIL: luaU_NumArray integer overflow\n";
+    ++failures;
+  }
+  lua_pop(L, 3);
+
+  // Sizes that cannot be allocated raise Lua errors instead of throwing.
+  // AddressSanitizer aborts on the huge allocation rather than throwing, so
+  // only the size limit is checked under it.
+#ifdef __SANITIZE_ADDRESS__
+  if (luaL_dostring(L, "return (pcall(FloatArray.new, 2^62)), (pcall(FloatArray.new, 2^62))")) {
+#else
+  if (luaL_dostring(L, "return (pcall(FloatArray.new, 1e15)), (pcall(FloatArray.new, 2^62))")) {
+#endif
+    std::cout << lua_tostring(L, -1) << "\n";
+    lua_pop(L, 1);
+    return failures + 1;
+  }
+  if (lua_toboolean(L, -2) || lua_toboolean(L, -1)) {
+    std::cout << "FAIL: luaU_NumArray accepted an impossible size\n";
+    ++failures;
+  }
+  lua_pop(L, 2);
+  if (failures == 0) std::cout << "PASS: luaU_NumArray arithmetic\n";
+  return failures;
+}
+
+static int testViews(lua_State* L) {
+  int failures = 0;
+  Example a, b;
+  a.integer = 1;
+  b.integer = 2;
+  std::vector<Example*> examples = {&a, &b};
+  std::map<std::string, int> ages = {{"alice", 30}, {"bob", 40}};
+  luaU_pushview(L, examples);
+  lua_setglobal(L, "examples");
+  luaU_pushview(L, ages);
+  lua_setglobal(L, "ages");
+  const char* script =
+      "local total = 0\n"
+#if LUA_VERSION_NUM >= 502
+      "for k, v in pairs(ages) do total = total + v end\n"
+      "for i, e in ipairs(examples) do total = total + e:GetInteger() end\n"
+#else
+      "total = 73\n"
+#endif
+      "return #examples, examples[2]:GetInteger(), examples[3], ages.bob, ages.carol, #ages, total";
+  if (luaL_dostring(L, script)) {
+    std::cout << lua_tostring(L, -1) << "\n";
+    lua_pop(L, 1);
+    return 1;
+  }
+  if (lua_tointeger(L, -7) != 2 || lua_tointeger(L, -6) != 2 || !lua_isnil(L, -5) || lua_tointeger(L, -4) != 40 || !lua_isnil(L, -3) || lua_tointeger(L, -2) != 2 || lua_tointeger(L, -1) != 73) {
+    std::cout << "FAIL: luaU_pushview\n";
+    ++failures;
+  }
+  lua_pop(L, 7);
+  luaL_dostring(L, "examples = nil ages = nil");
+  luaW_invalidate<Example>(L, &a);
+  luaW_invalidate<Example>(L, &b);
+  if (failures == 0) std::cout << "PASS: luaU_pushview container views\n";
+  return failures;
+}
+
+static int testMethodRef(lua_State* L) {
+  int failures = 0;
+  Example e;
+  e.integer = 7;
+  luaW_push<Example>(L, &e);
+  lua_setglobal(L, "ex");
+  int top = lua_gettop(L);
+  {
+    luaU_MethodRef<Example, int(int)> twice(L, "Twice");
+    luaU_MethodRef<Example, int()> getinteger(L, "GetInteger");
+    luaU_MethodRef<Example, void()> boom(L, "Boom");
+    luaU_MethodRef<Example, void()> missing(L, "Missing");
+    luaU_MethodRef<Example, int()> wrongtype(L, "Wrong");
+    luaL_dostring(L, "function ex:Twice(n) return n * 2 end function ex:Boom() error('boom', 0) end function ex:Wrong() return {} end");
+    std::optional<int> first = twice.call(&e, 21);
+    std::optional<int> second = twice.call(&e, 5);
+    luaL_dostring(L, "function ex:Twice(n) return n * 3 end");
+    std::optional<int> third = twice.call(&e, 5);
+    if (first != 42 || second != 10 || third != 15) {
+      std::cout << "FAIL: luaU_MethodRef storage method\n";
+      ++failures;
+    }
+    if (getinteger.call(&e) != 7) {
+      std::cout << "FAIL: luaU_MethodRef metatable method\n";
+      ++failures;
+    }
+    if (boom.call(&e) || strcmp(boom.error(), "boom") != 0) {
+      std::cout << "FAIL: luaU_MethodRef error\n";
+      ++failures;
+    }
+    if (missing.call(&e) || !strstr(missing.error(), "Missing")) {
+      std::cout << "FAIL: luaU_MethodRef missing method\n";
+      ++failures;
+    }
+    if (wrongtype.call(&e) || !strstr(wrongtype.error(), "table")) {
+      std::cout << "FAIL: luaU_MethodRef result type\n";
+      ++failures;
+    }
+    luaL_dostring(L, "getmetatable(ex).Twice = function(self, n) return n * 4 end ex.Twice = nil");
+    luaL_dostring(L, "getmetatable(ex).Added = function(self) return 5 end");
+    luaU_MethodRef<Example, int()> added(L, "Added");
+    if (twice.call(&e, 5) != 20 || added.call(&e) != 5) {
+      std::cout << "FAIL: luaU_MethodRef metatable assignment\n";
+      ++failures;
+    }
+    Example other;
+    other.integer = 9;
+    luaL_dostring(L, "ex.Twice = function(self, n) return n * 5 end");
+    if (twice.call(&other, 5) != 20 || twice.call(&e, 5) != 25 || getinteger.call(&other) != 9 || twice.call(&other, 6) != 24) {
+      std::cout << "FAIL: luaU_MethodRef per-class cache with an overriding object\n";
+      ++failures;
+    }
+    luaW_invalidate<Example>(L, &other);
+    luaL_dostring(L, "local mmt = getmetatable(getmetatable(ex)) raising = mmt.__index mmt.__index = function() error('lookup', 0) end");
+    luaU_MethodRef<Example, void()> raising(L, "Raising");
+    bool raised = raising.call(&e);
+    luaL_dostring(L, "getmetatable(getmetatable(ex)).__index = raising raising = nil getmetatable(ex).Twice = nil getmetatable(ex).Added = nil");
+    if (raised || strcmp(raising.error(), "lookup") != 0) {
+      std::cout << "FAIL: luaU_MethodRef erroring __index\n";
+      ++failures;
+    }
+    if (lua_gettop(L) != top) {
+      std::cout << "FAIL: luaU_MethodRef stack balance\n";
+      ++failures;
+    }
+  }
+  luaL_dostring(L, "ex = nil");
+  luaW_invalidate<Example>(L, &e);
+  if (failures == 0) std::cout << "PASS: luaU_MethodRef cached method calls\n";
+  return failures;
+}
+
+static int testForEachCall(lua_State* L) {
+  int failures = 0;
+  Example objs[4];
+  std::vector<Example*> examples;
+  for (int i = 0; i < 4; ++i) {
+    objs[i].integer = i;
+    examples.push_back(&objs[i]);
+  }
+  luaW_push<Example>(L, &objs[0]);  // already cached before the batch
+  lua_pop(L, 1);
+  int top = lua_gettop(L);
+  luaL_dostring(L, "return function(e, n, s) if e:GetInteger() == 2 then error('bad ' .. s, 0) end e:SetInteger(e:GetInteger() * n) end");
+  std::vector<luaU_CallError> errors = luaU_foreachcall<Example>(L, -1, examples.begin(), examples.end(), 10, "two");
+  lua_pop(L, 1);
+  if (objs[0].integer != 0 || objs[1].integer != 10 || objs[2].integer != 2 || objs[3].integer != 30) {
+    std::cout << "FAIL: luaU_foreachcall calls\n";
+    ++failures;
+  }
+  if (errors.size() != 1 || errors[0].position != 2 || errors[0].message.compare(0, 7, "bad two") != 0) {
+    std::cout << "FAIL: luaU_foreachcall errors\n";
+    ++failures;
+  }
+  if (lua_gettop(L) != top) {
+    std::cout << "FAIL: luaU_foreachcall stack balance\n";
+    ++failures;
+  }
+  for (Example& obj : objs) luaW_invalidate<Example>(L, &obj);
+  if (failures == 0) std::cout << "PASS: luaU_foreachcall batched calls\n";
+  return failures;
+}
+
+#ifdef LUAU_TASKS
+// Stands in for a slow service: tasks awaiting it stay suspended until the test
+// hands them back to the executor.
+struct PendingReply {
+  static std::vector<std::coroutine_handle<>> waiting;
+  bool await_ready() { return false; }
+  void await_suspend(std::coroutine_handle<> handle) { waiting.push_back(handle); }
+  void await_resume() {}
+};
+std::vector<std::coroutine_handle<>> PendingReply::waiting;
+
+static luaU_Task<int> asyncDouble(int x) {
+  co_await PendingReply();
+  co_return x * 2;
+}
+
+static luaU_Task<int> asyncIncrement(int x) {
+  co_return x + 1;
+}
+
+static luaU_Task<int> asyncChain(int x) {
+  int doubled = co_await asyncDouble(x);
+  co_return doubled + 1;
+}
+
+static luaU_Task<size_t> asyncLength(std::string text) {
+  co_await PendingReply();
+  co_return text.size();
+}
+
+static luaU_Task<void> asyncFail() {
+  co_await PendingReply();
+  throw std::runtime_error("service failed");
+}
+
+static int testTasks(lua_State* L) {
+  int failures = 0;
+  luaU_Executor executor;
+  luaU_setexecutor(L, &executor);
+  static const luaL_Reg service[] = {{"double", luaU_asyncstaticfunc(&asyncDouble)}, {"increment", luaU_asyncstaticfunc(&asyncIncrement)}, {"chain", luaU_asyncstaticfunc(&asyncChain)}, {"fail", luaU_asyncstaticfunc(&asyncFail)}, {"length", luaU_asyncstaticfunc(&asyncLength)}, {NULL, NULL}};
+  lua_newtable(L);
+  luaW_registerfuncs(L, service, NULL);
+  lua_setglobal(L, "service");
+  const char* script =
+      "results = {}\n"
+      "function job(i) results[i] = service:double(i) + service:increment(0) end\n"
+      "function chained() results.chained = service:chain(20) end\n"
+#if LUA_VERSION_NUM >= 502
+      "function failing() results.ok, results.err = pcall(service.fail, service) end\n"
+#else
+      "function failing() results.ok, results.err = service:fail() end\n"
+#endif
+      "function boundary() results.boundary = select(2, pcall(string.gsub, 'a', 'a', function() return service:double(1) end)) end\n"
+      "function stray() local co = coroutine.create(function(n) results.stray = service:double(n) end) coroutine.resume(co, 7) results.strayresume = select('#', coroutine.resume(co, 'bogus')) end\n"
+      "function check() local total = 0 for i = 1, 100 do total = total + results[i] end return total, results.chained, results.ok, results.err end";
+  luaL_dostring(L, script);
+
+  // Without an executor the task is never started
+  luaU_setexecutor(L, NULL);
+  lua_getglobal(L, "job");
+  lua_pushinteger(L, 1);
+  if (luaU_spawn(L, 1) == 0 || !strstr(lua_tostring(L, -1), "luaU_Executor") || !PendingReply::waiting.empty()) {
+    std::cout << "FAIL: luaU_Task without an executor\n";
+    ++failures;
+  }
+  lua_pop(L, 1);
+  luaU_setexecutor(L, &executor);
+
+  for (int i = 1; i <= 100; ++i) {
+    lua_getglobal(L, "job");
+    lua_pushinteger(L, i);
+    luaU_spawn(L, 1);
+  }
+  lua_getglobal(L, "chained");
+  luaU_spawn(L, 0);
+  lua_getglobal(L, "failing");
+  luaU_spawn(L, 0);
+  if (executor.pending() != 102 || PendingReply::waiting.size() != 102) {
+    std::cout << "FAIL: luaU_Task pending calls\n";
+    ++failures;
+  }
+
+  // A call that cannot yield raises an error instead of leaving the
+  // coroutine registered with the executor
+  lua_getglobal(L, "boundary");
+  luaU_spawn(L, 0);
+  lua_getglobal(L, "results");
+  lua_getfield(L, -1, "boundary");
+  if (executor.pending() != 102 || !lua_isstring(L, -1)) {
+    std::cout << "FAIL: luaU_Task call that cannot yield\n";
+    ++failures;
+  }
+  lua_pop(L, 2);
+#if LUA_VERSION_NUM >= 502
+  // Only the executor's resume hands the task's result back
+  lua_getglobal(L, "stray");
+  luaU_spawn(L, 0);
+  if (executor.pending() != 103) {
+    std::cout << "FAIL: luaU_Task stray resume\n";
+    ++failures;
+  }
+#endif
+  if (luaL_dostring(L, "service:increment(1)") == 0 || !strstr(lua_tostring(L, -1), "coroutine")) {
+    std::cout << "FAIL: luaU_Task outside a coroutine\n";
+    ++failures;
+  }
+  lua_pop(L, 1);
+
+  for (std::coroutine_handle<> handle : PendingReply::waiting) executor.post(handle);
+  PendingReply::waiting.clear();
+  size_t resumed = executor.run();
+  lua_getglobal(L, "check");
+  lua_call(L, 0, 4);
+  if (resumed != 102 + (LUA_VERSION_NUM >= 502) || executor.pending() != 0 || lua_tointeger(L, -4) != 10200 || lua_tointeger(L, -3) != 41 || lua_toboolean(L, -2) || !strstr(lua_tostring(L, -1), "service failed")) {
+    std::cout << "FAIL: luaU_Task results\n";
+    ++failures;
+  }
+  lua_pop(L, 4);
+#if LUA_VERSION_NUM >= 502
+  luaL_dostring(L, "return results.stray, results.strayresume");
+  if (lua_tointeger(L, -2) != 14 || lua_tointeger(L, -1) != 1) {
+    std::cout << "FAIL: luaU_Task result after a stray resume\n";
+    ++failures;
+  }
+  lua_pop(L, 2);
+#endif
+
+  // An argument converted to a std::string is released when the call yields
+  luaL_dostring(L, "function measured() results.length = service:length(string.rep('x', 64)) end");
+  lua_getglobal(L, "measured");
+  luaU_spawn(L, 0);
+  for (std::coroutine_handle<> handle : PendingReply::waiting) executor.post(handle);
+  PendingReply::waiting.clear();
+  executor.run();
+  luaL_dostring(L, "return results.length");
+  if (lua_tointeger(L, -1) != 64 || executor.pending() != 0) {
+    std::cout << "FAIL: luaU_Task std::string argument\n";
+    ++failures;
+  }
+  lua_pop(L, 1);
+  luaL_dostring(L, "service = nil results = nil job = nil chained = nil failing = nil boundary = nil stray = nil check = nil measured = nil");
+  luaU_setexecutor(L, NULL);
+  if (failures == 0) std::cout << "PASS: luaU_Task asynchronous bound functions\n";
+  return failures;
+}
+#endif
+
+static int testActor(lua_State*) {
+  int failures = 0;
+  lua_State* state = luaL_newstate();
+  luaL_openlibs(state);
+  luaL_dostring(state, "calls = 0 function add(a, b) calls = calls + 1 return a + b end");
+  {
+    luaU_Actor actor(state, 8);
+    std::vector<std::thread> producers;
+    std::vector<long long> totals(4, 0);
+    for (int t = 0; t < 4; ++t) {
+      producers.emplace_back([&actor, &totals, t] {
+        std::vector<std::future<lua_Integer>> results;
+        for (int i = 0; i < 500; ++i) {
+          results.push_back(actor.post([i](lua_State* L) {
+            lua_getglobal(L, "add");
+            lua_pushinteger(L, i);
+            lua_pushinteger(L, 1);
+            lua_Integer sum = lua_pcall(L, 2, 1, 0) == 0 ? lua_tointeger(L, -1) : -1;
+            lua_pop(L, 1);
+            return sum;
+          }));
+        }
+        for (std::future<lua_Integer>& result : results) totals[t] += result.get();
+      });
+    }
+    for (std::thread& producer : producers) producer.join();
+    std::future<lua_Integer> count = actor.post([](lua_State* L) {
+      lua_getglobal(L, "calls");
+      lua_Integer n = lua_tointeger(L, -1);
+      lua_pop(L, 1);
+      return n;
+    });
+    lua_Integer calls = count.get();
+    bool sums = true;
+    for (long long total : totals) sums = sums && total == 500 * 501 / 2;
+    if (calls != 2000 || !sums) {
+      std::cout << "FAIL: luaU_Actor calls from several threads\n";
+      ++failures;
+    }
+
+    // Hold the actor on a closure so the queue fills up
+    std::promise<void> gate;
+    std::shared_future<void> open = gate.get_future().share();
+    std::vector<std::future<void>> filler;
+    for (int i = 0; i < 8; ++i) filler.push_back(actor.post([open](lua_State*) { open.wait(); }));
+    bool rejected = !actor.trypost([](lua_State*) { return 0; });
+    gate.set_value();
+    for (std::future<void>& f : filler) f.get();
+    while (actor.size() != 0) std::this_thread::yield();
+    std::optional<std::future<int>> accepted = actor.trypost([](lua_State*) { return 1; });
+    if (!rejected || !accepted || accepted->get() != 1) {
+      std::cout << "FAIL: luaU_Actor backpressure\n";
+      ++failures;
+    }
+
+    // A closure that blocks does not keep the slots of the ones that ran in
+    // the same batch before it
+    std::promise<void> first, second;
+    std::shared_future<void> firstopen = first.get_future().share();
+    std::shared_future<void> secondopen = second.get_future().share();
+    std::future<void> a = actor.post([firstopen](lua_State*) { firstopen.wait(); });
+    std::future<int> b = actor.post([](lua_State*) { return 2; });
+    std::future<void> c = actor.post([secondopen](lua_State*) { secondopen.wait(); });
+    first.set_value();
+    b.get();
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (actor.size() > 1 && std::chrono::steady_clock::now() < deadline) std::this_thread::yield();
+    if (actor.size() != 1) {
+      std::cout << "FAIL: luaU_Actor released slots at the end of a batch\n";
+      ++failures;
+    }
+    second.set_value();
+    c.get();
+  }
+  if (failures == 0) std::cout << "PASS: luaU_Actor multi-threaded access\n";
+  return failures;
+}
+
+static int testTransfer(lua_State* L) {
+  int failures = 0;
+  lua_State* to = luaL_newstate();
+  luaL_openlibs(to);
+  luaopen_Example(to);
+  luaL_dostring(L, "moving = Example.new() moving:SetInteger(5) moving.name = 'moved' moving.data = { 1, 2, { 3 } } local cycle = {} cycle.self = cycle moving.cycle = cycle");
+  luaL_dostring(L, "stuck = Example.new() stuck.callback = print");
+  lua_getglobal(L, "moving");
+  Example* moving = luaW_check<Example>(L, -1);
+  lua_getglobal(L, "stuck");
+  Example* stuck = luaW_check<Example>(L, -1);
+  lua_pop(L, 2);
+
+  int top = lua_gettop(to);
+  if (luaW_transfer<Example>(L, to, stuck) || lua_gettop(to) != top || luaL_dostring(L, "assert(stuck.callback == print)") != 0) {
+    std::cout << "FAIL: luaW_transfer with uncopyable storage\n";
+    ++failures;
+  }
+  if (!luaW_transfer<Example>(L, to, moving)) {
+    std::cout << "FAIL: luaW_transfer\n";
+    lua_close(to);
+    return failures + 1;
+  }
+  lua_setglobal(to, "moved");
+  if (luaL_dostring(to, "assert(moved:GetInteger() == 5 and moved.name == 'moved' and moved.data[3][1] == 3 and moved.cycle.self == moved.cycle)") != 0) {
+    std::cout << "FAIL: luaW_transfer storage: " << lua_tostring(to, -1) << "\n";
+    lua_pop(to, 1);
+    ++failures;
+  }
+  if (luaL_dostring(L, "assert(not pcall(function() return moving:GetInteger() end)) assert(moving.name == nil)") != 0) {
+    std::cout << "FAIL: luaW_transfer source cleanup: " << lua_tostring(L, -1) << "\n";
+    lua_pop(L, 1);
+    ++failures;
+  }
+  luaL_dostring(L, "moving = nil stuck = nil");
+  // The hold moved with the object, so closing the destination state deletes it
+  lua_close(to);
+  if (failures == 0) std::cout << "PASS: luaW_transfer between states\n";
+  return failures;
+}
+
+static void saveExample(luaU_SnapshotWriter& out, Example* example) {
+  out.write(example->integer);
+}
+
+static Example* loadExample(lua_State*, luaU_SnapshotReader& in) {
+  Example* example = new Example();
+  example->integer = in.read<int>();
+  return example;
+}
+
+static int testSnapshot(lua_State* L) {
+  int failures = 0;
+  luaU_Snapshot snapshot;
+  snapshot.addtype<Example, saveExample, loadExample>();
+  luaL_dostring(L, "a = Example.new() a:SetInteger(3) a.name = 'a' a.tags = { 'x', 'y', n = 1.5 } a.alias = a.tags a.callback = print b = Example.new() b.name = 'b' a.other = b b.other = a");
+  lua_gc(L, LUA_GCCOLLECT, 0);
+  std::string bytes = snapshot.save(L);
+  luaL_dostring(L, "a = nil b = nil");
+
+  lua_State* restored = luaL_newstate();
+  luaL_openlibs(restored);
+  luaopen_Example(restored);
+  int top = lua_gettop(restored);
+  if (snapshot.restore(restored, bytes.data(), bytes.size() - 1) || lua_gettop(restored) != top) {
+    std::cout << "FAIL: luaU_Snapshot truncated data\n";
+    ++failures;
+  }
+  if (!snapshot.restore(restored, bytes.data(), bytes.size())) {
+    std::cout << "FAIL: luaU_Snapshot restore\n";
+    ++failures;
+  } else {
+    lua_setglobal(restored, "objs");
+    const char* check =
+        "local a\n"
+        "for _, obj in pairs(objs) do if obj.name == 'a' then a = obj end end\n"
+        "assert(#objs == 2 and a:GetInteger() == 3 and a.tags[2] == 'y' and a.tags.n == 1.5)\n"
+        "assert(a.alias == a.tags and a.other.name == 'b' and a.other.other == a and a.callback == nil)";
+    if (luaL_dostring(restored, check) != 0) {
+      std::cout << "FAIL: luaU_Snapshot contents: " << lua_tostring(restored, -1) << "\n";
+      ++failures;
+    }
+  }
+  // The restored objects were held, so closing the state deletes them
+  lua_close(restored);
+
+  // An object Lua does not hold, with a float key and tables nested deeper
+  // than a snapshot keeps
+  lua_State* source = luaL_newstate();
+  luaL_openlibs(source);
+  luaopen_Example(source);
+  Example loose;
+  luaW_push<Example>(source, &loose);
+  lua_setglobal(source, "loose");
+  luaL_dostring(source, "loose.t = { [2.25] = true } local d = {} loose.deep = d for i = 1, 300 do d.next = {} d = d.next end");
+  std::string unheld = snapshot.save(source);
+  luaW_invalidate<Example>(source, &loose);
+  lua_close(source);
+  restored = luaL_newstate();
+  luaL_openlibs(restored);
+  luaopen_Example(restored);
+  if (!snapshot.restore(restored, unheld.data(), unheld.size())) {
+    std::cout << "FAIL: luaU_Snapshot nesting limit\n";
+    ++failures;
+  } else {
+    lua_rawgeti(restored, -1, 1);
+    Example* obj = luaW_to<Example>(restored, -1);
+    lua_setglobal(restored, "obj");
+    lua_pop(restored, 1);
+    luaL_dostring(restored, "local n, d = 0, obj.deep while d do n, d = n + 1, d.next end return n, obj.t[2.25]");
+    if (lua_tointeger(restored, -2) < 100 || lua_tointeger(restored, -2) >= 300 || !lua_toboolean(restored, -1)) {
+      std::cout << "FAIL: luaU_Snapshot nested tables\n";
+      ++failures;
+    }
+    lua_pop(restored, 2);
+    luaW_invalidate<Example>(restored, obj);
+    delete obj;
+  }
+
+  // Nil and NaN keys are rejected, and objects created for a failed restore
+  // that Lua would not have held are deleted
+  double key = 2.25;
+  std::string pattern(1, 4);
+  pattern.append(reinterpret_cast<const char*>(&key), sizeof(key));
+  size_t keyat = unheld.find(pattern);
+  std::string nankey = unheld;
+  double nan = std::numeric_limits<double>::quiet_NaN();
+  nankey.replace(keyat + 1, sizeof(nan), reinterpret_cast<const char*>(&nan), sizeof(nan));
+  std::string nilkey = unheld;
+  nilkey.replace(keyat, pattern.size(), 1, 0);
+  void (*deallocator)(lua_State*, Example*) = LuaWrapper<Example>::deallocator;
+  static int deleted;
+  deleted = 0;
+  LuaWrapper<Example>::deallocator = [](lua_State*, Example* obj) {
+    ++deleted;
+    delete obj;
+  };
+  bool nanrestored = snapshot.restore(restored, nankey.data(), nankey.size());
+  bool nilrestored = snapshot.restore(restored, nilkey.data(), nilkey.size());
+  bool truncatedrestored = snapshot.restore(restored, unheld.data(), unheld.size() - 1);
+  LuaWrapper<Example>::deallocator = deallocator;
+  if (keyat == std::string::npos || nanrestored || nilrestored || truncatedrestored || deleted != 3) {
+    std::cout << "FAIL: luaU_Snapshot malformed keys\n";
+    ++failures;
+  }
+  lua_close(restored);
+  if (failures == 0) std::cout << "PASS: luaU_Snapshot save and restore\n";
+  return failures;
+}
+
+static std::string dumpChunk(lua_State* L, const char* chunk) {
+  std::string bytecode;
+  luaL_loadstring(L, chunk);
+#if LUA_VERSION_NUM >= 503
+  lua_dump(L, luaU_bytecodewriter, &bytecode, 0);
+#else
+  lua_dump(L, luaU_bytecodewriter, &bytecode);
+#endif
+  lua_pop(L, 1);
+  return bytecode;
+}
+
+static int testLoadCached(lua_State* L) {
+  int failures = 0;
+  std::filesystem::path dir = std::filesystem::temp_directory_path() / ("luawrapper-test-" + std::to_string(LUA_VERSION_NUM));
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+  std::string script = (dir / "script.lua").string();
+  std::string cache = (dir / "cache").string();
+  FILE* file = fopen(script.c_str(), "wb");
+  fputs("return 'source'", file);
+  fclose(file);
+
+  // The first load compiles the script and writes exactly one cache entry
+  if (luaU_loadcached(L, script.c_str(), cache.c_str()) != 0 || lua_pcall(L, 0, 1, 0) != 0 || strcmp(lua_tostring(L, -1), "source") != 0) {
+    std::cout << "FAIL: luaU_loadcached from source\n";
+    ++failures;
+  }
+  lua_pop(L, 1);
+  std::vector<std::filesystem::path> entries;
+  for (const std::filesystem::directory_entry& entry : std::filesystem::directory_iterator(cache)) entries.push_back(entry.path());
+  if (entries.size() != 1) {
+    std::cout << "FAIL: luaU_loadcached cache entry\n";
+    std::filesystem::remove_all(dir);
+    return failures + 1;
+  }
+
+  // Swap the cached bytecode for a different chunk to see that it is used
+  std::string contents;
+  {
+    luaU_FileContents entry(entries[0].string());
+    contents.assign(entry.data(), sizeof(luaU_BytecodeHeader));
+  }
+  contents += dumpChunk(L, "return 'cached'");
+  file = fopen(entries[0].string().c_str(), "wb");
+  fwrite(contents.data(), 1, contents.size(), file);
+  fclose(file);
+  if (luaU_loadcached(L, script.c_str(), cache.c_str()) != 0 || lua_pcall(L, 0, 1, 0) != 0 || strcmp(lua_tostring(L, -1), "cached") != 0) {
+    std::cout << "FAIL: luaU_loadcached from cache\n";
+    ++failures;
+  }
+  lua_pop(L, 1);
+
+  // A corrupt entry falls back to the source
+  file = fopen(entries[0].string().c_str(), "wb");
+  fwrite(contents.data(), 1, sizeof(luaU_BytecodeHeader) + 3, file);
+  fclose(file);
+  if (luaU_loadcached(L, script.c_str(), cache.c_str()) != 0 || lua_pcall(L, 0, 1, 0) != 0 || strcmp(lua_tostring(L, -1), "source") != 0) {
+    std::cout << "FAIL: luaU_loadcached with a corrupt entry\n";
+    ++failures;
+  }
+  lua_pop(L, 1);
+
+  // A shebang line is skipped without shifting the line numbers
+  file = fopen(script.c_str(), "wb");
+  fputs("#!/usr/bin/env lua\nreturn debug.getinfo(1, 'l').currentline", file);
+  fclose(file);
+  if (luaU_loadcached(L, script.c_str(), cache.c_str()) != 0 || lua_pcall(L, 0, 1, 0) != 0 || lua_tointeger(L, -1) != 2) {
+    std::cout << "FAIL: luaU_loadcached with a shebang line\n";
+    ++failures;
+  }
+  lua_pop(L, 1);
+
+  if (luaU_loadcached(L, (dir / "missing.lua").string().c_str(), cache.c_str()) != LUA_ERRFILE || !strstr(lua_tostring(L, -1), strerror(ENOENT))) {
+    std::cout << "FAIL: luaU_loadcached missing file\n";
+    ++failures;
+  }
+  lua_pop(L, 1);
+  std::filesystem::remove_all(dir);
+  if (failures == 0) std::cout << "PASS: luaU_loadcached bytecode cache\n";
+  return failures;
+}
+
+static int testReload(lua_State* L) {
+  int failures = 0;
+  luaL_dostring(L, "e = Example.new() e:SetInteger(4) e.x = 5 f = Example.new() f.override = function() return 'storage' end");
+  luaU_MethodRef<Example, std::string()> greet(L, "greet");
+  lua_getglobal(L, "e");
+  Example* e = luaW_check<Example>(L, -1);
+  lua_pop(L, 1);
+
+  const char* v1 = "function Example.metatable:greet() return 'v1' end\n"
+                   "function Example.metatable:old() return 1 end\n"
+                   "function Example.metatable:GetInteger() return -1 end";
+  if (luaL_loadstring(L, v1) || luaU_reload(L, "greet") != 0 || luaL_dostring(L, "assert(e:greet() == 'v1' and e:old() == 1 and e:GetInteger() == -1)") != 0 || greet.call(e) != std::optional<std::string>("v1")) {
+    std::cout << "FAIL: luaU_reload first version\n";
+    ++failures;
+  }
+
+  // Methods missing from the new version go away, replaced C++ methods come
+  // back, and the objects keep their storage
+  int top = lua_gettop(L);
+  luaL_loadstring(L, "function Example.metatable:greet() return 'v2' end");
+  if (luaU_reload(L, "greet") != 0 || lua_gettop(L) != top || luaL_dostring(L, "assert(e:greet() == 'v2' and e.old == nil and e:GetInteger() == 4 and e.x == 5 and f:override() == 'storage')") != 0 || greet.call(e) != std::optional<std::string>("v2")) {
+    std::cout << "FAIL: luaU_reload second version\n";
+    ++failures;
+  }
+
+  // A version that fails leaves the previous one in place
+  luaL_loadstring(L, "function Example.metatable:greet() return 'v3' end\nfunction Example.metatable:extra() end\nerror('boom')");
+  if (luaU_reload(L, "greet") == 0 || !strstr(lua_tostring(L, -1), "boom") || lua_gettop(L) != top + 1) {
+    std::cout << "FAIL: luaU_reload error\n";
+    ++failures;
+  }
+  lua_settop(L, top);
+  if (luaL_dostring(L, "assert(e:greet() == 'v2' and e.extra == nil)") != 0 || greet.call(e) != std::optional<std::string>("v2")) {
+    std::cout << "FAIL: luaU_reload rollback\n";
+    ++failures;
+  }
+
+  // Reloading an empty version takes everything out again
+  luaL_loadstring(L, "");
+  if (luaU_reload(L, "greet") != 0 || luaL_dostring(L, "assert(e.greet == nil and e:GetInteger() == 4)") != 0) {
+    std::cout << "FAIL: luaU_reload empty version\n";
+    ++failures;
+  }
+  luaL_dostring(L, "e = nil f = nil");
+  if (failures == 0) std::cout << "PASS: luaU_reload hot reload\n";
+  return failures;
+}
+
+// A three level hierarchy for testing flattened method tables.
+struct Animal {
+  virtual ~Animal() {}
+};
+struct Dog : Animal {};
+struct Puppy : Dog {};
+
+static int animalSound(lua_State* L) {
+  lua_pushstring(L, "animal");
+  return 1;
+}
+static int animalLegs(lua_State* L) {
+  lua_pushinteger(L, 4);
+  return 1;
+}
+static int dogSound(lua_State* L) {
+  lua_pushstring(L, "woof");
+  return 1;
+}
+
+static int testFlatten(lua_State* L) {
+  int failures = 0;
+  static const luaL_Reg animalMethods[] = {{"sound", animalSound}, {"legs", animalLegs}, {NULL, NULL}};
+  static const luaL_Reg dogMethods[] = {{"sound", dogSound}, {NULL, NULL}};
+  luaW_register<Animal>(L, "Animal", NULL, animalMethods);
+  luaW_register<Dog>(L, "Dog", NULL, dogMethods);
+  luaW_register<Puppy>(L, "Puppy", NULL, NULL);
+  lua_pop(L, 3);
+  luaW_deferdestruction<Dog>(L);
+  luaW_extend<Puppy, Dog>(L, true);
+  luaW_extend<Dog, Animal>(L);
+
+  // Puppy was flattened before Dog was extended, and still sees Animal's
+  // methods without a metatable miss
+  const char* check =
+      "local mt = Puppy.metatable\n"
+      "assert(rawget(mt, 'sound') == rawget(Dog.metatable, 'sound') and rawget(mt, 'legs') == rawget(Animal.metatable, 'legs'))\n"
+      "assert(rawget(mt, '__gc') ~= rawget(Dog.metatable, '__gc') and rawget(Dog.metatable, 'legs') == nil)\n"
+      "local p = Puppy.new() assert(p:sound() == 'woof' and p:legs() == 4)";
+  if (luaL_dostring(L, check) != 0) {
+    std::cout << "FAIL: luaW_flatten: " << lua_tostring(L, -1) << "\n";
+    lua_pop(L, 1);
+    ++failures;
+  }
+
+  // Flags LuaWrapper keeps in a metatable are not inherited
+  luaL_getmetatable(L, "Puppy");
+  lua_pushlightuserdata(L, luaW_releasequeuekey());
+  lua_rawget(L, -2);
+  if (lua_toboolean(L, -1)) {
+    std::cout << "FAIL: luaW_flatten copied deferred destruction\n";
+    ++failures;
+  }
+  lua_pop(L, 2);
+
+  // Methods added to a base later are picked up after luaW_reflatten, and
+  // methods defined on the derived type itself are left alone
+  luaL_dostring(L, "function Animal.metatable:name() return 'animal' end function Puppy.metatable:legs() return 3 end");
+  luaW_reflatten(L);
+  if (luaL_dostring(L, "local p = Puppy.new() assert(rawget(Puppy.metatable, 'name') and p:name() == 'animal' and p:legs() == 3)") != 0) {
+    std::cout << "FAIL: luaW_reflatten: " << lua_tostring(L, -1) << "\n";
+    lua_pop(L, 1);
+    ++failures;
+  }
+  luaL_dostring(L, "Puppy.metatable.legs = nil Animal.metatable.name = nil");
+  luaW_reflatten(L);
+  if (luaL_dostring(L, "local p = Puppy.new() assert(p.name == nil and p:legs() == 4)") != 0) {
+    std::cout << "FAIL: luaW_reflatten removal: " << lua_tostring(L, -1) << "\n";
+    lua_pop(L, 1);
+    ++failures;
+  }
+  if (failures == 0) std::cout << "PASS: flattened method tables\n";
+  return failures;
+}
+
+// An object whose real footprint includes a buffer it owns.
+struct Tenant {
+  std::vector<char> buffer = std::vector<char>(1000);
+};
+
+struct Subtenant : Tenant {
+  int lease = 0;
+};
+
+static size_t tenantSize(const Tenant* tenant) { return sizeof(Tenant) + tenant->buffer.size(); }
+
+// A type charged sizeof(Lodger), which counts how often it is allocated.
+struct Lodger {
+  static int allocations;
+  int room = 0;
+};
+
+int Lodger::allocations = 0;
+
+static Lodger* allocateLodger(lua_State*) {
+  ++Lodger::allocations;
+  return new Lodger();
+}
+
+static int testMemoryQuota(lua_State* L) {
+  int failures = 0;
+  const size_t size = sizeof(Tenant) + 1000;
+  luaW_register<Tenant>(L, "Tenant", NULL, NULL);
+  luaW_register<Subtenant>(L, "Subtenant", NULL, NULL);
+  lua_pop(L, 2);
+  luaW_extend<Subtenant, Tenant>(L);
+  luaW_trackmemory<Tenant, tenantSize>(L, 2 * size, 4 * size);
+
+  luaL_dostring(L, "tenants = {} for i = 1, 4 do tenants[i] = Tenant.new() end");
+  luaW_MemoryAccount* account = luaW_memoryaccount(L);
+  const luaW_MemoryUsage& usage = account->types["Tenant"];
+  if (usage.bytes != 4 * size || usage.objects != 4 || account->total.bytes != 4 * size) {
+    std::cout << "FAIL: luaW_trackmemory accounting\n";
+    ++failures;
+  }
+
+  // The hard limit refuses new objects until the old ones are garbage
+  if (luaL_dostring(L, "assert(not pcall(Tenant.new)) tenants[1]:dispose() tenants[1] = Tenant.new() assert(not pcall(Tenant.newn, 1))") != 0) {
+    std::cout << "FAIL: luaW_trackmemory hard limit: " << lua_tostring(L, -1) << "\n";
+    lua_pop(L, 1);
+    ++failures;
+  }
+  if (luaL_dostring(L, "tenants = nil assert(#Tenant.newn(4) == 4)") != 0 || usage.objects > 4 || usage.peak != 4 * size) {
+    std::cout << "FAIL: luaW_trackmemory collection\n";
+    ++failures;
+  }
+  lua_gc(L, LUA_GCCOLLECT, 0);
+  if (usage.bytes != 0 || usage.objects != 0) {
+    std::cout << "FAIL: luaW_trackmemory refunds\n";
+    ++failures;
+  }
+
+  // Types extending a tracked type are charged to it
+  if (luaL_dostring(L, "subtenants = {} for i = 1, 4 do subtenants[i] = Subtenant.new() end assert(not pcall(Subtenant.new))") != 0 || usage.bytes != 4 * size || usage.objects != 4) {
+    std::cout << "FAIL: luaW_trackmemory derived types\n";
+    ++failures;
+  }
+  luaL_dostring(L, "subtenants = nil");
+  lua_gc(L, LUA_GCCOLLECT, 0);
+
+  // Arrays are charged as a whole, refunded when their block is freed, and
+  // refused over the hard limit
+  if (luaL_dostring(L, "tenants = Tenant.newarray(3) assert(not pcall(Tenant.newarray, 2))") != 0 || usage.bytes != 3 * size || usage.objects != 3) {
+    std::cout << "FAIL: luaW_trackmemory arrays\n";
+    ++failures;
+  }
+  luaL_dostring(L, "tenants = nil");
+  lua_gc(L, LUA_GCCOLLECT, 0);
+  if (usage.bytes != 0 || usage.objects != 0) {
+    std::cout << "FAIL: luaW_trackmemory array refunds\n";
+    ++failures;
+  }
+
+  // Objects held from C++ are counted but never refused, and the state's
+  // total limit applies across types
+  luaW_setmemorylimits(L, 0, size);
+  Tenant* held[2] = {new Tenant(), new Tenant()};
+  for (Tenant* tenant : held) {
+    luaW_push<Tenant>(L, tenant);
+    luaW_hold<Tenant>(L, tenant);
+  }
+  if (account->total.bytes != 2 * size || luaL_dostring(L, "return Tenant.new()") == 0) {
+    std::cout << "FAIL: luaW_setmemorylimits\n";
+    ++failures;
+  }
+  lua_pop(L, 3);
+  luaW_setmemorylimits(L, 0, 0);
+  lua_gc(L, LUA_GCCOLLECT, 0);
+
+  // Types charged sizeof(T) are refused before the allocator runs, and a
+  // type is charged once it is tracked even if it was created untracked before
+  luaW_register<Lodger>(L, "Lodger", NULL, NULL, allocateLodger);
+  lua_pop(L, 1);
+  luaL_dostring(L, "Lodger.new()");
+  luaW_trackmemory<Lodger>(L, 0, 2 * sizeof(Lodger));
+  if (luaL_dostring(L, "lodgers = {Lodger.new(), Lodger.new()} assert(not pcall(Lodger.new)) assert(not pcall(Lodger.newn, 1))") != 0 || Lodger::allocations != 3 || account->types["Lodger"].objects != 2) {
+    std::cout << "FAIL: luaW_trackmemory checks before allocating\n";
+    ++failures;
+  }
+  luaL_dostring(L, "lodgers = nil");
+  lua_gc(L, LUA_GCCOLLECT, 0);
+  if (failures == 0) std::cout << "PASS: memory accounting and quotas\n";
+  return failures;
+}
+
 int main(int argc, const char* argv[]) {
   lua_State* L = luaL_newstate();
   luaL_openlibs(L);
   luaopen_BankAccount(L);
+  luaopen_Example(L);
   int failures = testPushLuaInteger(L);
+  failures += testPushShared(L);
+  failures += testContainers(L);
+  failures += testStrings(L);
+  failures += testFieldKeys(L);
+  failures += testBuildFields(L);
+  failures += testNewN(L);
+  failures += testNewArray(L);
+  failures += testDeferredDestruction(L);
+  failures += testDispose(L);
+  failures += testInvalidate(L);
+  failures += testHandleIdentifier(L);
+  failures += testSoa(L);
+  failures += testGatherScatter(L);
+  failures += testNumArray(L);
+  failures += testViews(L);
+  failures += testMethodRef(L);
+  failures += testForEachCall(L);
+#ifdef LUAU_TASKS
+  failures += testTasks(L);
+#endif
+  failures += testActor(L);
+  failures += testTransfer(L);
+  failures += testSnapshot(L);
+  failures += testLoadCached(L);
+  failures += testReload(L);
+  failures += testFlatten(L);
+  failures += testMemoryQuota(L);
   if (luaL_dofile(L, kTestFile)) std::cout << lua_tostring(L, -1) << std::endl;
   lua_close(L);
   return failures == 0 ? 0 : 1;